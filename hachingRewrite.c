@@ -1,11 +1,39 @@
+// Build: gcc -O2 hachingRewrite.c -o hachingRewrite -lmpg123 -lfftw3 -lfftw3f -lsqlite3 -lm -pthread
+// Live ALSA capture: add -DHACHING_ALSA -lasound
+// Metrics (--stats, --metrics): add -DHACHING_METRICS
+
+#include <ctype.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <fftw3.h>
+#include <limits.h>
 #include <math.h>
 #include <mpg123.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sqlite3.h>
+#include <stdatomic.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <time.h>
+#include <unistd.h>
+
+#ifdef HACHING_ALSA
+#include <alsa/asoundlib.h>
+#endif
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#endif
 
 typedef struct {
   short *samples;
@@ -14,226 +42,5471 @@ typedef struct {
   int channels;
 } AudioData;
 
-int extract_mp3_samples(const char *filename, AudioData *audio_data) {
-  mpg123_handle *mh;
-  unsigned char *buffer;
-  size_t buffer_size;
-  size_t done;
-  int err;
+// Called once per fixed-size block of interleaved PCM while the file is still
+// being decoded. Return non-zero to stop decoding early.
+typedef int (*pcm_block_callback)(const AudioData *block, void *user);
 
-  int channels, encoding;
-  long rate;
+// Hot-path instrumentation, compiled in with -DHACHING_METRICS and away to
+// nothing otherwise. Every thread owns a cache-line-aligned shard of
+// counters and log2 histograms, found through a thread-local pointer, so an
+// update is a plain load and store with no lock prefix and no sharing.
+// Readers sum all shards with relaxed loads; a shard outlives its thread so
+// totals never go backwards. Exported by --stats (a periodic line on stderr)
+// and --metrics (Prometheus text, rewritten on each tick and at exit).
+#ifdef HACHING_METRICS
+#define METRIC_BUCKETS 32 // bucket b holds values below 2^b
 
-  // Initialize mpg123
-  if (mpg123_init() != MPG123_OK) {
-    fprintf(stderr, "Failed to initialize mpg123\n");
+typedef enum {
+  COUNTER_PCM_FRAMES, // decoded or captured
+  COUNTER_TRACKS,
+  COUNTER_ANALYSED_FRAMES,
+  COUNTER_DB_ROWS,
+  COUNTER_LOOKUPS,
+  COUNTER_MATCHES,
+  METRIC_COUNTERS
+} metric_counter;
+
+typedef enum {
+  HISTOGRAM_DECODE_US,  // one whole track
+  HISTOGRAM_FFT_US,     // one STFT batch
+  HISTOGRAM_DB_US,      // one track's transaction, lock wait included
+  HISTOGRAM_CANDIDATES, // postings returned by one index lookup
+  HISTOGRAM_MATCH_US,   // query start to decision
+  METRIC_HISTOGRAMS
+} metric_histogram;
+
+typedef struct MetricsShard {
+  _Atomic uint64_t counters[METRIC_COUNTERS];
+  _Atomic uint64_t buckets[METRIC_HISTOGRAMS][METRIC_BUCKETS];
+  _Atomic uint64_t sums[METRIC_HISTOGRAMS];
+  struct MetricsShard *next;
+} MetricsShard;
+
+_Atomic(MetricsShard *) metrics_shards;
+__thread MetricsShard *metrics_local;
+
+MetricsShard *metrics_shard(void) {
+  if (metrics_local == NULL) {
+    void *mem;
+    if (posix_memalign(&mem, 64, sizeof(MetricsShard)) != 0) {
+      return NULL;
+    }
+    MetricsShard *shard = memset(mem, 0, sizeof(MetricsShard));
+    shard->next = atomic_load(&metrics_shards);
+    while (!atomic_compare_exchange_weak(&metrics_shards, &shard->next,
+                                         shard)) {
+    }
+    metrics_local = shard;
+  }
+  return metrics_local;
+}
+
+// Only the owning thread writes a shard, so load + store is enough
+void metric_bump(_Atomic uint64_t *slot, uint64_t n) {
+  atomic_store_explicit(
+      slot, atomic_load_explicit(slot, memory_order_relaxed) + n,
+      memory_order_relaxed);
+}
+
+void metrics_count(metric_counter counter, uint64_t n) {
+  MetricsShard *shard = metrics_shard();
+  if (shard != NULL) {
+    metric_bump(&shard->counters[counter], n);
+  }
+}
+
+void metrics_observe(metric_histogram histogram, uint64_t value) {
+  MetricsShard *shard = metrics_shard();
+  if (shard == NULL) {
+    return;
+  }
+  int bucket = value == 0 ? 0 : 64 - __builtin_clzll(value);
+  if (bucket >= METRIC_BUCKETS) {
+    bucket = METRIC_BUCKETS - 1;
+  }
+  metric_bump(&shard->buckets[histogram][bucket], 1);
+  metric_bump(&shard->sums[histogram], value);
+}
+
+uint64_t metrics_since_us(const struct timespec *start) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)(now.tv_sec - start->tv_sec) * 1000000 +
+         (now.tv_nsec - start->tv_nsec) / 1000;
+}
+
+// Totals over every shard, for export.
+typedef struct {
+  uint64_t counters[METRIC_COUNTERS];
+  uint64_t buckets[METRIC_HISTOGRAMS][METRIC_BUCKETS];
+  uint64_t sums[METRIC_HISTOGRAMS];
+} MetricsSnapshot;
+
+typedef struct {
+  const char *name;  // Prometheus name, without the hachingrewrite_ prefix
+  const char *label; // short name for the stats line
+  const char *help;
+} MetricInfo;
+
+const MetricInfo counter_info[METRIC_COUNTERS] = {
+    {"pcm_frames", "pcm frames", "PCM frames decoded or captured"},
+    {"tracks", "tracks", "Tracks decoded"},
+    {"analysed_frames", "analysed frames", "Frames turned into band energies"},
+    {"db_rows", "rows", "Sub-fingerprints stored in fingerprint.db"},
+    {"lookups", "lookups", "Index lookups, flipped variants included"},
+    {"matches", "matches", "Queries decided"},
+};
+
+// Histogram values are in microseconds unless the scale says otherwise
+const MetricInfo histogram_info[METRIC_HISTOGRAMS] = {
+    {"decode_seconds", "decode", "Time to decode one whole track"},
+    {"fft_seconds", "fft", "Time for one STFT batch"},
+    {"db_track_seconds", "db", "Time to store one track, lock wait included"},
+    {"query_candidates", "candidates", "Postings returned by one index lookup"},
+    {"match_seconds", "match", "Time from query start to decision"},
+};
+
+const double histogram_scale[METRIC_HISTOGRAMS] = {1e-6, 1e-6, 1e-6, 1, 1e-6};
+
+void metrics_snapshot(MetricsSnapshot *snap) {
+  memset(snap, 0, sizeof(*snap));
+  for (MetricsShard *shard = atomic_load(&metrics_shards); shard != NULL;
+       shard = shard->next) {
+    for (int c = 0; c < METRIC_COUNTERS; c++) {
+      snap->counters[c] +=
+          atomic_load_explicit(&shard->counters[c], memory_order_relaxed);
+    }
+    for (int h = 0; h < METRIC_HISTOGRAMS; h++) {
+      for (int b = 0; b < METRIC_BUCKETS; b++) {
+        snap->buckets[h][b] +=
+            atomic_load_explicit(&shard->buckets[h][b], memory_order_relaxed);
+      }
+      snap->sums[h] +=
+          atomic_load_explicit(&shard->sums[h], memory_order_relaxed);
+    }
+  }
+}
+
+// Writes the snapshot in the Prometheus text format. The file is replaced
+// by rename, so a scraper never reads half of it.
+int metrics_write_prometheus(const char *path, const MetricsSnapshot *snap) {
+  char tmp[PATH_MAX];
+  snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+  FILE *fp = fopen(tmp, "w");
+  if (fp == NULL) {
+    fprintf(stderr, "Unable to write %s: %s\n", tmp, strerror(errno));
+    return -1;
+  }
+
+  for (int c = 0; c < METRIC_COUNTERS; c++) {
+    const char *name = counter_info[c].name;
+    fprintf(fp, "# HELP hachingrewrite_%s_total %s\n", name,
+            counter_info[c].help);
+    fprintf(fp, "# TYPE hachingrewrite_%s_total counter\n", name);
+    fprintf(fp, "hachingrewrite_%s_total %llu\n", name,
+            (unsigned long long)snap->counters[c]);
+  }
+  for (int h = 0; h < METRIC_HISTOGRAMS; h++) {
+    const char *name = histogram_info[h].name;
+    double scale = histogram_scale[h];
+    fprintf(fp, "# HELP hachingrewrite_%s %s\n", name, histogram_info[h].help);
+    fprintf(fp, "# TYPE hachingrewrite_%s histogram\n", name);
+    uint64_t cumulative = 0;
+    for (int b = 0; b < METRIC_BUCKETS - 1; b++) {
+      cumulative += snap->buckets[h][b];
+      fprintf(fp, "hachingrewrite_%s_bucket{le=\"%g\"} %llu\n", name,
+              (double)((1ull << b) - 1) * scale,
+              (unsigned long long)cumulative);
+    }
+    cumulative += snap->buckets[h][METRIC_BUCKETS - 1];
+    fprintf(fp, "hachingrewrite_%s_bucket{le=\"+Inf\"} %llu\n", name,
+            (unsigned long long)cumulative);
+    fprintf(fp, "hachingrewrite_%s_sum %g\n", name, snap->sums[h] * scale);
+    fprintf(fp, "hachingrewrite_%s_count %llu\n", name,
+            (unsigned long long)cumulative);
+  }
+
+  if (fclose(fp) != 0 || rename(tmp, path) != 0) {
+    fprintf(stderr, "Unable to write %s: %s\n", path, strerror(errno));
+    return -1;
+  }
+  return 0;
+}
+
+// Upper bound of the bucket holding the pct-th percentile of the
+// observations made between two snapshots, in the histogram's units.
+double metrics_percentile(const MetricsSnapshot *prev,
+                          const MetricsSnapshot *cur, int h, int pct) {
+  uint64_t total = 0;
+  for (int b = 0; b < METRIC_BUCKETS; b++) {
+    total += cur->buckets[h][b] - prev->buckets[h][b];
+  }
+  uint64_t rank = (pct * total + 99) / 100;
+  uint64_t seen = 0;
+  for (int b = 0; b < METRIC_BUCKETS; b++) {
+    seen += cur->buckets[h][b] - prev->buckets[h][b];
+    if (seen >= rank && seen > 0) {
+      return (double)((1ull << b) - 1);
+    }
+  }
+  return 0;
+}
+
+// One line of interval totals, with rates for the frame counters and
+// percentiles for every histogram that saw observations, on stderr.
+void metrics_print_stats(const MetricsSnapshot *prev,
+                         const MetricsSnapshot *cur, double seconds) {
+  fprintf(stderr, "stats:");
+  for (int c = 0; c < METRIC_COUNTERS; c++) {
+    uint64_t delta = cur->counters[c] - prev->counters[c];
+    if (c == COUNTER_PCM_FRAMES || c == COUNTER_ANALYSED_FRAMES) {
+      fprintf(stderr, "%s %.0f %s/s", c ? "," : "", delta / seconds,
+              counter_info[c].label);
+    } else {
+      fprintf(stderr, ", %llu %s", (unsigned long long)delta,
+              counter_info[c].label);
+    }
+  }
+  for (int h = 0; h < METRIC_HISTOGRAMS; h++) {
+    uint64_t observed = 0;
+    for (int b = 0; b < METRIC_BUCKETS; b++) {
+      observed += cur->buckets[h][b] - prev->buckets[h][b];
+    }
+    if (observed == 0) {
+      continue;
+    }
+    const char *unit = histogram_scale[h] == 1 ? "" : " us";
+    fprintf(stderr, "; %s p50<=%.0f%s p99<=%.0f%s", histogram_info[h].label,
+            metrics_percentile(prev, cur, h, 50), unit,
+            metrics_percentile(prev, cur, h, 99), unit);
+  }
+  fprintf(stderr, "\n");
+}
+
+// Background exporter for --stats and --metrics.
+typedef struct {
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t wake;
+  int active;
+  int stop;
+  double interval; // seconds between ticks, 0 to export only at the end
+  const char *prometheus_path;
+  MetricsSnapshot last;
+  struct timespec last_time;
+} MetricsExporter;
+
+MetricsExporter metrics_exporter = {.lock = PTHREAD_MUTEX_INITIALIZER,
+                                    .wake = PTHREAD_COND_INITIALIZER};
+
+void metrics_tick(MetricsExporter *ex) {
+  MetricsSnapshot now;
+  struct timespec when;
+  metrics_snapshot(&now);
+  clock_gettime(CLOCK_MONOTONIC, &when);
+  double seconds = (when.tv_sec - ex->last_time.tv_sec) +
+                   (when.tv_nsec - ex->last_time.tv_nsec) / 1e9;
+
+  if (ex->interval > 0 && seconds > 0) {
+    metrics_print_stats(&ex->last, &now, seconds);
+  }
+  if (ex->prometheus_path) {
+    metrics_write_prometheus(ex->prometheus_path, &now);
+  }
+  ex->last = now;
+  ex->last_time = when;
+}
+
+void *metrics_exporter_main(void *arg) {
+  MetricsExporter *ex = arg;
+  pthread_mutex_lock(&ex->lock);
+  while (!ex->stop) {
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    double whole = floor(ex->interval);
+    deadline.tv_sec += (time_t)whole;
+    deadline.tv_nsec += (long)((ex->interval - whole) * 1e9);
+    if (deadline.tv_nsec >= 1000000000) {
+      deadline.tv_sec++;
+      deadline.tv_nsec -= 1000000000;
+    }
+    if (pthread_cond_timedwait(&ex->wake, &ex->lock, &deadline) ==
+            ETIMEDOUT &&
+        !ex->stop) {
+      metrics_tick(ex);
+    }
+  }
+  pthread_mutex_unlock(&ex->lock);
+  return NULL;
+}
+
+// Nothing is exported unless an interval or a path is given.
+int metrics_start(double interval, const char *prometheus_path) {
+  MetricsExporter *ex = &metrics_exporter;
+  if (interval <= 0 && prometheus_path == NULL) {
+    return 0;
+  }
+  ex->active = 1;
+  ex->interval = interval;
+  ex->prometheus_path = prometheus_path;
+  clock_gettime(CLOCK_MONOTONIC, &ex->last_time);
+  if (interval > 0 &&
+      pthread_create(&ex->thread, NULL, metrics_exporter_main, ex) != 0) {
+    fprintf(stderr, "Unable to start the metrics thread\n");
     return -1;
   }
+  return 0;
+}
+
+// Stops the ticks and exports one last time, so short runs report too.
+void metrics_stop(void) {
+  MetricsExporter *ex = &metrics_exporter;
+  if (!ex->active) {
+    return;
+  }
+  if (ex->interval > 0) {
+    pthread_mutex_lock(&ex->lock);
+    ex->stop = 1;
+    pthread_cond_signal(&ex->wake);
+    pthread_mutex_unlock(&ex->lock);
+    pthread_join(ex->thread, NULL);
+  }
+  metrics_tick(ex);
+}
+
+#define METRIC_COUNT(counter, n) metrics_count(counter, n)
+#define METRIC_OBSERVE(histogram, value) metrics_observe(histogram, value)
+#define METRIC_CLOCK(t)                                                        \
+  struct timespec t;                                                           \
+  clock_gettime(CLOCK_MONOTONIC, &t)
+#define METRIC_OBSERVE_SINCE(histogram, t)                                     \
+  metrics_observe(histogram, metrics_since_us(&t))
+#define METRICS_START(interval, path) metrics_start(interval, path)
+#define METRICS_STOP() metrics_stop()
+#else
+#define METRIC_COUNT(counter, n) ((void)0)
+#define METRIC_OBSERVE(histogram, value) ((void)0)
+#define METRIC_CLOCK(t) ((void)0)
+#define METRIC_OBSERVE_SINCE(histogram, t) ((void)0)
+#define METRICS_START(interval, path) 0
+#define METRICS_STOP() ((void)0)
+#endif
+
+// Bump allocator for per-track scratch. Allocations are 64-byte aligned,
+// which covers AVX-512 loads and everything fftw_malloc promises, so FFT
+// buffers can live here too. arena_reset releases a whole track in O(1). If
+// the track overflowed the current block, the reset swaps the chain for one
+// block that holds all of it, so tracks up to that size never again reach
+// the system allocator.
+#define ARENA_ALIGN 64
+#define ARENA_MIN_BLOCK (1 << 20)
+
+typedef struct ArenaBlock {
+  struct ArenaBlock *prev;
+  size_t capacity;
+  size_t used;
+} ArenaBlock; // the data starts ARENA_ALIGN bytes into the block
+
+typedef struct {
+  ArenaBlock *current;
+  size_t total; // bytes handed out since the last reset, padding included
+  void *last; // most recent allocation, the only one that can grow in place
+} Arena;
+
+size_t arena_round(size_t bytes) {
+  return (bytes + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+}
+
+unsigned char *arena_block_data(ArenaBlock *block) {
+  return (unsigned char *)block + ARENA_ALIGN;
+}
+
+ArenaBlock *arena_new_block(size_t capacity) {
+  void *mem;
+  if (posix_memalign(&mem, ARENA_ALIGN, ARENA_ALIGN + capacity) != 0) {
+    return NULL;
+  }
+  ArenaBlock *block = mem;
+  block->prev = NULL;
+  block->capacity = capacity;
+  block->used = 0;
+  return block;
+}
+
+void arena_free_blocks(ArenaBlock *block) {
+  while (block != NULL) {
+    ArenaBlock *prev = block->prev;
+    free(block);
+    block = prev;
+  }
+}
+
+void arena_destroy(Arena *arena) {
+  arena_free_blocks(arena->current);
+  memset(arena, 0, sizeof(*arena));
+}
+
+void *arena_alloc(Arena *arena, size_t bytes) {
+  size_t size = arena_round(bytes > 0 ? bytes : 1);
+  ArenaBlock *block = arena->current;
+
+  if (block == NULL || block->capacity - block->used < size) {
+    size_t capacity = size > ARENA_MIN_BLOCK ? size : ARENA_MIN_BLOCK;
+    if (block != NULL && capacity < 2 * block->capacity) {
+      capacity = 2 * block->capacity;
+    }
+    ArenaBlock *fresh = arena_new_block(capacity);
+    if (fresh == NULL) {
+      return NULL;
+    }
+    fresh->prev = block;
+    arena->current = block = fresh;
+  }
+
+  void *ptr = arena_block_data(block) + block->used;
+  block->used += size;
+  arena->total += size;
+  arena->last = ptr;
+  return ptr;
+}
+
+// Resizes ptr, which holds old_bytes. The most recent allocation grows or
+// shrinks in place while its block has room; anything else is moved, and
+// the old copy is reclaimed by the next reset.
+void *arena_grow(Arena *arena, void *ptr, size_t old_bytes, size_t new_bytes) {
+  ArenaBlock *block = arena->current;
+
+  if (ptr != NULL && ptr == arena->last) {
+    size_t offset = (unsigned char *)ptr - arena_block_data(block);
+    size_t size = arena_round(new_bytes > 0 ? new_bytes : 1);
+    if (block->capacity - offset >= size) {
+      arena->total = arena->total - (block->used - offset) + size;
+      block->used = offset + size;
+      return ptr;
+    }
+  }
+
+  void *moved = arena_alloc(arena, new_bytes);
+  if (moved != NULL && ptr != NULL) {
+    memcpy(moved, ptr, old_bytes < new_bytes ? old_bytes : new_bytes);
+  }
+  return moved;
+}
+
+void arena_reset(Arena *arena) {
+  ArenaBlock *block = arena->current;
+
+  if (block != NULL && block->prev != NULL) {
+    arena_free_blocks(block);
+    arena->current = arena_new_block(arena->total);
+  } else if (block != NULL) {
+    block->used = 0;
+  }
+  arena->total = 0;
+  arena->last = NULL;
+}
 
-  // Create mpg123 handle
-  mh = mpg123_new(NULL, &err);
+// Creates a decoder handle. mpg123_init must have been called; one handle can
+// be reused for any number of files.
+mpg123_handle *new_mp3_decoder(void) {
+  int err;
+  mpg123_handle *mh = mpg123_new(NULL, &err);
   if (mh == NULL) {
     fprintf(stderr, "Unable to create mpg123 handle: %s\n",
             mpg123_plain_strerror(err));
-    mpg123_exit();
-    return -1;
   }
+  return mh;
+}
+
+// Opens filename on mh and locks the decoder output to signed 16-bit samples.
+// Every successful open must be paired with close_mp3.
+int open_mp3(mpg123_handle *mh, const char *filename, long *rate,
+             int *channels) {
+  int encoding;
 
   // Open the file
   if (mpg123_open(mh, filename) != MPG123_OK) {
     fprintf(stderr, "Unable to open file: %s\n", mpg123_strerror(mh));
-    mpg123_delete(mh);
-    mpg123_exit();
     return -1;
   }
 
   // Get format information
-  if (mpg123_getformat(mh, &rate, &channels, &encoding) != MPG123_OK) {
+  if (mpg123_getformat(mh, rate, channels, &encoding) != MPG123_OK) {
     fprintf(stderr, "Unable to get format information\n");
     mpg123_close(mh);
-    mpg123_delete(mh);
-    mpg123_exit();
     return -1;
   }
 
   // Ensure we're working with 16-bit signed integers
   mpg123_format_none(mh);
-  mpg123_format(mh, rate, channels, MPG123_ENC_SIGNED_16);
+  mpg123_format(mh, *rate, *channels, MPG123_ENC_SIGNED_16);
 
-  // Set up buffer
-  buffer_size = mpg123_outblock(mh);
-  buffer = malloc(buffer_size);
-  if (buffer == NULL) {
-    fprintf(stderr, "Unable to allocate buffer\n");
-    mpg123_close(mh);
-    mpg123_delete(mh);
-    mpg123_exit();
+  return 0;
+}
+
+void close_mp3(mpg123_handle *mh) { mpg123_close(mh); }
+
+// Decodes the next MPEG frame straight into dest, which must have room for at
+// least mpg123_outblock bytes, so the PCM is written exactly once. Returns
+// MPG123_OK, MPG123_DONE at the end of the stream, or an error code.
+int decode_frame_into(mpg123_handle *mh, short *dest, size_t capacity,
+                      size_t *decoded) {
+  unsigned char *audio;
+  size_t bytes = 0;
+  off_t num;
+  int ret;
+
+  *decoded = 0;
+  if (mpg123_replace_buffer(mh, dest, capacity * sizeof(short)) !=
+      MPG123_OK) {
+    return MPG123_ERR;
+  }
+
+  do {
+    ret = mpg123_decode_frame(mh, &num, &audio, &bytes);
+  } while (ret == MPG123_NEW_FORMAT);
+
+  if (ret != MPG123_OK) {
+    return ret;
+  }
+
+  // mpg123 decodes into the replaced buffer; only move if it did not
+  if (audio != (unsigned char *)dest) {
+    memmove(dest, audio, bytes);
+  }
+  *decoded = bytes / sizeof(short);
+
+  return MPG123_OK;
+}
+
+// Decodes all of filename. The samples are allocated from arena and stay
+// valid until it is reset.
+int extract_mp3_samples(mpg123_handle *mh, const char *filename,
+                        AudioData *audio_data, Arena *arena) {
+  size_t frame_samples;
+  size_t decoded;
+  int ret;
+
+  int channels;
+  long rate;
+
+  METRIC_CLOCK(decode_start);
+  if (open_mp3(mh, filename, &rate, &channels) != 0) {
     return -1;
   }
 
+  // Largest chunk one decoded frame can produce
+  frame_samples = mpg123_outblock(mh) / sizeof(short);
+
   // Initialize audio data structure
   audio_data->sample_rate = rate;
   audio_data->channels = channels;
   audio_data->num_samples = 0;
   audio_data->samples = NULL;
 
-  printf("Sample rate: %ld Hz\n", rate);
-  printf("Channels: %d\n", channels);
-
-  // Read and decode the entire file
+  // Read and decode the entire file. Scanning the frame index gives the exact
+  // track length, so the buffer is allocated once; streams of unknown length
+  // start with room for ~2 seconds and grow by doubling.
   size_t total_samples = 0;
-  size_t capacity = rate * channels * 2; // Initial capacity for ~2 seconds
-  audio_data->samples = malloc(capacity * sizeof(short));
+  size_t capacity = rate * channels * 2;
+  int presized = 0;
+
+  if (mpg123_scan(mh) == MPG123_OK) {
+    off_t length = mpg123_length(mh);
+    if (length > 0) {
+      capacity = (size_t)length * channels + frame_samples;
+      presized = 1;
+    }
+  }
+
+  audio_data->samples = arena_alloc(arena, capacity * sizeof(short));
 
   if (audio_data->samples == NULL) {
     fprintf(stderr, "Unable to allocate sample buffer\n");
-    free(buffer);
-    mpg123_close(mh);
-    mpg123_delete(mh);
-    mpg123_exit();
+    close_mp3(mh);
     return -1;
   }
 
-  while (mpg123_read(mh, buffer, buffer_size, &done) == MPG123_OK) {
-    size_t samples_in_buffer = done / sizeof(short);
-
-    // Resize buffer if needed
-    if (total_samples + samples_in_buffer > capacity) {
-      capacity *= 2;
-      audio_data->samples =
-          realloc(audio_data->samples, capacity * sizeof(short));
-      if (audio_data->samples == NULL) {
+  for (;;) {
+    // Resize buffer if the next frame might not fit
+    if (capacity - total_samples < frame_samples) {
+      short *grown = arena_grow(arena, audio_data->samples,
+                                capacity * sizeof(short),
+                                2 * capacity * sizeof(short));
+      if (grown == NULL) {
         fprintf(stderr, "Unable to reallocate sample buffer\n");
-        free(buffer);
-        mpg123_close(mh);
-        mpg123_delete(mh);
-        mpg123_exit();
+        audio_data->samples = NULL;
+        close_mp3(mh);
         return -1;
       }
+      capacity *= 2;
+      audio_data->samples = grown;
     }
 
-    // Copy samples to our array
-    short *samples = (short *)buffer;
-    for (size_t i = 0; i < samples_in_buffer; i++) {
-      audio_data->samples[total_samples + i] = samples[i];
+    ret = decode_frame_into(mh, audio_data->samples + total_samples,
+                            capacity - total_samples, &decoded);
+    if (ret != MPG123_OK) {
+      break;
     }
 
-    total_samples += samples_in_buffer;
+    total_samples += decoded;
+    METRIC_COUNT(COUNTER_PCM_FRAMES, decoded / channels);
+  }
+
+  if (ret != MPG123_DONE) {
+    fprintf(stderr, "Decoding stopped early: %s\n", mpg123_strerror(mh));
+  }
+
+  // Give back the slack left over from doubling; this never moves
+  if (!presized && total_samples > 0 && total_samples < capacity) {
+    arena_grow(arena, audio_data->samples, capacity * sizeof(short),
+               total_samples * sizeof(short));
   }
 
   audio_data->num_samples = total_samples;
 
   // Clean up
-  free(buffer);
-  mpg123_close(mh);
-  mpg123_delete(mh);
-  mpg123_exit();
+  close_mp3(mh);
 
+  METRIC_COUNT(COUNTER_TRACKS, 1);
+  METRIC_OBSERVE_SINCE(HISTOGRAM_DECODE_US, decode_start);
   return 0;
 }
 
-int main(int argc, char *argv[]) {
-  if (argc != 2) {
-    printf("Usage: %s <mp3_file>\n", argv[0]);
-    return 1;
-  }
+// Decodes filename incrementally, handing block_frames frames of interleaved
+// PCM at a time to callback. Only one block is ever resident, so memory use
+// does not depend on the length of the track. The last block may be short.
+int stream_mp3_samples(mpg123_handle *mh, const char *filename,
+                       size_t block_frames, pcm_block_callback callback,
+                       void *user) {
+  size_t frame_samples;
+  size_t decoded;
+  int ret;
 
-  struct timespec t_start, t_end;
-  double elapsed;
+  int channels;
+  long rate;
 
-  AudioData audio_data;
+  if (open_mp3(mh, filename, &rate, &channels) != 0) {
+    return -1;
+  }
 
-  if (extract_mp3_samples(argv[1], &audio_data) != 0) {
-    fprintf(stderr, "Failed to extract samples\n");
-    return 1;
+  // Frames are decoded in place at the tail of the block, so leave room for
+  // one frame past the block size; the overhang starts the next block.
+  frame_samples = mpg123_outblock(mh) / sizeof(short);
+  size_t block_capacity = block_frames * channels;
+  AudioData block = {malloc((block_capacity + frame_samples) * sizeof(short)),
+                     0, rate, channels};
+  if (block.samples == NULL) {
+    fprintf(stderr, "Unable to allocate block buffer\n");
+    close_mp3(mh);
+    return -1;
   }
 
-  printf("Successfully extracted %zu samples\n", audio_data.num_samples);
-  printf("Duration: %.2f seconds\n", (double)audio_data.num_samples /
-                                         audio_data.channels /
-                                         audio_data.sample_rate);
+  printf("Sample rate: %ld Hz\n", rate);
+  printf("Channels: %d\n", channels);
 
-  // get left channel samples
-  double *leftChanelSamples =
-      malloc(audio_data.num_samples / 2 * sizeof(double));
+  int status = 0;
+  size_t filled = 0;
+  while (status == 0) {
+    ret = decode_frame_into(mh, block.samples + filled,
+                            block_capacity + frame_samples - filled, &decoded);
+    if (ret != MPG123_OK) {
+      break;
+    }
+    filled += decoded;
+    METRIC_COUNT(COUNTER_PCM_FRAMES, decoded / channels);
 
-  if (leftChanelSamples == NULL) {
-    fprintf(stderr,
-            "Error: Failed to allocate memory for leftChannelSamples.\n");
-    exit(EXIT_FAILURE);
+    if (filled >= block_capacity) {
+      block.num_samples = block_capacity;
+      status = callback(&block, user);
+      filled -= block_capacity;
+      memmove(block.samples, block.samples + block_capacity,
+              filled * sizeof(short));
+    }
   }
 
-  for (int i = 0; i < audio_data.num_samples / 2; i++) {
-    leftChanelSamples[i] = audio_data.samples[i * 2];
+  if (status == 0 && ret != MPG123_DONE) {
+    fprintf(stderr, "Decoding stopped early: %s\n", mpg123_strerror(mh));
   }
 
-  // fft every hop ~3.33s
+  if (status == 0 && filled > 0) {
+    block.num_samples = filled;
+    status = callback(&block, user);
+  }
 
-  int hopsize = 159840;
+  free(block.samples);
+  close_mp3(mh);
 
-  if (clock_gettime(CLOCK_MONOTONIC, &t_start) != 0) {
-    perror("clock_gettime");
-    exit(EXIT_FAILURE);
-  }
+  METRIC_COUNT(COUNTER_TRACKS, 1);
+  return status == 0 ? 0 : -1;
+}
 
-  double *in = malloc(hopsize * sizeof(double));
+// Polyphase resampler from the decoded rate to a canonical hashing rate
+// (--resample), so tracks hash with the same frame geometry whatever rate
+// they were encoded at. hashing.ts gets the same effect by having ffmpeg
+// resample to 48 kHz. The rate ratio is reduced to up/down; output frame n
+// sits at n * down in the up-times-upsampled input, and its phase selects
+// one row of taps from a Blackman-windowed sinc whose cutoff is 90% of the
+// lower Nyquist rate, so the zero-stuffed samples are never touched. State
+// carries across calls, so a stream can be fed in blocks of any size.
+#define RESAMPLER_ZERO_CROSSINGS 8
+#define RESAMPLER_BANDWIDTH 0.9
 
-  if (in == NULL) {
-    fprintf(stderr, "Error: Failed to allocate memory for in.\n");
-    exit(EXIT_FAILURE);
-  }
+long resample_rate = 0; // 0 hashes at the decoded rate
 
-  double *freqArr = malloc(audio_data.num_samples / 2 * sizeof(double));
+typedef struct {
+  long in_rate;
+  long out_rate;
+  int channels;
+  int up;
+  int down;
+  int taps;       // per phase, even
+  float *coeffs;  // up rows of taps, oldest sample first
+  short *history; // input frames still needed, interleaved
+  size_t buffered;
+  size_t history_capacity;
+  uint64_t next;     // upsampled position of the next output in history
+  uint64_t consumed; // input frames seen since the last reset
+  uint64_t produced; // output frames written since the last reset
+} Resampler;
 
-  if (freqArr == NULL) {
-    fprintf(stderr, "Error: Failed to allocate memory for freqArr.\n");
-    exit(EXIT_FAILURE);
+void resampler_destroy(Resampler *rs) {
+  free(rs->coeffs);
+  free(rs->history);
+  memset(rs, 0, sizeof(*rs));
+}
+
+long gcd_long(long a, long b) {
+  while (b != 0) {
+    long t = a % b;
+    a = b;
+    b = t;
   }
+  return a;
+}
 
-  fftw_complex *out = fftw_malloc(sizeof(fftw_complex) * (hopsize / 2 + 1));
+// Starts a new stream: the history is primed with taps / 2 frames of
+// silence so the first output is centred on the first input frame.
+void resampler_reset(Resampler *rs) {
+  rs->buffered = rs->taps / 2;
+  memset(rs->history, 0, rs->buffered * rs->channels * sizeof(short));
+  rs->next = (uint64_t)rs->up * rs->taps;
+  rs->consumed = 0;
+  rs->produced = 0;
+}
 
-  if (out == NULL) {
-    fprintf(stderr, "Error: Failed to allocate memory for out.\n");
-    exit(EXIT_FAILURE);
+// Prepares rs for in_rate -> out_rate and resets it. The tap table is kept
+// when the rates and channel count are unchanged.
+int resampler_configure(Resampler *rs, long in_rate, long out_rate,
+                        int channels) {
+  if (rs->coeffs && rs->in_rate == in_rate && rs->out_rate == out_rate &&
+      rs->channels == channels) {
+    resampler_reset(rs);
+    return 0;
   }
+  resampler_destroy(rs);
 
-  fftw_plan plan = fftw_plan_dft_r2c_1d(hopsize, in, out, FFTW_MEASURE);
+  long g = gcd_long(in_rate, out_rate);
+  rs->in_rate = in_rate;
+  rs->out_rate = out_rate;
+  rs->channels = channels;
+  rs->up = (int)(out_rate / g);
+  rs->down = (int)(in_rate / g);
+  int ratio = (rs->down + rs->up - 1) / rs->up;
+  rs->taps = 2 * RESAMPLER_ZERO_CROSSINGS * (ratio > 1 ? ratio : 1);
+  rs->history_capacity = 4 * (size_t)rs->taps;
+  rs->coeffs = malloc((size_t)rs->up * rs->taps * sizeof(float));
+  rs->history = malloc(rs->history_capacity * channels * sizeof(short));
+  if (rs->coeffs == NULL || rs->history == NULL) {
+    fprintf(stderr, "Error: Failed to allocate resampler.\n");
+    resampler_destroy(rs);
+    return -1;
+  }
 
-  if (!plan) {
-    fprintf(stderr, "Error: FFTW plan creation failed\n");
-    exit(EXIT_FAILURE);
+  // Cutoff in cycles per upsampled sample
+  int wider = rs->up > rs->down ? rs->up : rs->down;
+  double fc = 0.5 * RESAMPLER_BANDWIDTH / wider;
+  double length = (double)rs->up * rs->taps;
+  double centre = (length - 1) / 2;
+
+  for (int p = 0; p < rs->up; p++) {
+    float *row = rs->coeffs + (size_t)p * rs->taps;
+    double sum = 0;
+    for (int r = 0; r < rs->taps; r++) {
+      // Row p, tap r multiplies input i - r' where j = p + r' * up
+      double j = p + (double)(rs->taps - 1 - r) * rs->up;
+      double x = 2 * fc * (j - centre);
+      double sinc = x == 0 ? 1 : sin(M_PI * x) / (M_PI * x);
+      double w = 0.42 - 0.5 * cos(2 * M_PI * j / (length - 1)) +
+                 0.08 * cos(4 * M_PI * j / (length - 1));
+      row[r] = (float)(sinc * w);
+      sum += sinc * w;
+    }
+    // Unity gain at DC for every phase
+    for (int r = 0; r < rs->taps; r++) {
+      row[r] = (float)(row[r] / sum);
+    }
   }
 
-  for (int i = 0; i + hopsize <= audio_data.num_samples / 2; i += hopsize) {
-    for (int j = 0; j < hopsize; j++) {
-      in[j] = leftChanelSamples[i + j];
+  resampler_reset(rs);
+  return 0;
+}
+
+// Most output frames one call with frames input frames can produce.
+size_t resampler_output_bound(const Resampler *rs, size_t frames) {
+  return (size_t)(((uint64_t)frames + rs->taps) * rs->up / rs->down) + 1;
+}
+
+// Largest input that is sure to produce at most out_frames outputs.
+size_t resampler_input_for(const Resampler *rs, size_t out_frames) {
+  uint64_t in = (uint64_t)(out_frames > 0 ? out_frames - 1 : 0) * rs->down /
+                rs->up;
+  return in > (uint64_t)rs->taps ? (size_t)(in - rs->taps) : 0;
+}
+
+// Emits every output whose taps are all in the history, then drops the
+// frames no later output needs.
+size_t resampler_drain(Resampler *rs, short *out) {
+  int ch = rs->channels;
+  size_t count = 0;
+
+  while (rs->next / rs->up < rs->buffered) {
+    size_t newest = rs->next / rs->up;
+    const float *row = rs->coeffs + (size_t)(rs->next % rs->up) * rs->taps;
+    const short *src = rs->history + (newest + 1 - rs->taps) * ch;
+    for (int c = 0; c < ch; c++) {
+      float acc = 0;
+      for (int r = 0; r < rs->taps; r++) {
+        acc += row[r] * src[(size_t)r * ch + c];
+      }
+      long v = lrintf(acc);
+      out[count * ch + c] = v > SHRT_MAX   ? SHRT_MAX
+                            : v < SHRT_MIN ? SHRT_MIN
+                                           : (short)v;
     }
+    count++;
+    rs->next += rs->down;
+  }
+
+  size_t keep_from = rs->next / rs->up + 1 - rs->taps;
+  if (keep_from > rs->buffered) {
+    keep_from = rs->buffered;
+  }
+  memmove(rs->history, rs->history + keep_from * ch,
+          (rs->buffered - keep_from) * ch * sizeof(short));
+  rs->buffered -= keep_from;
+  rs->next -= (uint64_t)keep_from * rs->up;
+  rs->produced += count;
+  return count;
+}
 
-    fftw_execute(plan);
+// Resamples frames interleaved input frames into out, which must have room
+// for resampler_output_bound(rs, frames). Returns the frames written, or
+// (size_t)-1 if the history could not grow.
+size_t resampler_process(Resampler *rs, const short *in, size_t frames,
+                         short *out) {
+  int ch = rs->channels;
+  size_t total = 0;
 
-    for (int j = 0; j < hopsize / 2 + 1; j++) {
-      freqArr[i + j] = sqrt(out[j][0] * out[j][0] + out[j][1] * out[j][1]);
+  while (frames > 0) {
+    size_t room = rs->history_capacity - rs->buffered;
+    if (room == 0) {
+      size_t capacity = 2 * rs->history_capacity;
+      short *grown = realloc(rs->history, capacity * ch * sizeof(short));
+      if (grown == NULL) {
+        fprintf(stderr, "Error: Failed to grow resampler history.\n");
+        return (size_t)-1;
+      }
+      rs->history = grown;
+      rs->history_capacity = capacity;
+      continue;
     }
+    size_t take = frames < room ? frames : room;
+    memcpy(rs->history + rs->buffered * ch, in, take * ch * sizeof(short));
+    rs->buffered += take;
+    rs->consumed += take;
+    in += take * ch;
+    frames -= take;
+    total += resampler_drain(rs, out + total * ch);
   }
 
-  if (clock_gettime(CLOCK_MONOTONIC, &t_end) != 0) {
-    perror("clock_gettime");
-    exit(EXIT_FAILURE);
+  return total;
+}
+
+// Ends the stream: pads with silence until the last input frame has been
+// centred, then trims to the exact converted length. out needs room for
+// resampler_output_bound(rs, 0) frames.
+size_t resampler_flush(Resampler *rs, short *out) {
+  uint64_t expected = (rs->consumed * rs->up + rs->down - 1) / rs->down;
+  if (rs->produced >= expected) {
+    return 0;
   }
+  size_t want = (size_t)(expected - rs->produced);
 
-  // Compute elapsed time in seconds
-  elapsed =
-      (t_end.tv_sec - t_start.tv_sec) + (t_end.tv_nsec - t_start.tv_nsec) / 1e9;
+  size_t pad = rs->taps / 2 + 1;
+  short *silence = calloc(pad * rs->channels, sizeof(short));
+  if (silence == NULL) {
+    fprintf(stderr, "Error: Failed to flush resampler.\n");
+    return 0;
+  }
+  uint64_t consumed = rs->consumed;
+  size_t got = resampler_process(rs, silence, pad, out);
+  rs->consumed = consumed;
+  free(silence);
 
-  printf("Processing loop took %.6f seconds\n", elapsed);
+  if (got == (size_t)-1) {
+    return 0;
+  }
+  return got < want ? got : want;
+}
 
-  // Clean up
-  free(audio_data.samples);
-  free(leftChanelSamples);
-  free(freqArr);
-  fftw_destroy_plan(plan);
-  free(in);
-  fftw_free(out);
+// Converts a decoded track to resample_rate. The new samples come from arena
+// like the decoded ones; nothing happens when no canonical rate is set or
+// the track is already at it.
+int resample_audio(Resampler *rs, AudioData *audio, Arena *arena) {
+  if (resample_rate <= 0 || audio->sample_rate == resample_rate) {
+    return 0;
+  }
+  if (resampler_configure(rs, audio->sample_rate, resample_rate,
+                          audio->channels) != 0) {
+    return -1;
+  }
+
+  size_t frames = audio->num_samples / audio->channels;
+  size_t bound =
+      resampler_output_bound(rs, frames) + resampler_output_bound(rs, 0);
+  short *out = arena_alloc(arena, bound * audio->channels * sizeof(short));
+  if (out == NULL) {
+    fprintf(stderr, "Unable to allocate resampled buffer\n");
+    return -1;
+  }
+
+  size_t got = resampler_process(rs, audio->samples, frames, out);
+  if (got == (size_t)-1) {
+    return -1;
+  }
+  got += resampler_flush(rs, out + got * audio->channels);
 
+  audio->samples = out;
+  audio->num_samples = got * audio->channels;
+  audio->sample_rate = resample_rate;
   return 0;
 }
+
+// Fingerprint scheme shared with hashing.ts: every 3.33 s window is cut into
+// 0.37 s Hann-windowed frames at 31/32 overlap, and each frame after the
+// first yields a 32-bit sub-fingerprint from 33 log-spaced bands between 300
+// and 2000 Hz.
+#define HASH_WINDOW_SECONDS 3.33
+#define FRAME_LENGTH_SECONDS 0.37
+#define OVERLAP_FACTOR (31.0 / 32)
+#define NUM_BANDS 33
+#define BAND_LOW_HZ 300.0
+#define BAND_HIGH_HZ 2000.0
+
+#define MAX_CACHED_PLANS 8
+
+// Frames transformed per fftw_plan_many_dft_r2c call. 16 frames of 0.37 s at
+// 48 kHz keep the batch input around 2 MB.
+#define STFT_BATCH 16
+
+// Arithmetic the STFT runs in. Single precision (--float) halves the
+// memory traffic of the frame batches and doubles the SIMD width; the 33
+// band energies per frame are still summed in double.
+typedef enum { PRECISION_DOUBLE, PRECISION_FLOAT } sample_precision;
+
+sample_precision hash_precision = PRECISION_DOUBLE;
+
+// FFTW plans shared by every thread, one per transform length, batch size
+// and precision. The planner is not thread-safe, so plans are only created
+// under planner_lock; running a finished plan on other arrays through the
+// new-array interface needs no lock.
+typedef struct {
+  int n;
+  int howmany;
+  sample_precision precision;
+  fftw_plan plan;   // PRECISION_DOUBLE
+  fftwf_plan plan_f; // PRECISION_FLOAT
+} CachedPlan;
+
+CachedPlan plan_cache[MAX_CACHED_PLANS];
+int plan_cache_count = 0;
+pthread_mutex_t planner_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Planner rigor for sizes with no saved wisdom. FFTW_ESTIMATE keeps cold
+// starts fast; --patient spends the FFTW_PATIENT search once and saves it.
+int plan_patient = 0;
+
+// Wisdom files live here, one per CPU model and transform shape:
+// <dir>/<cpu>-r2c-<n>x<howmany>.wisdom, or r2cf for single precision
+char wisdom_dir[PATH_MAX];
+
+// mkdir -p
+int make_dirs(const char *path) {
+  char buf[PATH_MAX];
+  snprintf(buf, sizeof(buf), "%s", path);
+  for (char *p = buf + 1; *p; p++) {
+    if (*p == '/') {
+      *p = '\0';
+      if (mkdir(buf, 0755) != 0 && errno != EEXIST) {
+        return -1;
+      }
+      *p = '/';
+    }
+  }
+  return mkdir(buf, 0755) != 0 && errno != EEXIST ? -1 : 0;
+}
+
+// Uses dir if given, else $HACHING_WISDOM_DIR, else the user cache directory.
+void init_wisdom_dir(const char *dir) {
+  const char *env = getenv("HACHING_WISDOM_DIR");
+  const char *xdg = getenv("XDG_CACHE_HOME");
+  const char *home = getenv("HOME");
+
+  if (dir != NULL) {
+    snprintf(wisdom_dir, sizeof(wisdom_dir), "%s", dir);
+  } else if (env != NULL && env[0] != '\0') {
+    snprintf(wisdom_dir, sizeof(wisdom_dir), "%s", env);
+  } else if (xdg != NULL && xdg[0] != '\0') {
+    snprintf(wisdom_dir, sizeof(wisdom_dir), "%s/hachingRewrite", xdg);
+  } else if (home != NULL && home[0] != '\0') {
+    snprintf(wisdom_dir, sizeof(wisdom_dir), "%s/.cache/hachingRewrite", home);
+  } else {
+    wisdom_dir[0] = '\0';
+  }
+}
+
+// Wisdom is only valid on the machine that measured it, so the file name
+// carries the CPU model from /proc/cpuinfo, reduced to [A-Za-z0-9_].
+const char *cpu_key(void) {
+  static char key[64];
+  if (key[0] != '\0') {
+    return key;
+  }
+
+  char line[256];
+  const char *model = NULL;
+  FILE *fp = fopen("/proc/cpuinfo", "r");
+  while (fp != NULL && fgets(line, sizeof(line), fp) != NULL) {
+    if (strncmp(line, "model name", 10) == 0 && strchr(line, ':') != NULL) {
+      model = strchr(line, ':') + 1;
+      break;
+    }
+  }
+  if (fp != NULL) {
+    fclose(fp);
+  }
+
+  size_t len = 0;
+  for (const char *c = model ? model : "generic";
+       *c && len < sizeof(key) - 1; c++) {
+    if (isalnum((unsigned char)*c)) {
+      key[len++] = *c;
+    } else if (len > 0 && key[len - 1] != '_' && *c != '\n') {
+      key[len++] = '_';
+    }
+  }
+  while (len > 0 && key[len - 1] == '_') {
+    len--;
+  }
+  key[len] = '\0';
+  if (len == 0) {
+    strcpy(key, "generic");
+  }
+
+  return key;
+}
+
+int wisdom_path(char *buf, size_t len, int n, int howmany,
+                sample_precision precision) {
+  if (wisdom_dir[0] == '\0') {
+    return -1;
+  }
+  int written = snprintf(buf, len, "%s/%s-%s-%dx%d.wisdom", wisdom_dir,
+                         cpu_key(),
+                         precision == PRECISION_FLOAT ? "r2cf" : "r2c", n,
+                         howmany);
+  return written > 0 && (size_t)written < len ? 0 : -1;
+}
+
+// Plans one shape in the given precision on throwaway arrays, since
+// measuring planners scribble over theirs; fftw_malloc gives every later
+// array the same alignment. Single-frame plans run on frames inside a batch
+// buffer, whose alignment varies with n, so they are planned unaligned.
+// With wise set only saved wisdom is used. Returns 0 when a plan was made.
+// Call with planner_lock held.
+int plan_r2c_shape(CachedPlan *entry, int wise) {
+  int n = entry->n;
+  int howmany = entry->howmany;
+  int bins = n / 2 + 1;
+  unsigned flags = wise           ? FFTW_MEASURE | FFTW_WISDOM_ONLY
+                   : plan_patient ? FFTW_PATIENT
+                                  : FFTW_ESTIMATE;
+  if (howmany == 1) {
+    flags |= FFTW_UNALIGNED;
+  }
+
+  if (entry->precision == PRECISION_FLOAT) {
+    float *in = fftwf_malloc((size_t)howmany * n * sizeof(float));
+    fftwf_complex *out = fftwf_malloc(sizeof(fftwf_complex) * howmany * bins);
+    if (in != NULL && out != NULL) {
+      entry->plan_f = fftwf_plan_many_dft_r2c(1, &n, howmany, in, NULL, 1, n,
+                                              out, NULL, 1, bins, flags);
+    }
+    fftwf_free(in);
+    fftwf_free(out);
+    return entry->plan_f ? 0 : -1;
+  }
+
+  double *in = fftw_malloc((size_t)howmany * n * sizeof(double));
+  fftw_complex *out = fftw_malloc(sizeof(fftw_complex) * howmany * bins);
+  if (in != NULL && out != NULL) {
+    entry->plan = fftw_plan_many_dft_r2c(1, &n, howmany, in, NULL, 1, n, out,
+                                         NULL, 1, bins, flags);
+  }
+  fftw_free(in);
+  fftw_free(out);
+  return entry->plan ? 0 : -1;
+}
+
+// Plan for howmany back-to-back real transforms of length n, with input
+// frames n samples apart and output spectra n / 2 + 1 bins apart. Saved
+// wisdom for the shape is used when present; otherwise the plan is estimated,
+// or searched patiently and exported when --patient is set. Returns the
+// cache entry, whose plan or plan_f matches precision, or NULL.
+const CachedPlan *get_cached_plan(int n, int howmany,
+                                  sample_precision precision) {
+  const CachedPlan *found = NULL;
+
+  pthread_mutex_lock(&planner_lock);
+  for (int i = 0; i < plan_cache_count; i++) {
+    if (plan_cache[i].n == n && plan_cache[i].howmany == howmany &&
+        plan_cache[i].precision == precision) {
+      found = &plan_cache[i];
+    }
+  }
+
+  if (found == NULL && plan_cache_count < MAX_CACHED_PLANS) {
+    CachedPlan entry = {n, howmany, precision, NULL, NULL};
+    char path[PATH_MAX];
+    int have_path = wisdom_path(path, sizeof(path), n, howmany, precision) == 0;
+    int wise = 0;
+    if (have_path) {
+      wise = precision == PRECISION_FLOAT
+                 ? fftwf_import_wisdom_from_filename(path)
+                 : fftw_import_wisdom_from_filename(path);
+    }
+
+    int planned = wise && plan_r2c_shape(&entry, 1) == 0;
+    if (!planned) {
+      wise = 0;
+      planned = plan_r2c_shape(&entry, 0) == 0;
+    }
+
+    if (planned && !wise && plan_patient && have_path) {
+      int saved = make_dirs(wisdom_dir) == 0 &&
+                  (precision == PRECISION_FLOAT
+                       ? fftwf_export_wisdom_to_filename(path)
+                       : fftw_export_wisdom_to_filename(path));
+      if (!saved) {
+        fprintf(stderr, "Warning: could not save FFTW wisdom to %s\n", path);
+      }
+    }
+
+    if (planned) {
+      plan_cache[plan_cache_count] = entry;
+      found = &plan_cache[plan_cache_count++];
+    }
+  }
+  pthread_mutex_unlock(&planner_lock);
+
+  if (!found) {
+    fprintf(stderr, "Error: FFTW plan creation failed\n");
+  }
+
+  return found;
+}
+
+fftw_plan get_r2c_plan(int n, int howmany) {
+  const CachedPlan *entry = get_cached_plan(n, howmany, PRECISION_DOUBLE);
+  return entry ? entry->plan : NULL;
+}
+
+fftwf_plan get_r2cf_plan(int n, int howmany) {
+  const CachedPlan *entry = get_cached_plan(n, howmany, PRECISION_FLOAT);
+  return entry ? entry->plan_f : NULL;
+}
+
+void destroy_plan_cache(void) {
+  for (int i = 0; i < plan_cache_count; i++) {
+    if (plan_cache[i].plan) {
+      fftw_destroy_plan(plan_cache[i].plan);
+    }
+    if (plan_cache[i].plan_f) {
+      fftwf_destroy_plan(plan_cache[i].plan_f);
+    }
+  }
+  plan_cache_count = 0;
+}
+
+// Interleaved 16-bit PCM as the hashing stages read it. Picking the channel
+// (or mixing all of them), widening int16 to double and applying the Hann
+// window happen in one pass that writes straight into the FFT input, so a
+// track is never copied into a separate array of doubles first.
+typedef enum { CHANNEL_LEFT, CHANNEL_RIGHT, CHANNEL_MIX } channel_mode;
+
+typedef struct {
+  const short *samples; // positioned at the first frame
+  int channels;
+  channel_mode mode;
+} PcmView;
+
+channel_mode hash_channel = CHANNEL_LEFT;
+
+PcmView pcm_view_at(const PcmView *pcm, size_t frame) {
+  PcmView view = *pcm;
+  view.samples += frame * pcm->channels;
+  return view;
+}
+
+// dst[i] = channel sample of frame i * window[i], for n frames at src.
+typedef void (*pcm_window_fn)(const short *src, int channels,
+                              channel_mode mode, const double *window,
+                              double *dst, int n);
+
+void pcm_window_scalar(const short *src, int channels, channel_mode mode,
+                       const double *window, double *dst, int n) {
+  if (mode == CHANNEL_MIX && channels > 1) {
+    double scale = 1.0 / channels;
+    for (int i = 0; i < n; i++) {
+      int sum = 0;
+      for (int c = 0; c < channels; c++) {
+        sum += src[(size_t)i * channels + c];
+      }
+      dst[i] = sum * scale * window[i];
+    }
+    return;
+  }
+
+  int c = mode == CHANNEL_RIGHT && channels > 1 ? 1 : 0;
+  for (int i = 0; i < n; i++) {
+    dst[i] = src[(size_t)i * channels + c] * window[i];
+  }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+// Stereo goes through pmaddwd: weights (1, 0), (0, 1) or (1, 1) select or
+// sum each L/R pair exactly in int32 before widening to double.
+__attribute__((target("avx2"))) void
+pcm_window_avx2(const short *src, int channels, channel_mode mode,
+                const double *window, double *dst, int n) {
+  int i = 0;
+  if (channels == 2) {
+    __m128i weights = mode == CHANNEL_MIX     ? _mm_set1_epi32(0x00010001)
+                      : mode == CHANNEL_RIGHT ? _mm_set1_epi32(0x00010000)
+                                              : _mm_set1_epi32(0x00000001);
+    __m256d scale = _mm256_set1_pd(mode == CHANNEL_MIX ? 0.5 : 1.0);
+    for (; i + 4 <= n; i += 4) {
+      __m128i pairs = _mm_loadu_si128((const __m128i *)(src + 2 * (size_t)i));
+      __m256d x = _mm256_cvtepi32_pd(_mm_madd_epi16(pairs, weights));
+      x = _mm256_mul_pd(_mm256_mul_pd(x, scale), _mm256_loadu_pd(window + i));
+      _mm256_storeu_pd(dst + i, x);
+    }
+  } else if (channels == 1) {
+    for (; i + 4 <= n; i += 4) {
+      __m128i v = _mm_loadl_epi64((const __m128i *)(src + i));
+      __m256d x = _mm256_cvtepi32_pd(_mm_cvtepi16_epi32(v));
+      _mm256_storeu_pd(dst + i, _mm256_mul_pd(x, _mm256_loadu_pd(window + i)));
+    }
+  }
+  pcm_window_scalar(src + (size_t)i * channels, channels, mode, window + i,
+                    dst + i, n - i);
+}
+#elif defined(__aarch64__)
+void pcm_window_neon(const short *src, int channels, channel_mode mode,
+                     const double *window, double *dst, int n) {
+  int i = 0;
+  if (channels == 2) {
+    float64x2_t scale = vdupq_n_f64(mode == CHANNEL_MIX ? 0.5 : 1.0);
+    for (; i + 4 <= n; i += 4) {
+      int16x4x2_t lr = vld2_s16(src + 2 * (size_t)i); // deinterleaves L and R
+      int32x4_t x = mode == CHANNEL_MIX     ? vaddl_s16(lr.val[0], lr.val[1])
+                    : mode == CHANNEL_RIGHT ? vmovl_s16(lr.val[1])
+                                            : vmovl_s16(lr.val[0]);
+      float64x2_t lo = vcvtq_f64_s64(vmovl_s32(vget_low_s32(x)));
+      float64x2_t hi = vcvtq_f64_s64(vmovl_s32(vget_high_s32(x)));
+      vst1q_f64(dst + i,
+                vmulq_f64(vmulq_f64(lo, scale), vld1q_f64(window + i)));
+      vst1q_f64(dst + i + 2,
+                vmulq_f64(vmulq_f64(hi, scale), vld1q_f64(window + i + 2)));
+    }
+  } else if (channels == 1) {
+    for (; i + 4 <= n; i += 4) {
+      int32x4_t x = vmovl_s16(vld1_s16(src + i));
+      float64x2_t lo = vcvtq_f64_s64(vmovl_s32(vget_low_s32(x)));
+      float64x2_t hi = vcvtq_f64_s64(vmovl_s32(vget_high_s32(x)));
+      vst1q_f64(dst + i, vmulq_f64(lo, vld1q_f64(window + i)));
+      vst1q_f64(dst + i + 2, vmulq_f64(hi, vld1q_f64(window + i + 2)));
+    }
+  }
+  pcm_window_scalar(src + (size_t)i * channels, channels, mode, window + i,
+                    dst + i, n - i);
+}
+#endif
+
+pcm_window_fn pcm_window = pcm_window_scalar;
+
+// Single-precision twin of pcm_window, for --float.
+typedef void (*pcm_window_f_fn)(const short *src, int channels,
+                                channel_mode mode, const float *window,
+                                float *dst, int n);
+
+void pcm_window_f_scalar(const short *src, int channels, channel_mode mode,
+                         const float *window, float *dst, int n) {
+  if (mode == CHANNEL_MIX && channels > 1) {
+    float scale = 1.0f / channels;
+    for (int i = 0; i < n; i++) {
+      int sum = 0;
+      for (int c = 0; c < channels; c++) {
+        sum += src[(size_t)i * channels + c];
+      }
+      dst[i] = (float)sum * scale * window[i];
+    }
+    return;
+  }
+
+  int c = mode == CHANNEL_RIGHT && channels > 1 ? 1 : 0;
+  for (int i = 0; i < n; i++) {
+    dst[i] = (float)src[(size_t)i * channels + c] * window[i];
+  }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("avx2"))) void
+pcm_window_f_avx2(const short *src, int channels, channel_mode mode,
+                  const float *window, float *dst, int n) {
+  int i = 0;
+  if (channels == 2) {
+    __m256i weights = mode == CHANNEL_MIX ? _mm256_set1_epi32(0x00010001)
+                      : mode == CHANNEL_RIGHT
+                          ? _mm256_set1_epi32(0x00010000)
+                          : _mm256_set1_epi32(0x00000001);
+    __m256 scale = _mm256_set1_ps(mode == CHANNEL_MIX ? 0.5f : 1.0f);
+    for (; i + 8 <= n; i += 8) {
+      __m256i pairs =
+          _mm256_loadu_si256((const __m256i *)(src + 2 * (size_t)i));
+      __m256 x = _mm256_cvtepi32_ps(_mm256_madd_epi16(pairs, weights));
+      x = _mm256_mul_ps(_mm256_mul_ps(x, scale), _mm256_loadu_ps(window + i));
+      _mm256_storeu_ps(dst + i, x);
+    }
+  } else if (channels == 1) {
+    for (; i + 8 <= n; i += 8) {
+      __m128i v = _mm_loadu_si128((const __m128i *)(src + i));
+      __m256 x = _mm256_cvtepi32_ps(_mm256_cvtepi16_epi32(v));
+      _mm256_storeu_ps(dst + i, _mm256_mul_ps(x, _mm256_loadu_ps(window + i)));
+    }
+  }
+  pcm_window_f_scalar(src + (size_t)i * channels, channels, mode, window + i,
+                      dst + i, n - i);
+}
+#elif defined(__aarch64__)
+void pcm_window_f_neon(const short *src, int channels, channel_mode mode,
+                       const float *window, float *dst, int n) {
+  int i = 0;
+  if (channels == 2) {
+    float32x4_t scale = vdupq_n_f32(mode == CHANNEL_MIX ? 0.5f : 1.0f);
+    for (; i + 4 <= n; i += 4) {
+      int16x4x2_t lr = vld2_s16(src + 2 * (size_t)i);
+      int32x4_t x = mode == CHANNEL_MIX     ? vaddl_s16(lr.val[0], lr.val[1])
+                    : mode == CHANNEL_RIGHT ? vmovl_s16(lr.val[1])
+                                            : vmovl_s16(lr.val[0]);
+      vst1q_f32(dst + i, vmulq_f32(vmulq_f32(vcvtq_f32_s32(x), scale),
+                                   vld1q_f32(window + i)));
+    }
+  } else if (channels == 1) {
+    for (; i + 4 <= n; i += 4) {
+      float32x4_t x = vcvtq_f32_s32(vmovl_s16(vld1_s16(src + i)));
+      vst1q_f32(dst + i, vmulq_f32(x, vld1q_f32(window + i)));
+    }
+  }
+  pcm_window_f_scalar(src + (size_t)i * channels, channels, mode, window + i,
+                      dst + i, n - i);
+}
+#endif
+
+pcm_window_f_fn pcm_window_f = pcm_window_f_scalar;
+
+// Short-time Fourier transform over consecutive overlapping frames. The Hann
+// coefficients are computed once, and frames are windowed into a batch that
+// a single planned call transforms together; a one-frame plan handles the
+// tail of a window that does not fill a whole batch. Only the arrays and
+// plans of the chosen precision are set up.
+typedef struct {
+  int frame_len;
+  int hop_size;
+  int num_bins;
+  int batch;
+  sample_precision precision;
+  double *window;
+  double *in;
+  fftw_complex *out;
+  fftw_plan batch_plan;
+  fftw_plan single_plan;
+  float *window_f;
+  float *in_f;
+  fftwf_complex *out_f;
+  fftwf_plan batch_plan_f;
+  fftwf_plan single_plan_f;
+} Stft;
+
+void stft_destroy(Stft *stft) {
+  free(stft->window);
+  fftw_free(stft->in);
+  fftw_free(stft->out);
+  free(stft->window_f);
+  fftwf_free(stft->in_f);
+  fftwf_free(stft->out_f);
+  memset(stft, 0, sizeof(*stft));
+}
+
+int stft_init(Stft *stft, int frame_len, int hop_size, int batch,
+              sample_precision precision) {
+  stft->frame_len = frame_len;
+  stft->hop_size = hop_size;
+  stft->num_bins = frame_len / 2 + 1;
+  stft->batch = batch;
+  stft->precision = precision;
+
+  int allocated;
+  if (precision == PRECISION_FLOAT) {
+    stft->window_f = malloc(frame_len * sizeof(float));
+    stft->in_f = fftwf_malloc((size_t)batch * frame_len * sizeof(float));
+    stft->out_f = fftwf_malloc(sizeof(fftwf_complex) * batch * stft->num_bins);
+    allocated = stft->window_f && stft->in_f && stft->out_f;
+  } else {
+    stft->window = malloc(frame_len * sizeof(double));
+    stft->in = fftw_malloc((size_t)batch * frame_len * sizeof(double));
+    stft->out = fftw_malloc(sizeof(fftw_complex) * batch * stft->num_bins);
+    allocated = stft->window && stft->in && stft->out;
+  }
+
+  if (!allocated) {
+    fprintf(stderr, "Error: Failed to allocate STFT buffers.\n");
+    stft_destroy(stft);
+    return -1;
+  }
+
+  // Hann, same expression as applyHannWindow in hashing.ts
+  for (int n = 0; n < frame_len; n++) {
+    double w = 0.5 * (1 - cos((2 * M_PI * n) / (frame_len - 1)));
+    if (precision == PRECISION_FLOAT) {
+      stft->window_f[n] = (float)w;
+    } else {
+      stft->window[n] = w;
+    }
+  }
+
+  int planned;
+  if (precision == PRECISION_FLOAT) {
+    stft->batch_plan_f = get_r2cf_plan(frame_len, batch);
+    stft->single_plan_f = get_r2cf_plan(frame_len, 1);
+    planned = stft->batch_plan_f && stft->single_plan_f;
+  } else {
+    stft->batch_plan = get_r2c_plan(frame_len, batch);
+    stft->single_plan = get_r2c_plan(frame_len, 1);
+    planned = stft->batch_plan && stft->single_plan;
+  }
+  if (!planned) {
+    stft_destroy(stft);
+    return -1;
+  }
+
+  return 0;
+}
+
+// Converts and windows count (at most batch) frames into stft->in (or
+// in_f), the first starting at the start of pcm.
+void stft_window(Stft *stft, const PcmView *pcm, int count) {
+  int N = stft->frame_len;
+
+  for (int f = 0; f < count; f++) {
+    PcmView frame = pcm_view_at(pcm, (size_t)f * stft->hop_size);
+    if (stft->precision == PRECISION_FLOAT) {
+      pcm_window_f(frame.samples, pcm->channels, pcm->mode, stft->window_f,
+                   stft->in_f + (size_t)f * N, N);
+    } else {
+      pcm_window(frame.samples, pcm->channels, pcm->mode, stft->window,
+                 stft->in + (size_t)f * N, N);
+    }
+  }
+}
+
+// Transforms the first count frames already windowed into stft->in (or
+// in_f). The spectrum of frame f is left at out + f * num_bins.
+void stft_transform(Stft *stft, int count) {
+  int N = stft->frame_len;
+
+  if (stft->precision == PRECISION_FLOAT) {
+    if (count == stft->batch) {
+      fftwf_execute_dft_r2c(stft->batch_plan_f, stft->in_f, stft->out_f);
+    } else {
+      for (int f = 0; f < count; f++) {
+        fftwf_execute_dft_r2c(stft->single_plan_f, stft->in_f + (size_t)f * N,
+                              stft->out_f + (size_t)f * stft->num_bins);
+      }
+    }
+    return;
+  }
+
+  if (count == stft->batch) {
+    fftw_execute_dft_r2c(stft->batch_plan, stft->in, stft->out);
+  } else {
+    for (int f = 0; f < count; f++) {
+      fftw_execute_dft_r2c(stft->single_plan, stft->in + (size_t)f * N,
+                           stft->out + (size_t)f * stft->num_bins);
+    }
+  }
+}
+
+// |X[k]|^2 of n interleaved FFTW bins. Band energies are sums of squared
+// magnitudes, so the sqrt of the old magnitude loop is skipped entirely.
+typedef void (*power_spectrum_fn)(const fftw_complex *in, double *out, int n);
+
+void power_spectrum_scalar(const fftw_complex *in, double *out, int n) {
+  for (int k = 0; k < n; k++) {
+    out[k] = in[k][0] * in[k][0] + in[k][1] * in[k][1];
+  }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("avx2"))) void
+power_spectrum_avx2(const fftw_complex *in, double *out, int n) {
+  int k = 0;
+  for (; k + 4 <= n; k += 4) {
+    __m256d a = _mm256_loadu_pd(in[k]);     // re0 im0 re1 im1
+    __m256d b = _mm256_loadu_pd(in[k + 2]); // re2 im2 re3 im3
+    __m256d sum = _mm256_hadd_pd(_mm256_mul_pd(a, a), _mm256_mul_pd(b, b));
+    // hadd leaves bins in order 0 2 1 3
+    _mm256_storeu_pd(out + k,
+                     _mm256_permute4x64_pd(sum, _MM_SHUFFLE(3, 1, 2, 0)));
+  }
+  power_spectrum_scalar(in + k, out + k, n - k);
+}
+#elif defined(__aarch64__)
+void power_spectrum_neon(const fftw_complex *in, double *out, int n) {
+  int k = 0;
+  for (; k + 2 <= n; k += 2) {
+    float64x2x2_t v = vld2q_f64(in[k]); // deinterleaves re and im
+    vst1q_f64(out + k, vaddq_f64(vmulq_f64(v.val[0], v.val[0]),
+                                 vmulq_f64(v.val[1], v.val[1])));
+  }
+  power_spectrum_scalar(in + k, out + k, n - k);
+}
+#endif
+
+power_spectrum_fn power_spectrum = power_spectrum_scalar;
+
+// Single-precision spectrum: squares and sums in float, widened on store so
+// the band sums stay double.
+typedef void (*power_spectrum_f_fn)(const fftwf_complex *in, double *out,
+                                    int n);
+
+void power_spectrum_f_scalar(const fftwf_complex *in, double *out, int n) {
+  for (int k = 0; k < n; k++) {
+    out[k] = in[k][0] * in[k][0] + in[k][1] * in[k][1];
+  }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("avx2"))) void
+power_spectrum_f_avx2(const fftwf_complex *in, double *out, int n) {
+  int k = 0;
+  for (; k + 8 <= n; k += 8) {
+    __m256 a = _mm256_loadu_ps(in[k]);     // bins 0-3, re/im interleaved
+    __m256 b = _mm256_loadu_ps(in[k + 4]); // bins 4-7
+    __m256 sum = _mm256_hadd_ps(_mm256_mul_ps(a, a), _mm256_mul_ps(b, b));
+    // hadd leaves bins in order 0 1 4 5 2 3 6 7; swap the middle pairs
+    sum = _mm256_castpd_ps(_mm256_permute4x64_pd(_mm256_castps_pd(sum),
+                                                 _MM_SHUFFLE(3, 1, 2, 0)));
+    _mm256_storeu_pd(out + k, _mm256_cvtps_pd(_mm256_castps256_ps128(sum)));
+    _mm256_storeu_pd(out + k + 4,
+                     _mm256_cvtps_pd(_mm256_extractf128_ps(sum, 1)));
+  }
+  power_spectrum_f_scalar(in + k, out + k, n - k);
+}
+#elif defined(__aarch64__)
+void power_spectrum_f_neon(const fftwf_complex *in, double *out, int n) {
+  int k = 0;
+  for (; k + 4 <= n; k += 4) {
+    float32x4x2_t v = vld2q_f32(in[k]);
+    float32x4_t p = vaddq_f32(vmulq_f32(v.val[0], v.val[0]),
+                              vmulq_f32(v.val[1], v.val[1]));
+    vst1q_f64(out + k, vcvt_f64_f32(vget_low_f32(p)));
+    vst1q_f64(out + k + 2, vcvt_high_f64_f32(p));
+  }
+  power_spectrum_f_scalar(in + k, out + k, n - k);
+}
+#endif
+
+power_spectrum_f_fn power_spectrum_f = power_spectrum_f_scalar;
+
+// Bin tables for the band energies of one frame geometry. Only bins in
+// [first_bin, last_bin) contribute (300-2000 Hz), so the power spectrum is
+// evaluated over that range alone. When the range is narrow enough that
+// per-bin Goertzel recurrences on the windowed frame cost less than the
+// whole r2c transform, the FFT is skipped instead.
+typedef enum { BANDS_FROM_FFT, BANDS_GOERTZEL } band_method;
+
+typedef struct {
+  int edges[NUM_BANDS + 1];
+  int first_bin;
+  int last_bin;
+  band_method method;
+  double *goertzel_coeff; // 2 cos(2 pi k / N) for first_bin <= k < last_bin
+  double *power;          // last_bin - first_bin values
+} BandPlan;
+
+void band_plan_destroy(BandPlan *bands) {
+  free(bands->goertzel_coeff);
+  free(bands->power);
+  memset(bands, 0, sizeof(*bands));
+}
+
+// HACHING_BANDS=fft or =goertzel overrides the cost estimate.
+int band_plan_init(BandPlan *bands, long sample_rate, int frame_len) {
+  // 34 edges -> 33 bands, clamped to the N/2 bins getHash keeps
+  double freq_per_bin = (double)sample_rate / frame_len;
+  for (int m = 0; m <= NUM_BANDS; m++) {
+    double freq = BAND_LOW_HZ * pow(BAND_HIGH_HZ / BAND_LOW_HZ,
+                                    (double)m / NUM_BANDS);
+    int bin = (int)floor(freq / freq_per_bin);
+    bands->edges[m] = bin < frame_len / 2 ? bin : frame_len / 2;
+  }
+  bands->first_bin = bands->edges[0];
+  bands->last_bin = bands->edges[NUM_BANDS];
+
+  // r2c is ~2.5 N log2 N flops; Goertzel is 3 N per bin plus the tail
+  int range = bands->last_bin - bands->first_bin;
+  double fft_cost = 2.5 * frame_len * log2(frame_len);
+  double goertzel_cost = 3.0 * frame_len * range;
+  bands->method = goertzel_cost < fft_cost ? BANDS_GOERTZEL : BANDS_FROM_FFT;
+
+  const char *forced = getenv("HACHING_BANDS");
+  if (forced != NULL && strcmp(forced, "fft") == 0) {
+    bands->method = BANDS_FROM_FFT;
+  } else if (forced != NULL && strcmp(forced, "goertzel") == 0) {
+    bands->method = BANDS_GOERTZEL;
+  }
+
+  bands->power = malloc((range + 1) * sizeof(double));
+  if (bands->power == NULL) {
+    fprintf(stderr, "Error: Failed to allocate band buffers.\n");
+    return -1;
+  }
+
+  if (bands->method == BANDS_GOERTZEL) {
+    bands->goertzel_coeff = malloc((range + 1) * sizeof(double));
+    if (bands->goertzel_coeff == NULL) {
+      fprintf(stderr, "Error: Failed to allocate band buffers.\n");
+      band_plan_destroy(bands);
+      return -1;
+    }
+    for (int k = 0; k < range; k++) {
+      bands->goertzel_coeff[k] =
+          2 * cos(2 * M_PI * (bands->first_bin + k) / frame_len);
+    }
+  }
+
+  return 0;
+}
+
+// Sums of bands->power per band, in the order getHash adds them.
+void sum_band_energies(const BandPlan *bands, double *energies) {
+  const double *power = bands->power - bands->first_bin;
+  for (int b = 0; b < NUM_BANDS; b++) {
+    energies[b] = 0;
+    for (int k = bands->edges[b]; k < bands->edges[b + 1]; k++) {
+      energies[b] += power[k];
+    }
+  }
+}
+
+void band_energies_from_spectrum(BandPlan *bands, const fftw_complex *spectrum,
+                                 double *energies) {
+  power_spectrum(spectrum + bands->first_bin, bands->power,
+                 bands->last_bin - bands->first_bin);
+  sum_band_energies(bands, energies);
+}
+
+void band_energies_from_spectrum_f(BandPlan *bands,
+                                   const fftwf_complex *spectrum,
+                                   double *energies) {
+  power_spectrum_f(spectrum + bands->first_bin, bands->power,
+                   bands->last_bin - bands->first_bin);
+  sum_band_energies(bands, energies);
+}
+
+// |X[k]|^2 straight from the windowed frame, one recurrence per needed bin.
+void band_energies_goertzel(BandPlan *bands, const double *frame, int N,
+                            double *energies) {
+  int range = bands->last_bin - bands->first_bin;
+  for (int k = 0; k < range; k++) {
+    double coeff = bands->goertzel_coeff[k];
+    double s1 = 0, s2 = 0;
+    for (int n = 0; n < N; n++) {
+      double s0 = frame[n] + coeff * s1 - s2;
+      s2 = s1;
+      s1 = s0;
+    }
+    bands->power[k] = s1 * s1 + s2 * s2 - coeff * s1 * s2;
+  }
+  sum_band_energies(bands, energies);
+}
+
+// Goertzel over a single-precision frame; the recurrence stays double.
+void band_energies_goertzel_f(BandPlan *bands, const float *frame, int N,
+                              double *energies) {
+  int range = bands->last_bin - bands->first_bin;
+  for (int k = 0; k < range; k++) {
+    double coeff = bands->goertzel_coeff[k];
+    double s1 = 0, s2 = 0;
+    for (int n = 0; n < N; n++) {
+      double s0 = frame[n] + coeff * s1 - s2;
+      s2 = s1;
+      s1 = s0;
+    }
+    bands->power[k] = s1 * s1 + s2 * s2 - coeff * s1 * s2;
+  }
+  sum_band_energies(bands, energies);
+}
+
+// Per-thread hashing state for one sample rate. The frame geometry is
+// derived exactly the way getHash derives it so the bits match.
+typedef struct {
+  long sample_rate;
+  int window_len;
+  int frame_len;
+  int hop_size;
+  int frames_per_window;
+  sample_precision precision;
+  BandPlan bands;
+  Stft stft;
+  double *energies;
+} HashContext;
+
+void hash_context_destroy(HashContext *ctx) {
+  stft_destroy(&ctx->stft);
+  band_plan_destroy(&ctx->bands);
+  free(ctx->energies);
+  memset(ctx, 0, sizeof(*ctx));
+}
+
+int hash_context_configure_precision(HashContext *ctx, long sample_rate,
+                                     sample_precision precision) {
+  if (ctx->sample_rate == sample_rate && ctx->precision == precision) {
+    return 0;
+  }
+  hash_context_destroy(ctx);
+
+  double hop_seconds = FRAME_LENGTH_SECONDS * (1 - OVERLAP_FACTOR);
+
+  ctx->sample_rate = sample_rate;
+  ctx->precision = precision;
+  ctx->window_len = (int)lround(HASH_WINDOW_SECONDS * sample_rate);
+  ctx->frame_len = (int)floor(FRAME_LENGTH_SECONDS * sample_rate);
+  ctx->hop_size = (int)floor(hop_seconds * sample_rate);
+  ctx->frames_per_window =
+      (ctx->window_len - ctx->frame_len) / ctx->hop_size + 1;
+
+  ctx->energies =
+      malloc((size_t)ctx->frames_per_window * NUM_BANDS * sizeof(double));
+
+  if (ctx->energies == NULL) {
+    fprintf(stderr, "Error: Failed to allocate hashing buffers.\n");
+    hash_context_destroy(ctx);
+    return -1;
+  }
+
+  if (band_plan_init(&ctx->bands, sample_rate, ctx->frame_len) != 0 ||
+      stft_init(&ctx->stft, ctx->frame_len, ctx->hop_size, STFT_BATCH,
+                precision) != 0) {
+    hash_context_destroy(ctx);
+    return -1;
+  }
+
+  return 0;
+}
+
+int hash_context_configure(HashContext *ctx, long sample_rate) {
+  return hash_context_configure_precision(ctx, sample_rate, hash_precision);
+}
+
+// Bit m (LSB is bit 0) is set iff the energy slope between bands m and m+1
+// rose since the previous frame: [E(n,m) - E(n,m+1)] > [E(n-1,m) - E(n-1,m+1)]
+uint32_t compute_sub_fingerprint(const double *prevEnergies,
+                                 const double *currEnergies) {
+  uint32_t hash = 0;
+  for (int m = 0; m < 32; m++) {
+    double slopePrev = prevEnergies[m] - prevEnergies[m + 1];
+    double slopeCurr = currEnergies[m] - currEnergies[m + 1];
+    if (slopeCurr > slopePrev) {
+      hash |= (uint32_t)1 << m;
+    }
+  }
+  return hash;
+}
+
+// One sub-fingerprint per frame starting at frame 1; energyFrames holds
+// NUM_BANDS values per frame. Returns frames - 1.
+typedef int (*sub_fingerprints_fn)(const double *energyFrames, int frames,
+                                   uint32_t *fingerprints);
+
+int compute_all_sub_fingerprints_scalar(const double *energyFrames, int frames,
+                                        uint32_t *fingerprints) {
+  for (int n = 1; n < frames; n++) {
+    fingerprints[n - 1] =
+        compute_sub_fingerprint(energyFrames + (n - 1) * NUM_BANDS,
+                                energyFrames + n * NUM_BANDS);
+  }
+  return frames > 0 ? frames - 1 : 0;
+}
+
+// The vector versions compare the 32 slopes a few lanes at a time and pack
+// each compare mask straight into the hash. A frame's slopes are computed
+// once and kept as the next frame's previous slopes; the subtractions are
+// the scalar ones, so every bit matches.
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("avx2"))) int
+compute_all_sub_fingerprints_avx2(const double *energyFrames, int frames,
+                                  uint32_t *fingerprints) {
+  __m256d slopePrev[8];
+
+  for (int n = 0; n < frames; n++) {
+    const double *e = energyFrames + n * NUM_BANDS;
+    uint32_t hash = 0;
+    for (int j = 0; j < 8; j++) {
+      __m256d slopeCurr = _mm256_sub_pd(_mm256_loadu_pd(e + 4 * j),
+                                        _mm256_loadu_pd(e + 4 * j + 1));
+      if (n > 0) {
+        __m256d rose = _mm256_cmp_pd(slopeCurr, slopePrev[j], _CMP_GT_OQ);
+        hash |= (uint32_t)_mm256_movemask_pd(rose) << (4 * j);
+      }
+      slopePrev[j] = slopeCurr;
+    }
+    if (n > 0) {
+      fingerprints[n - 1] = hash;
+    }
+  }
+  return frames > 0 ? frames - 1 : 0;
+}
+#elif defined(__aarch64__)
+int compute_all_sub_fingerprints_neon(const double *energyFrames, int frames,
+                                      uint32_t *fingerprints) {
+  float64x2_t slopePrev[16];
+
+  for (int n = 0; n < frames; n++) {
+    const double *e = energyFrames + n * NUM_BANDS;
+    uint32_t hash = 0;
+    for (int j = 0; j < 16; j++) {
+      float64x2_t slopeCurr =
+          vsubq_f64(vld1q_f64(e + 2 * j), vld1q_f64(e + 2 * j + 1));
+      if (n > 0) {
+        uint64x2_t rose = vcgtq_f64(slopeCurr, slopePrev[j]);
+        uint32_t bits = (uint32_t)(vgetq_lane_u64(rose, 0) & 1) |
+                        (uint32_t)(vgetq_lane_u64(rose, 1) & 2);
+        hash |= bits << (2 * j);
+      }
+      slopePrev[j] = slopeCurr;
+    }
+    if (n > 0) {
+      fingerprints[n - 1] = hash;
+    }
+  }
+  return frames > 0 ? frames - 1 : 0;
+}
+#endif
+
+sub_fingerprints_fn compute_all_sub_fingerprints =
+    compute_all_sub_fingerprints_scalar;
+
+// Chooses the widest PCM conversion, power spectrum and sub-fingerprint
+// kernels the CPU supports; all variants do the scalar arithmetic in the
+// scalar order, so fingerprints do not change. HACHING_SIMD=scalar keeps the
+// portable loops.
+void select_simd_kernels(void) {
+  const char *forced = getenv("HACHING_SIMD");
+  if (forced != NULL && strcmp(forced, "scalar") == 0) {
+    return;
+  }
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) {
+    power_spectrum = power_spectrum_avx2;
+    compute_all_sub_fingerprints = compute_all_sub_fingerprints_avx2;
+    pcm_window = pcm_window_avx2;
+    power_spectrum_f = power_spectrum_f_avx2;
+    pcm_window_f = pcm_window_f_avx2;
+  }
+#elif defined(__aarch64__)
+  power_spectrum = power_spectrum_neon;
+  compute_all_sub_fingerprints = compute_all_sub_fingerprints_neon;
+  pcm_window = pcm_window_neon;
+  power_spectrum_f = power_spectrum_f_neon;
+  pcm_window_f = pcm_window_f_neon;
+#endif
+}
+
+// Band energies of the count frames of the current batch: from the windowed
+// frames with Goertzel, otherwise from their spectra, which stft_transform
+// must already have produced. NUM_BANDS values per frame go to energies.
+void batch_band_energies(HashContext *ctx, int count, double *energies) {
+  Stft *stft = &ctx->stft;
+  int N = ctx->frame_len;
+  int single = stft->precision == PRECISION_FLOAT;
+
+  for (int f = 0; f < count; f++) {
+    double *dst = energies + (size_t)f * NUM_BANDS;
+    if (ctx->bands.method == BANDS_GOERTZEL) {
+      if (single) {
+        band_energies_goertzel_f(&ctx->bands, stft->in_f + (size_t)f * N, N,
+                                 dst);
+      } else {
+        band_energies_goertzel(&ctx->bands, stft->in + (size_t)f * N, N, dst);
+      }
+      continue;
+    }
+
+    size_t bin = (size_t)f * stft->num_bins;
+    if (single) {
+      band_energies_from_spectrum_f(&ctx->bands, stft->out_f + bin, dst);
+    } else {
+      band_energies_from_spectrum(&ctx->bands, stft->out + bin, dst);
+    }
+  }
+}
+
+// Band energies of frames consecutive frames at hop_size spacing, the first
+// starting at the start of pcm; NUM_BANDS values per frame go to energies.
+void compute_band_energies(HashContext *ctx, const PcmView *pcm, int frames,
+                           double *energies) {
+  Stft *stft = &ctx->stft;
+
+  for (int f0 = 0; f0 < frames; f0 += stft->batch) {
+    int count = frames - f0;
+    if (count > stft->batch) {
+      count = stft->batch;
+    }
+
+    PcmView first = pcm_view_at(pcm, (size_t)f0 * ctx->hop_size);
+    stft_window(stft, &first, count);
+    if (ctx->bands.method != BANDS_GOERTZEL) {
+      METRIC_CLOCK(fft_start);
+      stft_transform(stft, count);
+      METRIC_OBSERVE_SINCE(HISTOGRAM_FFT_US, fft_start);
+    }
+    batch_band_energies(ctx, count, energies + (size_t)f0 * NUM_BANDS);
+    METRIC_COUNT(COUNTER_ANALYSED_FRAMES, count);
+  }
+}
+
+// Port of getHash: all sub-fingerprints of one window of window_len samples.
+// Writes frames_per_window - 1 values and returns how many were written.
+int get_hash(HashContext *ctx, const PcmView *pcm, uint32_t *fingerprints) {
+  compute_band_energies(ctx, pcm, ctx->frames_per_window, ctx->energies);
+  return compute_all_sub_fingerprints(ctx->energies, ctx->frames_per_window,
+                                      fingerprints);
+}
+
+// Sub-fingerprints of one track in the order shazamClone.ts stores them:
+// window after window, frames_per_window - 1 values each.
+typedef struct {
+  uint32_t *hashes;
+  size_t count;
+  size_t capacity;
+} Fingerprints;
+
+int fingerprints_reserve(Fingerprints *fp, size_t extra) {
+  if (fp->count + extra <= fp->capacity) {
+    return 0;
+  }
+  size_t capacity = fp->capacity ? fp->capacity : 1024;
+  while (capacity < fp->count + extra) {
+    capacity *= 2;
+  }
+  uint32_t *grown = realloc(fp->hashes, capacity * sizeof(uint32_t));
+  if (grown == NULL) {
+    fprintf(stderr, "Unable to grow fingerprint buffer\n");
+    return -1;
+  }
+  fp->hashes = grown;
+  fp->capacity = capacity;
+  return 0;
+}
+
+// Hashes every whole 3.33 s window of a track, appending to fp.
+// Returns the number of windows hashed, or -1 on allocation failure.
+long hash_track(HashContext *ctx, const PcmView *pcm, size_t frames,
+                Fingerprints *fp) {
+  size_t windows = frames / ctx->window_len;
+
+  if (fingerprints_reserve(fp, windows * (ctx->frames_per_window - 1)) != 0) {
+    return -1;
+  }
+
+  for (size_t w = 0; w < windows; w++) {
+    PcmView window = pcm_view_at(pcm, w * ctx->window_len);
+    fp->count += get_hash(ctx, &window, fp->hashes + fp->count);
+  }
+
+  return (long)windows;
+}
+
+void print_fingerprints(const Fingerprints *fp, int per_window) {
+  for (size_t i = 0; i < fp->count; i++) {
+    printf("%zu %zu %u\n", i / per_window, i % per_window, fp->hashes[i]);
+  }
+}
+
+// Bulk writer for the fingerprint.db schema db.js creates. Each track is one
+// transaction: a songs row, then its sub-fingerprints sorted into primary
+// key order and sent through multi-row INSERTs, so each statement touches
+// neighbouring B-tree pages instead of one random leaf per row. Offsets are
+// the integer sub-fingerprint index within the track. With --defer-index the
+// secondary hash index is dropped for the load and built once on close.
+// Worker threads share the one connection under a lock.
+#define DB_BATCH_ROWS 256 // 3 parameters each, under SQLite's 999 limit
+
+typedef struct {
+  sqlite3 *db;
+  sqlite3_stmt *insert_song;
+  sqlite3_stmt *insert_batch;
+  sqlite3_stmt *insert_row;
+  pthread_mutex_t lock;
+  int defer_index;
+  uint64_t *rows; // hash << 32 | offset, the sort buffer
+  size_t rows_capacity;
+  size_t tracks;
+  size_t inserted;
+} FingerprintDb;
+
+FingerprintDb *fingerprint_db = NULL;
+
+int db_exec(sqlite3 *db, const char *sql) {
+  char *message = NULL;
+  if (sqlite3_exec(db, sql, NULL, NULL, &message) != SQLITE_OK) {
+    fprintf(stderr, "SQLite error: %s\n", message ? message : "unknown");
+    sqlite3_free(message);
+    return -1;
+  }
+  return 0;
+}
+
+int compare_rows(const void *a, const void *b) {
+  uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+  return (x > y) - (x < y);
+}
+
+void fingerprint_db_free(FingerprintDb *fdb) {
+  sqlite3_finalize(fdb->insert_song);
+  sqlite3_finalize(fdb->insert_batch);
+  sqlite3_finalize(fdb->insert_row);
+  sqlite3_close(fdb->db);
+  pthread_mutex_destroy(&fdb->lock);
+  free(fdb->rows);
+  free(fdb);
+}
+
+FingerprintDb *fingerprint_db_open(const char *path, int defer_index) {
+  FingerprintDb *fdb = calloc(1, sizeof(FingerprintDb));
+  if (fdb == NULL) {
+    fprintf(stderr, "Unable to allocate database writer\n");
+    return NULL;
+  }
+  pthread_mutex_init(&fdb->lock, NULL);
+  fdb->defer_index = defer_index;
+
+  if (sqlite3_open(path, &fdb->db) != SQLITE_OK) {
+    fprintf(stderr, "Unable to open %s: %s\n", path, sqlite3_errmsg(fdb->db));
+    fingerprint_db_free(fdb);
+    return NULL;
+  }
+
+  // WAL makes each per-track commit an append; NORMAL skips the fsync on
+  // every commit, which WAL keeps safe against corruption
+  if (db_exec(fdb->db, "PRAGMA journal_mode = WAL;"
+                       "PRAGMA synchronous = NORMAL;"
+                       "PRAGMA cache_size = -65536;"
+                       "PRAGMA temp_store = MEMORY;"
+                       "PRAGMA foreign_keys = ON;") != 0 ||
+      db_exec(fdb->db, "CREATE TABLE IF NOT EXISTS songs ("
+                       "  id INTEGER PRIMARY KEY AUTOINCREMENT,"
+                       "  name TEXT NOT NULL,"
+                       "  artist TEXT,"
+                       "  album TEXT);"
+                       "CREATE TABLE IF NOT EXISTS subfingerprints ("
+                       "  hash INTEGER NOT NULL,"
+                       "  song_id INTEGER NOT NULL,"
+                       "  offset INTEGER NOT NULL,"
+                       "  PRIMARY KEY (hash, song_id, offset),"
+                       "  FOREIGN KEY(song_id) REFERENCES songs(id));") != 0 ||
+      db_exec(fdb->db,
+              defer_index
+                  ? "DROP INDEX IF EXISTS idx_subfingerprints_hash;"
+                  : "CREATE INDEX IF NOT EXISTS idx_subfingerprints_hash "
+                    "ON subfingerprints(hash);") != 0) {
+    fingerprint_db_free(fdb);
+    return NULL;
+  }
+
+  char sql[128 + DB_BATCH_ROWS * sizeof(",(?, ?, ?)")];
+  int len = snprintf(sql, sizeof(sql),
+                     "INSERT OR IGNORE INTO subfingerprints "
+                     "(hash, song_id, offset) VALUES (?, ?, ?)");
+  for (int r = 1; r < DB_BATCH_ROWS; r++) {
+    len += snprintf(sql + len, sizeof(sql) - len, ",(?, ?, ?)");
+  }
+
+  if (sqlite3_prepare_v2(fdb->db,
+                         "INSERT INTO songs (id, name) VALUES (?, ?);", -1,
+                         &fdb->insert_song, NULL) != SQLITE_OK ||
+      sqlite3_prepare_v2(fdb->db, sql, -1, &fdb->insert_batch, NULL) !=
+          SQLITE_OK ||
+      sqlite3_prepare_v2(fdb->db,
+                         "INSERT OR IGNORE INTO subfingerprints "
+                         "(hash, song_id, offset) VALUES (?, ?, ?);",
+                         -1, &fdb->insert_row, NULL) != SQLITE_OK) {
+    fprintf(stderr, "SQLite error: %s\n", sqlite3_errmsg(fdb->db));
+    fingerprint_db_free(fdb);
+    return NULL;
+  }
+
+  return fdb;
+}
+
+// Runs stmt once after binding rows [0, count) starting at parameter 1.
+int insert_rows(sqlite3_stmt *stmt, sqlite3_int64 song_id,
+                const uint64_t *rows, int count) {
+  for (int r = 0; r < count; r++) {
+    sqlite3_bind_int64(stmt, 3 * r + 1, (sqlite3_int64)(rows[r] >> 32));
+    sqlite3_bind_int64(stmt, 3 * r + 2, song_id);
+    sqlite3_bind_int64(stmt, 3 * r + 3,
+                       (sqlite3_int64)(rows[r] & UINT32_MAX));
+  }
+  int rc = sqlite3_step(stmt);
+  sqlite3_reset(stmt);
+  return rc == SQLITE_DONE ? 0 : -1;
+}
+
+// Stores count sub-fingerprints under a new songs row. song_id 0 lets
+// SQLite assign the id; offsets NULL means hashes[i] is at offset i.
+int fingerprint_db_add_rows(FingerprintDb *fdb, sqlite3_int64 song_id,
+                            const char *name, const uint32_t *hashes,
+                            const uint32_t *offsets, size_t count) {
+  METRIC_CLOCK(db_start);
+  pthread_mutex_lock(&fdb->lock);
+
+  if (count > fdb->rows_capacity) {
+    uint64_t *grown = realloc(fdb->rows, count * sizeof(uint64_t));
+    if (grown == NULL) {
+      fprintf(stderr, "Unable to grow database row buffer\n");
+      pthread_mutex_unlock(&fdb->lock);
+      return -1;
+    }
+    fdb->rows = grown;
+    fdb->rows_capacity = count;
+  }
+  for (size_t i = 0; i < count; i++) {
+    fdb->rows[i] = (uint64_t)hashes[i] << 32 | (offsets ? offsets[i] : i);
+  }
+  qsort(fdb->rows, count, sizeof(uint64_t), compare_rows);
+
+  int failed = db_exec(fdb->db, "BEGIN;");
+
+  if (!failed) {
+    if (song_id > 0) {
+      sqlite3_bind_int64(fdb->insert_song, 1, song_id);
+    } else {
+      sqlite3_bind_null(fdb->insert_song, 1);
+    }
+    sqlite3_bind_text(fdb->insert_song, 2, name, -1, SQLITE_TRANSIENT);
+    failed = sqlite3_step(fdb->insert_song) != SQLITE_DONE;
+    sqlite3_reset(fdb->insert_song);
+    song_id = sqlite3_last_insert_rowid(fdb->db);
+  }
+
+  size_t i = 0;
+  for (; !failed && i + DB_BATCH_ROWS <= count; i += DB_BATCH_ROWS) {
+    failed = insert_rows(fdb->insert_batch, song_id, fdb->rows + i,
+                         DB_BATCH_ROWS) != 0;
+  }
+  for (; !failed && i < count; i++) {
+    failed = insert_rows(fdb->insert_row, song_id, fdb->rows + i, 1) != 0;
+  }
+
+  if (failed) {
+    fprintf(stderr, "Unable to store %s: %s\n", name,
+            sqlite3_errmsg(fdb->db));
+    db_exec(fdb->db, "ROLLBACK;");
+  } else if (db_exec(fdb->db, "COMMIT;") != 0) {
+    failed = 1;
+  } else {
+    fdb->tracks++;
+    fdb->inserted += count;
+  }
+
+  pthread_mutex_unlock(&fdb->lock);
+  if (!failed) {
+    METRIC_COUNT(COUNTER_DB_ROWS, count);
+    METRIC_OBSERVE_SINCE(HISTOGRAM_DB_US, db_start);
+  }
+  return failed ? -1 : 0;
+}
+
+// Stores one track under a new songs row named after the file.
+int fingerprint_db_add_track(FingerprintDb *fdb, const char *path,
+                             const uint32_t *hashes, size_t count) {
+  const char *name = strrchr(path, '/');
+  name = name ? name + 1 : path;
+  return fingerprint_db_add_rows(fdb, 0, name, hashes, NULL, count);
+}
+
+// Builds the deferred index, checkpoints the WAL and closes the database.
+int fingerprint_db_close(FingerprintDb *fdb) {
+  int status = 0;
+
+  if (fdb->defer_index &&
+      db_exec(fdb->db, "CREATE INDEX IF NOT EXISTS idx_subfingerprints_hash "
+                       "ON subfingerprints(hash);") != 0) {
+    status = -1;
+  }
+  if (db_exec(fdb->db, "PRAGMA wal_checkpoint(TRUNCATE);") != 0) {
+    status = -1;
+  }
+
+  printf("Stored %zu sub-fingerprints from %zu tracks\n", fdb->inserted,
+         fdb->tracks);
+  fingerprint_db_free(fdb);
+  return status;
+}
+
+// Read-only inverted index over fingerprint.db, written once by
+// --build-index and mmap'd by every query process, so lookups need no
+// deserialization and concurrent processes share the page cache. Entries are
+// sorted by hash; a bucket table on the top 16 bits bounds the search to the
+// low 16 bits, which are all that is stored per entry:
+//
+//   IndexHeader
+//   uint32_t buckets[65537]    first entry of each top-16-bit bucket
+//   uint16_t low[count]        low 16 bits of each hash, sorted per bucket
+//   IndexPosting postings[count]
+//
+// Sections start on 64-byte boundaries; all values are host-endian.
+#define INDEX_MAGIC "HACHIDX1"
+#define INDEX_VERSION 1
+#define INDEX_BUCKETS 65536
+
+typedef struct {
+  char magic[8];
+  uint32_t version;
+  uint32_t buckets;
+  uint64_t count;
+  uint64_t low_offset;
+  uint64_t postings_offset;
+  uint64_t size;
+} IndexHeader;
+
+typedef struct {
+  uint32_t song_id;
+  uint32_t offset; // sub-fingerprint index within the song
+} IndexPosting;
+
+typedef struct {
+  void *map;
+  size_t size;
+  uint64_t count;
+  const uint32_t *buckets;
+  const uint16_t *low;
+  const IndexPosting *postings;
+  void *owned; // the arrays above when built from a packed archive
+  // Packed archives written --with-postings have varint posting lists
+  uint32_t bucket_bits;
+  const uint64_t *runs;
+  const unsigned char *lists;
+} FingerprintIndex;
+
+size_t align64(size_t n) { return (n + 63) & ~(size_t)63; }
+
+// Streams the rows in primary key order (already sorted by hash) into
+// out_path through a temporary file renamed into place, so running readers
+// keep their old mapping.
+int build_index(const char *db_path, const char *out_path) {
+  sqlite3 *db;
+  sqlite3_stmt *stmt = NULL;
+
+  if (sqlite3_open_v2(db_path, &db, SQLITE_OPEN_READONLY, NULL) != SQLITE_OK) {
+    fprintf(stderr, "Unable to open %s: %s\n", db_path, sqlite3_errmsg(db));
+    sqlite3_close(db);
+    return -1;
+  }
+
+  uint64_t count = 0;
+  if (sqlite3_prepare_v2(db, "SELECT count(*) FROM subfingerprints;", -1,
+                         &stmt, NULL) != SQLITE_OK ||
+      sqlite3_step(stmt) != SQLITE_ROW) {
+    fprintf(stderr, "SQLite error: %s\n", sqlite3_errmsg(db));
+    sqlite3_finalize(stmt);
+    sqlite3_close(db);
+    return -1;
+  }
+  count = (uint64_t)sqlite3_column_int64(stmt, 0);
+  sqlite3_finalize(stmt);
+
+  IndexHeader header = {.magic = INDEX_MAGIC,
+                        .version = INDEX_VERSION,
+                        .buckets = INDEX_BUCKETS,
+                        .count = count};
+  size_t buckets_size = (INDEX_BUCKETS + 1) * sizeof(uint32_t);
+  header.low_offset = align64(sizeof(IndexHeader)) + align64(buckets_size);
+  header.postings_offset =
+      header.low_offset + align64(count * sizeof(uint16_t));
+  header.size = header.postings_offset + count * sizeof(IndexPosting);
+
+  uint32_t *buckets = calloc(INDEX_BUCKETS + 1, sizeof(uint32_t));
+  uint16_t *low = malloc((count + 1) * sizeof(uint16_t));
+  IndexPosting *postings = malloc((count + 1) * sizeof(IndexPosting));
+  if (buckets == NULL || low == NULL || postings == NULL) {
+    fprintf(stderr, "Unable to allocate index buffers\n");
+    free(buckets);
+    free(low);
+    free(postings);
+    sqlite3_close(db);
+    return -1;
+  }
+
+  uint64_t n = 0;
+  int rc = sqlite3_prepare_v2(db,
+                              "SELECT hash, song_id, offset FROM "
+                              "subfingerprints ORDER BY hash, song_id, offset;",
+                              -1, &stmt, NULL);
+  while (rc == SQLITE_OK && (rc = sqlite3_step(stmt)) == SQLITE_ROW &&
+         n < count) {
+    uint32_t hash = (uint32_t)sqlite3_column_int64(stmt, 0);
+    buckets[(hash >> 16) + 1]++;
+    low[n] = (uint16_t)hash;
+    postings[n].song_id = (uint32_t)sqlite3_column_int64(stmt, 1);
+    postings[n].offset = (uint32_t)sqlite3_column_int64(stmt, 2);
+    n++;
+    rc = SQLITE_OK;
+  }
+  int ok = rc == SQLITE_DONE && n == count;
+  if (!ok) {
+    fprintf(stderr, "Unable to read %s: %s\n", db_path, sqlite3_errmsg(db));
+  }
+  sqlite3_finalize(stmt);
+  sqlite3_close(db);
+
+  // counts -> prefix sums
+  for (int b = 0; b < INDEX_BUCKETS; b++) {
+    buckets[b + 1] += buckets[b];
+  }
+
+  char tmp_path[PATH_MAX];
+  FILE *out = NULL;
+  if (ok && snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", out_path) >=
+                (int)sizeof(tmp_path)) {
+    fprintf(stderr, "Index path too long: %s\n", out_path);
+    ok = 0;
+  }
+  if (ok && (out = fopen(tmp_path, "wb")) == NULL) {
+    fprintf(stderr, "Unable to create %s: %s\n", tmp_path, strerror(errno));
+    ok = 0;
+  }
+
+  if (ok) {
+    static const char zeros[64];
+    size_t buckets_at = align64(sizeof(IndexHeader));
+    ok = fwrite(&header, sizeof(header), 1, out) == 1 &&
+         fwrite(zeros, 1, buckets_at - sizeof(header), out) ==
+             buckets_at - sizeof(header) &&
+         fwrite(buckets, buckets_size, 1, out) == 1 &&
+         fwrite(zeros, 1, header.low_offset - buckets_at - buckets_size,
+                out) == header.low_offset - buckets_at - buckets_size &&
+         fwrite(low, sizeof(uint16_t), count, out) == count &&
+         fwrite(zeros, 1,
+                header.postings_offset - header.low_offset -
+                    count * sizeof(uint16_t),
+                out) == header.postings_offset - header.low_offset -
+                            count * sizeof(uint16_t) &&
+         fwrite(postings, sizeof(IndexPosting), count, out) == count;
+    if (fclose(out) != 0) {
+      ok = 0;
+    }
+    if (!ok) {
+      fprintf(stderr, "Unable to write %s\n", tmp_path);
+      unlink(tmp_path);
+    } else if (rename(tmp_path, out_path) != 0) {
+      fprintf(stderr, "Unable to rename %s: %s\n", tmp_path, strerror(errno));
+      unlink(tmp_path);
+      ok = 0;
+    }
+  }
+
+  free(buckets);
+  free(low);
+  free(postings);
+
+  if (ok) {
+    printf("Indexed %llu sub-fingerprints into %s (%llu bytes)\n",
+           (unsigned long long)count, out_path,
+           (unsigned long long)header.size);
+  }
+  return ok ? 0 : -1;
+}
+
+// Compact fingerprint archives, loaded with one mmap. A song file
+// (--archive-dir) holds one track's sub-fingerprints; a packed archive
+// (--pack) holds a whole catalogue, and --query and --listen read it in
+// place of an index file. Both store hashes as raw uint32 blocks, the
+// offset of each value implied by its position in the block, so a
+// sub-fingerprint costs 4 bytes against about 40 for a fingerprint.db row:
+//
+//   SongFileHeader, char name[name_len]     song file
+//   ArchiveBlock, uint32_t hashes[count]    repeated
+//
+//   ArchiveHeader                           packed archive
+//   ArchiveBlock, uint32_t hashes[count]    every song's blocks, in song order
+//   ArchiveSong songs[songs]
+//   char names[]
+//   posting lists                           --with-postings only
+//   uint64_t runs[(1 << bucket_bits) + 1]   start of each run in the lists
+//
+// A gap in a song's offsets starts a new block. By default the inverted
+// index is rebuilt in memory from the blocks when the archive is opened,
+// which costs a sort of the catalogue per process. --with-postings stores
+// it instead, at about 7 more bytes per sub-fingerprint, as varint posting
+// lists that lookups decode in place; bucket_bits is 0 without them.
+// Buckets split hashes on their top bucket_bits, chosen for about
+// ARCHIVE_BUCKET_POSTINGS postings each. A run walks its distinct hashes
+// in order, each as
+// varint(low bits - previous low bits) and varint(postings), then per
+// posting in (song_id, offset) order varint(song_id delta) and
+// varint(offset), the offset coded as a delta when the song repeats.
+// Sections after the blocks start on 64-byte boundaries; all values are
+// host-endian.
+#define ARCHIVE_MAGIC "HACHARC1"
+#define SONG_FILE_MAGIC "HACHSNG1"
+#define ARCHIVE_VERSION 1
+#define ARCHIVE_BLOCK_MAGIC 0x314b4c42u // "BLK1"
+#define ARCHIVE_BLOCK_VALUES 4096
+#define ARCHIVE_BUCKET_POSTINGS 16
+#define ARCHIVE_MIN_BUCKET_BITS 8
+#define ARCHIVE_MAX_BUCKET_BITS 24
+
+typedef struct {
+  uint32_t magic;
+  uint32_t song_id; // 0 in song files
+  uint32_t first;   // offset of hashes[0]
+  uint32_t count;
+} ArchiveBlock;
+
+typedef struct {
+  char magic[8];
+  uint32_t version;
+  uint32_t name_len;
+  uint64_t count;
+} SongFileHeader;
+
+typedef struct {
+  char magic[8];
+  uint32_t version;
+  uint32_t bucket_bits;
+  uint64_t songs;
+  uint64_t count;
+  uint64_t songs_offset;
+  uint64_t names_offset;
+  uint64_t lists_offset;
+  uint64_t runs_offset;
+  uint64_t size;
+} ArchiveHeader;
+
+typedef struct {
+  uint32_t song_id;
+  uint32_t name_len;
+  uint64_t name_offset;   // within names
+  uint64_t blocks_offset; // from the start of the file
+  uint64_t blocks;
+  uint64_t count;
+} ArchiveSong;
+
+typedef struct {
+  uint32_t hash;
+  uint32_t song_id;
+  uint32_t offset;
+} ArchiveRow;
+
+int compare_archive_rows(const void *a, const void *b) {
+  const ArchiveRow *x = a, *y = b;
+  if (x->hash != y->hash) {
+    return x->hash < y->hash ? -1 : 1;
+  }
+  if (x->song_id != y->song_id) {
+    return x->song_id < y->song_id ? -1 : 1;
+  }
+  return (x->offset > y->offset) - (x->offset < y->offset);
+}
+
+// Reads one varint from [*p, end) into *value. Returns -1 when it runs
+// past end, which only a corrupt list does.
+int get_varint(const unsigned char **p, const unsigned char *end,
+               uint64_t *value) {
+  uint64_t v = 0;
+  for (int shift = 0; *p < end && shift < 64; shift += 7) {
+    unsigned char byte = *(*p)++;
+    v |= (uint64_t)(byte & 0x7f) << shift;
+    if (!(byte & 0x80)) {
+      *value = v;
+      return 0;
+    }
+  }
+  return -1;
+}
+
+// Writes a packed archive front to back: songs and their blocks, then the
+// posting lists fed in (hash, song_id, offset) order, then the bucket table
+// and finally the header over the placeholder at the start.
+typedef struct {
+  FILE *out;
+  char tmp_path[PATH_MAX];
+  uint64_t pos;
+  int failed;
+  int postings; // write posting lists after the song table
+  ArchiveHeader header;
+  ArchiveSong *songs;
+  size_t songs_capacity;
+  char *names;
+  size_t names_len;
+  size_t names_capacity;
+  ArchiveBlock block;
+  uint32_t values[ARCHIVE_BLOCK_VALUES];
+  uint64_t *runs;
+  uint64_t bucket; // next bucket whose start is unset
+  uint32_t prev_key;
+  uint32_t hash; // hash of the pending postings
+  IndexPosting *pending;
+  size_t pending_count;
+  size_t pending_capacity;
+} ArchiveWriter;
+
+void archive_write(ArchiveWriter *aw, const void *data, size_t len) {
+  if (!aw->failed && fwrite(data, 1, len, aw->out) != len) {
+    aw->failed = 1;
+  }
+  aw->pos += len;
+}
+
+void archive_pad(ArchiveWriter *aw) {
+  static const char zeros[64];
+  archive_write(aw, zeros, align64(aw->pos) - aw->pos);
+}
+
+void archive_put_varint(ArchiveWriter *aw, uint64_t value) {
+  unsigned char buf[10];
+  size_t len = 0;
+  while (value >= 0x80) {
+    buf[len++] = (unsigned char)value | 0x80;
+    value >>= 7;
+  }
+  buf[len++] = (unsigned char)value;
+  archive_write(aw, buf, len);
+}
+
+int archive_writer_open(ArchiveWriter *aw, const char *path, int postings) {
+  memset(aw, 0, sizeof(*aw));
+  aw->postings = postings;
+  memcpy(aw->header.magic, ARCHIVE_MAGIC, 8);
+  aw->header.version = ARCHIVE_VERSION;
+
+  if (snprintf(aw->tmp_path, sizeof(aw->tmp_path), "%s.tmp", path) >=
+      (int)sizeof(aw->tmp_path)) {
+    fprintf(stderr, "Archive path too long: %s\n", path);
+    return -1;
+  }
+  if ((aw->out = fopen(aw->tmp_path, "wb")) == NULL) {
+    fprintf(stderr, "Unable to create %s: %s\n", aw->tmp_path,
+            strerror(errno));
+    return -1;
+  }
+  archive_write(aw, &aw->header, sizeof(aw->header));
+  archive_pad(aw);
+  return 0;
+}
+
+void archive_flush_block(ArchiveWriter *aw) {
+  if (aw->block.count == 0) {
+    return;
+  }
+  archive_write(aw, &aw->block, sizeof(aw->block));
+  archive_write(aw, aw->values, aw->block.count * sizeof(uint32_t));
+  aw->songs[aw->header.songs - 1].blocks++;
+  aw->block.count = 0;
+}
+
+int archive_begin_song(ArchiveWriter *aw, uint32_t song_id, const char *name) {
+  size_t name_len = strlen(name);
+
+  if (aw->header.songs == aw->songs_capacity) {
+    size_t capacity = aw->songs_capacity ? aw->songs_capacity * 2 : 64;
+    ArchiveSong *songs = realloc(aw->songs, capacity * sizeof(ArchiveSong));
+    if (songs == NULL) {
+      fprintf(stderr, "Unable to grow archive song table\n");
+      return -1;
+    }
+    aw->songs = songs;
+    aw->songs_capacity = capacity;
+  }
+  if (aw->names_len + name_len > aw->names_capacity) {
+    size_t capacity = aw->names_capacity ? aw->names_capacity : 4096;
+    while (aw->names_len + name_len > capacity) {
+      capacity *= 2;
+    }
+    char *names = realloc(aw->names, capacity);
+    if (names == NULL) {
+      fprintf(stderr, "Unable to grow archive name table\n");
+      return -1;
+    }
+    aw->names = names;
+    aw->names_capacity = capacity;
+  }
+
+  aw->songs[aw->header.songs++] =
+      (ArchiveSong){song_id, (uint32_t)name_len, aw->names_len, aw->pos, 0, 0};
+  memcpy(aw->names + aw->names_len, name, name_len);
+  aw->names_len += name_len;
+  return 0;
+}
+
+// Appends the sub-fingerprint at offset of the current song; offsets must
+// increase.
+void archive_add_value(ArchiveWriter *aw, uint32_t offset, uint32_t hash) {
+  ArchiveSong *song = &aw->songs[aw->header.songs - 1];
+
+  if (aw->block.count == ARCHIVE_BLOCK_VALUES ||
+      (aw->block.count > 0 && offset != aw->block.first + aw->block.count)) {
+    archive_flush_block(aw);
+  }
+  if (aw->block.count == 0) {
+    aw->block = (ArchiveBlock){ARCHIVE_BLOCK_MAGIC, song->song_id, offset, 0};
+  }
+  aw->values[aw->block.count++] = hash;
+  song->count++;
+  aw->header.count++;
+}
+
+void archive_end_song(ArchiveWriter *aw) { archive_flush_block(aw); }
+
+// Writes the song table and sizes the bucket table for the postings to
+// come, if the archive has them.
+int archive_begin_index(ArchiveWriter *aw) {
+  archive_pad(aw);
+  aw->header.songs_offset = aw->pos;
+  archive_write(aw, aw->songs, aw->header.songs * sizeof(ArchiveSong));
+  aw->header.names_offset = aw->pos;
+  archive_write(aw, aw->names, aw->names_len);
+  archive_pad(aw);
+  aw->header.lists_offset = aw->pos;
+  if (!aw->postings) {
+    return 0;
+  }
+
+  uint32_t bits = ARCHIVE_MIN_BUCKET_BITS;
+  while (bits < ARCHIVE_MAX_BUCKET_BITS &&
+         ((uint64_t)ARCHIVE_BUCKET_POSTINGS << bits) < aw->header.count) {
+    bits++;
+  }
+  aw->header.bucket_bits = bits;
+  aw->runs = calloc(((size_t)1 << bits) + 1, sizeof(uint64_t));
+  if (aw->runs == NULL) {
+    fprintf(stderr, "Unable to allocate archive bucket table\n");
+    return -1;
+  }
+  return 0;
+}
+
+void archive_flush_hash(ArchiveWriter *aw) {
+  if (aw->pending_count == 0) {
+    return;
+  }
+
+  int shift = 32 - (int)aw->header.bucket_bits;
+  uint64_t bucket = aw->hash >> shift;
+  uint32_t key = aw->hash & (((uint32_t)1 << shift) - 1);
+  while (aw->bucket <= bucket) {
+    aw->runs[aw->bucket++] = aw->pos - aw->header.lists_offset;
+    aw->prev_key = 0;
+  }
+
+  archive_put_varint(aw, key - aw->prev_key);
+  archive_put_varint(aw, aw->pending_count);
+  aw->prev_key = key;
+
+  uint32_t song_id = 0, offset = 0;
+  for (size_t i = 0; i < aw->pending_count; i++) {
+    const IndexPosting *p = &aw->pending[i];
+    archive_put_varint(aw, p->song_id - song_id);
+    archive_put_varint(aw, p->song_id == song_id ? p->offset - offset
+                                                 : p->offset);
+    song_id = p->song_id;
+    offset = p->offset;
+  }
+  aw->pending_count = 0;
+}
+
+// Adds one posting; calls must come in (hash, song_id, offset) order.
+int archive_add_posting(ArchiveWriter *aw, uint32_t hash, uint32_t song_id,
+                        uint32_t offset) {
+  if (aw->pending_count > 0 && hash != aw->hash) {
+    archive_flush_hash(aw);
+  }
+  if (aw->pending_count == aw->pending_capacity) {
+    size_t capacity = aw->pending_capacity ? aw->pending_capacity * 2 : 256;
+    IndexPosting *pending =
+        realloc(aw->pending, capacity * sizeof(IndexPosting));
+    if (pending == NULL) {
+      fprintf(stderr, "Unable to grow archive posting buffer\n");
+      return -1;
+    }
+    aw->pending = pending;
+    aw->pending_capacity = capacity;
+  }
+  aw->hash = hash;
+  aw->pending[aw->pending_count++] = (IndexPosting){song_id, offset};
+  return 0;
+}
+
+// Finishes the archive and renames it into place, or discards it if ok is
+// 0 or anything failed to write.
+int archive_writer_close(ArchiveWriter *aw, const char *path, int ok) {
+  if (ok && aw->runs != NULL) {
+    archive_flush_hash(aw);
+    uint64_t buckets = (uint64_t)1 << aw->header.bucket_bits;
+    while (aw->bucket <= buckets) {
+      aw->runs[aw->bucket++] = aw->pos - aw->header.lists_offset;
+    }
+    archive_pad(aw);
+    aw->header.runs_offset = aw->pos;
+    archive_write(aw, aw->runs, (buckets + 1) * sizeof(uint64_t));
+  } else if (ok) {
+    aw->header.runs_offset = aw->pos;
+  }
+
+  if (ok) {
+    aw->header.size = aw->pos;
+    if (!aw->failed && fseeko(aw->out, 0, SEEK_SET) != 0) {
+      aw->failed = 1;
+    }
+    archive_write(aw, &aw->header, sizeof(aw->header));
+  }
+
+  if (fclose(aw->out) != 0) {
+    aw->failed = 1;
+  }
+  if (ok && aw->failed) {
+    fprintf(stderr, "Unable to write %s\n", aw->tmp_path);
+    ok = 0;
+  }
+  if (ok && rename(aw->tmp_path, path) != 0) {
+    fprintf(stderr, "Unable to rename %s: %s\n", aw->tmp_path,
+            strerror(errno));
+    ok = 0;
+  }
+  if (!ok) {
+    unlink(aw->tmp_path);
+  }
+
+  free(aw->songs);
+  free(aw->names);
+  free(aw->runs);
+  free(aw->pending);
+  return ok ? 0 : -1;
+}
+
+const char *song_file_dir = NULL; // --archive-dir
+
+// Writes the song file for the track at path into dir, named after the
+// track with its extension replaced by .hfp.
+int write_song_file(const char *dir, const char *path, const uint32_t *hashes,
+                    size_t count) {
+  const char *name = strrchr(path, '/');
+  name = name ? name + 1 : path;
+  const char *dot = strrchr(name, '.');
+  int stem = dot && dot != name ? (int)(dot - name) : (int)strlen(name);
+
+  char out_path[PATH_MAX], tmp_path[PATH_MAX];
+  if (snprintf(out_path, sizeof(out_path), "%s/%.*s.hfp", dir, stem, name) >=
+          (int)sizeof(out_path) ||
+      snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", out_path) >=
+          (int)sizeof(tmp_path)) {
+    fprintf(stderr, "Song file path too long: %s/%s\n", dir, name);
+    return -1;
+  }
+
+  FILE *out = fopen(tmp_path, "wb");
+  if (out == NULL) {
+    fprintf(stderr, "Unable to create %s: %s\n", tmp_path, strerror(errno));
+    return -1;
+  }
+
+  SongFileHeader header = {.magic = SONG_FILE_MAGIC,
+                           .version = ARCHIVE_VERSION,
+                           .name_len = (uint32_t)strlen(name),
+                           .count = count};
+  int ok = fwrite(&header, sizeof(header), 1, out) == 1 &&
+           fwrite(name, 1, header.name_len, out) == header.name_len;
+  for (size_t i = 0; ok && i < count; i += ARCHIVE_BLOCK_VALUES) {
+    size_t n = count - i < ARCHIVE_BLOCK_VALUES ? count - i
+                                                : ARCHIVE_BLOCK_VALUES;
+    ArchiveBlock block = {ARCHIVE_BLOCK_MAGIC, 0, (uint32_t)i, (uint32_t)n};
+    ok = fwrite(&block, sizeof(block), 1, out) == 1 &&
+         fwrite(hashes + i, sizeof(uint32_t), n, out) == n;
+  }
+  if (fclose(out) != 0) {
+    ok = 0;
+  }
+
+  if (!ok) {
+    fprintf(stderr, "Unable to write %s\n", tmp_path);
+    unlink(tmp_path);
+    return -1;
+  }
+  if (rename(tmp_path, out_path) != 0) {
+    fprintf(stderr, "Unable to rename %s: %s\n", tmp_path, strerror(errno));
+    unlink(tmp_path);
+    return -1;
+  }
+  return 0;
+}
+
+// Packs fingerprint.db: blocks from the rows in (song_id, offset) order,
+// then any postings from the primary key order.
+int pack_from_db(ArchiveWriter *aw, const char *db_path) {
+  sqlite3 *db;
+  sqlite3_stmt *stmt = NULL, *names = NULL;
+
+  if (sqlite3_open_v2(db_path, &db, SQLITE_OPEN_READONLY, NULL) != SQLITE_OK) {
+    fprintf(stderr, "Unable to open %s: %s\n", db_path, sqlite3_errmsg(db));
+    sqlite3_close(db);
+    return -1;
+  }
+
+  // Older shazamClone.ts databases hold offsets in fractional seconds,
+  // which have no position in a block
+  if (sqlite3_prepare_v2(db,
+                         "SELECT count(*) FROM subfingerprints "
+                         "WHERE offset <> CAST(offset AS INTEGER);",
+                         -1, &stmt, NULL) == SQLITE_OK &&
+      sqlite3_step(stmt) == SQLITE_ROW && sqlite3_column_int64(stmt, 0) > 0) {
+    fprintf(stderr, "Skipping %lld sub-fingerprints with non-integer offsets\n",
+            (long long)sqlite3_column_int64(stmt, 0));
+  }
+  sqlite3_finalize(stmt);
+
+  int rc = sqlite3_prepare_v2(db,
+                              "SELECT song_id, offset, hash FROM "
+                              "subfingerprints WHERE offset = CAST(offset AS "
+                              "INTEGER) ORDER BY song_id, offset;",
+                              -1, &stmt, NULL);
+  if (rc == SQLITE_OK) {
+    rc = sqlite3_prepare_v2(db, "SELECT name FROM songs WHERE id = ?;", -1,
+                            &names, NULL);
+  }
+
+  int have_song = 0;
+  sqlite3_int64 current = 0;
+  while (rc == SQLITE_OK && (rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+    sqlite3_int64 song_id = sqlite3_column_int64(stmt, 0);
+    if (!have_song || song_id != current) {
+      if (have_song) {
+        archive_end_song(aw);
+      }
+      sqlite3_bind_int64(names, 1, song_id);
+      const char *name = sqlite3_step(names) == SQLITE_ROW
+                             ? (const char *)sqlite3_column_text(names, 0)
+                             : NULL;
+      int failed = archive_begin_song(aw, (uint32_t)song_id, name ? name : "");
+      sqlite3_reset(names);
+      if (failed) {
+        break;
+      }
+      have_song = 1;
+      current = song_id;
+    }
+    archive_add_value(aw, (uint32_t)sqlite3_column_int64(stmt, 1),
+                      (uint32_t)sqlite3_column_int64(stmt, 2));
+    rc = SQLITE_OK;
+  }
+  if (have_song) {
+    archive_end_song(aw);
+  }
+  if (rc != SQLITE_DONE && rc != SQLITE_ROW) {
+    fprintf(stderr, "Unable to read %s: %s\n", db_path, sqlite3_errmsg(db));
+  }
+  sqlite3_finalize(stmt);
+  sqlite3_finalize(names);
+  stmt = NULL;
+
+  int ok = rc == SQLITE_DONE && archive_begin_index(aw) == 0;
+  if (ok && !aw->postings) {
+    sqlite3_close(db);
+    return 0;
+  }
+  rc = ok ? sqlite3_prepare_v2(db,
+                               "SELECT hash, song_id, offset FROM "
+                               "subfingerprints WHERE offset = CAST(offset AS "
+                               "INTEGER) ORDER BY hash, song_id, offset;",
+                               -1, &stmt, NULL)
+          : SQLITE_ERROR;
+  while (rc == SQLITE_OK && (rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+    if (archive_add_posting(aw, (uint32_t)sqlite3_column_int64(stmt, 0),
+                            (uint32_t)sqlite3_column_int64(stmt, 1),
+                            (uint32_t)sqlite3_column_int64(stmt, 2)) != 0) {
+      break;
+    }
+    rc = SQLITE_OK;
+  }
+  if (ok && rc != SQLITE_DONE && rc != SQLITE_ROW) {
+    fprintf(stderr, "Unable to read %s: %s\n", db_path, sqlite3_errmsg(db));
+  }
+  ok = ok && rc == SQLITE_DONE;
+  sqlite3_finalize(stmt);
+  sqlite3_close(db);
+  return ok ? 0 : -1;
+}
+
+int is_song_file(const struct dirent *entry) {
+  size_t len = strlen(entry->d_name);
+  return len > 4 && strcmp(entry->d_name + len - 4, ".hfp") == 0;
+}
+
+// Appends the song file at path as song_id, collecting its postings into
+// rows unless that is NULL.
+int pack_song_file(ArchiveWriter *aw, const char *path, uint32_t song_id,
+                   uint32_t *values, ArchiveRow **rows, size_t *count,
+                   size_t *capacity) {
+  FILE *fp = fopen(path, "rb");
+  if (fp == NULL) {
+    perror(path);
+    return -1;
+  }
+
+  SongFileHeader header;
+  char name[PATH_MAX];
+  int ok = fread(&header, sizeof(header), 1, fp) == 1 &&
+           memcmp(header.magic, SONG_FILE_MAGIC, 8) == 0 &&
+           header.version == ARCHIVE_VERSION &&
+           header.name_len < sizeof(name) &&
+           fread(name, 1, header.name_len, fp) == header.name_len;
+  if (ok) {
+    name[header.name_len] = '\0';
+    ok = archive_begin_song(aw, song_id, name) == 0;
+  }
+
+  if (ok && rows != NULL && *count + header.count > *capacity) {
+    size_t grown = *capacity ? *capacity : 65536;
+    while (*count + header.count > grown) {
+      grown *= 2;
+    }
+    ArchiveRow *resized = realloc(*rows, grown * sizeof(ArchiveRow));
+    if (resized == NULL) {
+      fprintf(stderr, "Unable to grow archive row buffer\n");
+      fclose(fp);
+      return -1;
+    }
+    *rows = resized;
+    *capacity = grown;
+  }
+
+  uint64_t seen = 0;
+  ArchiveBlock block;
+  while (ok && seen < header.count) {
+    ok = fread(&block, sizeof(block), 1, fp) == 1 &&
+         block.magic == ARCHIVE_BLOCK_MAGIC &&
+         block.count <= ARCHIVE_BLOCK_VALUES &&
+         block.count <= header.count - seen &&
+         fread(values, sizeof(uint32_t), block.count, fp) == block.count;
+    for (uint32_t i = 0; ok && i < block.count; i++) {
+      archive_add_value(aw, block.first + i, values[i]);
+      if (rows != NULL) {
+        (*rows)[(*count)++] =
+            (ArchiveRow){values[i], song_id, block.first + i};
+      }
+    }
+    seen += block.count;
+  }
+  if (ok) {
+    archive_end_song(aw);
+  } else {
+    fprintf(stderr, "Invalid song file: %s\n", path);
+  }
+  fclose(fp);
+  return ok ? 0 : -1;
+}
+
+// Packs every *.hfp in dir, numbering the songs from 1 in name order. Any
+// postings are sorted in memory.
+int pack_from_dir(ArchiveWriter *aw, const char *dir) {
+  struct dirent **entries;
+  int n = scandir(dir, &entries, is_song_file, alphasort);
+  if (n < 0) {
+    perror(dir);
+    return -1;
+  }
+
+  uint32_t *values = malloc(ARCHIVE_BLOCK_VALUES * sizeof(uint32_t));
+  ArchiveRow *rows = NULL;
+  size_t count = 0, capacity = 0;
+  int ok = values != NULL;
+  if (!ok) {
+    fprintf(stderr, "Unable to allocate song file buffer\n");
+  }
+
+  char path[PATH_MAX];
+  for (int i = 0; i < n; i++) {
+    if (ok) {
+      snprintf(path, sizeof(path), "%s/%s", dir, entries[i]->d_name);
+      ok = pack_song_file(aw, path, (uint32_t)i + 1, values,
+                          aw->postings ? &rows : NULL, &count,
+                          &capacity) == 0;
+    }
+    free(entries[i]);
+  }
+  free(entries);
+  free(values);
+
+  if (ok) {
+    qsort(rows, count, sizeof(ArchiveRow), compare_archive_rows);
+    ok = archive_begin_index(aw) == 0;
+  }
+  for (size_t i = 0; ok && i < count; i++) {
+    ok = archive_add_posting(aw, rows[i].hash, rows[i].song_id,
+                             rows[i].offset) == 0;
+  }
+  free(rows);
+  return ok ? 0 : -1;
+}
+
+// Packs source, either fingerprint.db or a directory of song files, into
+// the archive at out_path, with posting lists if postings is set.
+int pack_archive(const char *source, const char *out_path, int postings) {
+  ArchiveWriter aw;
+  struct stat st;
+
+  if (archive_writer_open(&aw, out_path, postings) != 0) {
+    return -1;
+  }
+  int ok = (stat(source, &st) == 0 && S_ISDIR(st.st_mode)
+                ? pack_from_dir(&aw, source)
+                : pack_from_db(&aw, source)) == 0;
+  if (archive_writer_close(&aw, out_path, ok) != 0) {
+    return -1;
+  }
+
+  printf("Packed %llu sub-fingerprints from %llu songs into %s (%llu bytes, "
+         "%.2f per sub-fingerprint)\n",
+         (unsigned long long)aw.header.count,
+         (unsigned long long)aw.header.songs, out_path,
+         (unsigned long long)aw.header.size,
+         aw.header.count ? (double)aw.header.size / aw.header.count : 0.0);
+  return 0;
+}
+
+// Checks the header of the packed archive idx maps, and the bucket table
+// when it has posting lists, so lookups never leave the map.
+int archive_validate(const FingerprintIndex *idx) {
+  const ArchiveHeader *header = idx->map;
+  if (idx->size < sizeof(ArchiveHeader) ||
+      header->version != ARCHIVE_VERSION || header->size != idx->size ||
+      header->songs_offset < align64(sizeof(ArchiveHeader)) ||
+      header->songs_offset % 8 ||
+      header->songs_offset > header->names_offset ||
+      header->songs >
+          (header->names_offset - header->songs_offset) / sizeof(ArchiveSong) ||
+      header->names_offset > header->lists_offset ||
+      header->lists_offset > header->runs_offset ||
+      header->runs_offset > header->size) {
+    return -1;
+  }
+
+  if (header->bucket_bits == 0) {
+    return header->runs_offset == header->size ? 0 : -1;
+  }
+  if (header->bucket_bits < ARCHIVE_MIN_BUCKET_BITS ||
+      header->bucket_bits > ARCHIVE_MAX_BUCKET_BITS ||
+      header->runs_offset % 8 ||
+      header->runs_offset +
+              (((uint64_t)1 << header->bucket_bits) + 1) * sizeof(uint64_t) !=
+          header->size) {
+    return -1;
+  }
+
+  const uint64_t *runs =
+      (const uint64_t *)((const char *)idx->map + header->runs_offset);
+  size_t buckets = (size_t)1 << header->bucket_bits;
+  for (size_t b = 0; b < buckets; b++) {
+    if (runs[b] > runs[b + 1]) {
+      return -1;
+    }
+  }
+  return runs[buckets] <= header->runs_offset - header->lists_offset ? 0
+                                                                     : -1;
+}
+
+// The block at byte offset at of the archive idx maps, or NULL when that is
+// not a whole block inside the block section.
+const ArchiveBlock *archive_block(const FingerprintIndex *idx, uint64_t at) {
+  const ArchiveHeader *header = idx->map;
+  if (at % 4 || at > header->songs_offset ||
+      header->songs_offset - at < sizeof(ArchiveBlock)) {
+    return NULL;
+  }
+  const ArchiveBlock *block =
+      (const ArchiveBlock *)((const char *)idx->map + at);
+  if (block->magic != ARCHIVE_BLOCK_MAGIC ||
+      block->count > (header->songs_offset - at - sizeof(ArchiveBlock)) /
+                         sizeof(uint32_t)) {
+    return NULL;
+  }
+  return block;
+}
+
+// Builds the buckets, low and postings of an index file in memory from the
+// blocks of an archive without posting lists: one pass counts the top 16
+// bits of every hash, a second places the entries by bucket, then each
+// bucket is sorted on its own.
+int archive_build_index(FingerprintIndex *idx) {
+  const ArchiveHeader *header = idx->map;
+  const ArchiveSong *songs =
+      (const ArchiveSong *)((const char *)idx->map + header->songs_offset);
+  uint64_t count = header->count;
+  if (count > header->songs_offset / sizeof(uint32_t)) {
+    return -1;
+  }
+
+  size_t buckets_size = (INDEX_BUCKETS + 1) * sizeof(uint32_t);
+  size_t low_size = (count * sizeof(uint16_t) + 7) & ~(size_t)7;
+  char *owned = malloc(buckets_size + low_size + count * sizeof(IndexPosting));
+  uint32_t *buckets = (uint32_t *)owned;
+  uint32_t *cursor = calloc(INDEX_BUCKETS + 1, sizeof(uint32_t));
+  ArchiveRow *rows = malloc((count + 1) * sizeof(ArchiveRow));
+  if (owned == NULL || cursor == NULL || rows == NULL) {
+    fprintf(stderr, "Unable to allocate archive index\n");
+    free(owned);
+    free(cursor);
+    free(rows);
+    return -2;
+  }
+  memset(buckets, 0, buckets_size);
+  madvise(idx->map, header->songs_offset, MADV_SEQUENTIAL);
+
+  int ok = 1;
+  for (int pass = 0; ok && pass < 2; pass++) {
+    uint64_t seen = 0;
+    for (uint64_t s = 0; ok && s < header->songs; s++) {
+      const ArchiveSong *song = &songs[s];
+      uint64_t at = song->blocks_offset, n = 0;
+      for (uint64_t b = 0; ok && b < song->blocks; b++) {
+        const ArchiveBlock *block = archive_block(idx, at);
+        if (block == NULL || block->count > song->count - n ||
+            block->count > count - seen - n) {
+          ok = 0;
+          break;
+        }
+        const uint32_t *values = (const uint32_t *)(block + 1);
+        for (uint32_t i = 0; i < block->count; i++) {
+          if (pass == 0) {
+            buckets[(values[i] >> 16) + 1]++;
+          } else {
+            rows[cursor[values[i] >> 16]++] =
+                (ArchiveRow){values[i], song->song_id, block->first + i};
+          }
+        }
+        n += block->count;
+        at += sizeof(ArchiveBlock) + block->count * sizeof(uint32_t);
+      }
+      ok = ok && n == song->count;
+      seen += n;
+    }
+    ok = ok && seen == count;
+
+    if (ok && pass == 0) {
+      // counts -> prefix sums
+      for (int b = 0; b < INDEX_BUCKETS; b++) {
+        buckets[b + 1] += buckets[b];
+      }
+      memcpy(cursor, buckets, buckets_size);
+    }
+  }
+
+  if (ok) {
+    uint16_t *low = (uint16_t *)(owned + buckets_size);
+    IndexPosting *postings = (IndexPosting *)(owned + buckets_size + low_size);
+    for (int b = 0; b < INDEX_BUCKETS; b++) {
+      qsort(rows + buckets[b], buckets[b + 1] - buckets[b], sizeof(ArchiveRow),
+            compare_archive_rows);
+    }
+    for (uint64_t i = 0; i < count; i++) {
+      low[i] = (uint16_t)rows[i].hash;
+      postings[i] = (IndexPosting){rows[i].song_id, rows[i].offset};
+    }
+    idx->owned = owned;
+    idx->count = count;
+    idx->buckets = buckets;
+    idx->low = low;
+    idx->postings = postings;
+  } else {
+    free(owned);
+  }
+  free(cursor);
+  free(rows);
+  return ok ? 0 : -1;
+}
+
+// Points idx at the posting lists of the packed archive it maps, or builds
+// an index from its blocks when it has none. Returns -1 for an invalid
+// archive and -2 when memory ran out.
+int archive_attach(FingerprintIndex *idx) {
+  const ArchiveHeader *header = idx->map;
+  if (archive_validate(idx) != 0) {
+    return -1;
+  }
+  if (header->bucket_bits == 0) {
+    return archive_build_index(idx);
+  }
+
+  const char *base = idx->map;
+  idx->count = header->count;
+  idx->bucket_bits = header->bucket_bits;
+  idx->runs = (const uint64_t *)(base + header->runs_offset);
+  idx->lists = (const unsigned char *)base + header->lists_offset;
+
+  // Lists are touched at random; the bucket table on every probe
+  long page = sysconf(_SC_PAGESIZE);
+  uint64_t runs_page = header->runs_offset & ~(uint64_t)(page - 1);
+  madvise(idx->map, idx->size, MADV_RANDOM);
+  madvise((char *)idx->map + runs_page, idx->size - runs_page, MADV_WILLNEED);
+  return 0;
+}
+
+// Decodes the posting list of hash from its bucket's run into scratch.
+size_t archive_lookup(const FingerprintIndex *idx, uint32_t hash,
+                      IndexPosting *scratch, size_t scratch_len,
+                      const IndexPosting **first) {
+  int shift = 32 - (int)idx->bucket_bits;
+  uint64_t bucket = hash >> shift;
+  uint32_t key = hash & (((uint32_t)1 << shift) - 1);
+  const unsigned char *p = idx->lists + idx->runs[bucket];
+  const unsigned char *end = idx->lists + idx->runs[bucket + 1];
+
+  *first = NULL;
+  uint32_t k = 0;
+  uint64_t key_delta, count, delta, value;
+  while (get_varint(&p, end, &key_delta) == 0 &&
+         get_varint(&p, end, &count) == 0) {
+    k += (uint32_t)key_delta;
+    if (k > key) {
+      break;
+    }
+    if (k < key) {
+      for (uint64_t i = 0; i < count; i++) {
+        if (get_varint(&p, end, &delta) != 0 ||
+            get_varint(&p, end, &value) != 0) {
+          return 0;
+        }
+      }
+      continue;
+    }
+    if (count > scratch_len) {
+      return (size_t)count;
+    }
+
+    uint32_t song_id = 0, offset = 0;
+    for (size_t i = 0; i < count; i++) {
+      if (get_varint(&p, end, &delta) != 0 ||
+          get_varint(&p, end, &value) != 0) {
+        return 0;
+      }
+      song_id += (uint32_t)delta;
+      offset = delta ? (uint32_t)value : offset + (uint32_t)value;
+      scratch[i] = (IndexPosting){song_id, offset};
+    }
+    *first = scratch;
+    return (size_t)count;
+  }
+  return 0;
+}
+
+void index_close(FingerprintIndex *idx) {
+  if (idx->map != NULL) {
+    munmap(idx->map, idx->size);
+  }
+  free(idx->owned);
+  memset(idx, 0, sizeof(*idx));
+}
+
+// Maps the file at path read-only into idx->map.
+int index_map(FingerprintIndex *idx, const char *path) {
+  memset(idx, 0, sizeof(*idx));
+
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    fprintf(stderr, "Unable to open %s: %s\n", path, strerror(errno));
+    return -1;
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(IndexHeader)) {
+    fprintf(stderr, "Invalid index file: %s\n", path);
+    close(fd);
+    return -1;
+  }
+
+  void *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) {
+    fprintf(stderr, "Unable to map %s: %s\n", path, strerror(errno));
+    return -1;
+  }
+  idx->map = map;
+  idx->size = st.st_size;
+  return 0;
+}
+
+int index_open(FingerprintIndex *idx, const char *path) {
+  if (index_map(idx, path) != 0) {
+    return -1;
+  }
+
+  void *map = idx->map;
+  if (memcmp(map, ARCHIVE_MAGIC, 8) == 0) {
+    int rc = archive_attach(idx);
+    if (rc != 0) {
+      if (rc == -1) {
+        fprintf(stderr, "Invalid archive file: %s\n", path);
+      }
+      index_close(idx);
+      return -1;
+    }
+    return 0;
+  }
+
+  const IndexHeader *header = map;
+  if (memcmp(header->magic, INDEX_MAGIC, 8) != 0 ||
+      header->version != INDEX_VERSION || header->buckets != INDEX_BUCKETS ||
+      header->size != (uint64_t)idx->size ||
+      header->postings_offset + header->count * sizeof(IndexPosting) !=
+          header->size) {
+    fprintf(stderr, "Invalid index file: %s\n", path);
+    index_close(idx);
+    return -1;
+  }
+
+  idx->count = header->count;
+  idx->buckets =
+      (const uint32_t *)((const char *)map + align64(sizeof(IndexHeader)));
+  idx->low = (const uint16_t *)((const char *)map + header->low_offset);
+  idx->postings =
+      (const IndexPosting *)((const char *)map + header->postings_offset);
+
+  // Postings are touched at random; the bucket table on every probe
+  madvise(map, idx->size, MADV_RANDOM);
+  madvise(map, header->low_offset, MADV_WILLNEED);
+
+  return 0;
+}
+
+// Postings of one hash: sets *first and returns how many there are. An
+// archive decodes them into scratch, and leaves *first NULL when there are
+// more than scratch_len.
+size_t index_lookup(const FingerprintIndex *idx, uint32_t hash,
+                    IndexPosting *scratch, size_t scratch_len,
+                    const IndexPosting **first) {
+  if (idx->lists != NULL) {
+    return archive_lookup(idx, hash, scratch, scratch_len, first);
+  }
+
+  uint32_t lo = idx->buckets[hash >> 16], hi = idx->buckets[(hash >> 16) + 1];
+  uint16_t key = (uint16_t)hash;
+
+  // lower bound of key in low[lo, hi)
+  while (lo < hi) {
+    uint32_t mid = lo + (hi - lo) / 2;
+    if (idx->low[mid] < key) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+
+  uint32_t end = lo;
+  uint32_t bucket_end = idx->buckets[(hash >> 16) + 1];
+  while (end < bucket_end && idx->low[end] == key) {
+    end++;
+  }
+
+  *first = idx->postings + lo;
+  return end - lo;
+}
+
+// Writes every song of a packed archive into fingerprint.db under its
+// archived song_id; the inverse of --pack.
+int unpack_archive(const char *archive_path, const char *db_path,
+                   int defer_index) {
+  FingerprintIndex idx;
+  if (index_map(&idx, archive_path) != 0) {
+    return -1;
+  }
+  if (memcmp(idx.map, ARCHIVE_MAGIC, 8) != 0 || archive_validate(&idx) != 0) {
+    fprintf(stderr, "Not a packed archive: %s\n", archive_path);
+    index_close(&idx);
+    return -1;
+  }
+
+  const ArchiveHeader *header = idx.map;
+  const char *base = idx.map;
+  const ArchiveSong *songs = (const ArchiveSong *)(base + header->songs_offset);
+  madvise(idx.map, header->lists_offset, MADV_SEQUENTIAL);
+
+  FingerprintDb *fdb = fingerprint_db_open(db_path, defer_index);
+  if (fdb == NULL) {
+    index_close(&idx);
+    return -1;
+  }
+
+  uint32_t *hashes = NULL, *offsets = NULL;
+  size_t capacity = 0;
+  int ok = 1;
+  for (uint64_t s = 0; ok && s < header->songs; s++) {
+    const ArchiveSong *song = &songs[s];
+    if (song->count > capacity) {
+      uint32_t *grown_hashes = realloc(hashes, song->count * sizeof(uint32_t));
+      if (grown_hashes != NULL) {
+        hashes = grown_hashes;
+      }
+      uint32_t *grown_offsets =
+          realloc(offsets, song->count * sizeof(uint32_t));
+      if (grown_offsets != NULL) {
+        offsets = grown_offsets;
+      }
+      if (grown_hashes == NULL || grown_offsets == NULL) {
+        fprintf(stderr, "Unable to grow archive song buffer\n");
+        ok = 0;
+        break;
+      }
+      capacity = song->count;
+    }
+
+    // Songs imported from a database without a songs row have no name
+    char name[PATH_MAX];
+    if (song->name_len > 0 && song->name_len < sizeof(name) &&
+        song->name_offset + song->name_len <=
+            header->lists_offset - header->names_offset) {
+      memcpy(name, base + header->names_offset + song->name_offset,
+             song->name_len);
+      name[song->name_len] = '\0';
+    } else {
+      snprintf(name, sizeof(name), "song %u", song->song_id);
+    }
+
+    uint64_t at = song->blocks_offset;
+    size_t n = 0;
+    for (uint64_t b = 0; ok && b < song->blocks; b++) {
+      const ArchiveBlock *block = archive_block(&idx, at);
+      if (block == NULL || block->count > song->count - n) {
+        fprintf(stderr, "Invalid block in %s\n", archive_path);
+        ok = 0;
+        break;
+      }
+      const uint32_t *values = (const uint32_t *)(block + 1);
+      for (uint32_t i = 0; i < block->count; i++) {
+        hashes[n] = values[i];
+        offsets[n++] = block->first + i;
+      }
+      at += sizeof(ArchiveBlock) + block->count * sizeof(uint32_t);
+    }
+
+    if (ok && n != song->count) {
+      fprintf(stderr, "Invalid song table in %s\n", archive_path);
+      ok = 0;
+    }
+    ok = ok && fingerprint_db_add_rows(fdb, song->song_id, name, hashes,
+                                       offsets, n) == 0;
+  }
+
+  free(hashes);
+  free(offsets);
+  if (fingerprint_db_close(fdb) != 0) {
+    ok = 0;
+  }
+  index_close(&idx);
+  return ok ? 0 : -1;
+}
+
+// Identification of a probe clip against the index. The probe is hashed on
+// a continuous hop grid and each sub-fingerprint votes for every
+// (song_id, time delta) its postings imply; a true match piles its votes
+// into one delta bin while chance collisions scatter. Votes are counted as
+// frames arrive, and the query stops as soon as the best bin has
+// QUERY_MIN_VOTES and QUERY_LEAD_FACTOR times the best bin of any other
+// song. Stored offsets are converted to time with the probe's frame
+// geometry, so the catalogue is assumed to share its sample rate.
+//
+// For Hamming tolerance each sub-fingerprint is also looked up with every
+// combination of its flip_bits least reliable bits inverted: the bits whose
+// slope comparison had the smallest margin, which noise flips first.
+#define QUERY_MIN_VOTES 16
+#define QUERY_LEAD_FACTOR 3
+#define QUERY_MAX_POSTINGS 2048 // hashes this common (silence) do not vote
+#define QUERY_MAX_FLIP_BITS 4
+
+typedef struct {
+  uint32_t song_id;
+  int32_t delta; // song time minus probe time, in hops
+  uint32_t votes; // 0 marks an empty slot
+} VoteBin;
+
+typedef struct {
+  const FingerprintIndex *index;
+  const HashContext *ctx;
+  int flip_bits;
+  IndexPosting *postings; // QUERY_MAX_POSTINGS, for archive lookups
+  VoteBin *bins;
+  size_t capacity; // power of two
+  size_t used;
+  size_t best; // slot of the leading bin, valid when best_votes > 0
+  uint32_t best_votes;
+  uint32_t second_votes; // leading bin among the other songs
+  double prev[NUM_BANDS];
+  size_t frames;  // probe frames seen so far
+  size_t lookups; // index probes, flipped variants included
+#ifdef HACHING_METRICS
+  struct timespec started; // for the match latency histogram
+#endif
+} QuerySession;
+
+void query_session_destroy(QuerySession *q) {
+  free(q->postings);
+  free(q->bins);
+  memset(q, 0, sizeof(*q));
+}
+
+int query_session_init(QuerySession *q, const FingerprintIndex *index,
+                       const HashContext *ctx, int flip_bits) {
+  memset(q, 0, sizeof(*q));
+  q->index = index;
+  q->ctx = ctx;
+  q->flip_bits = flip_bits < QUERY_MAX_FLIP_BITS ? flip_bits
+                                                 : QUERY_MAX_FLIP_BITS;
+  q->capacity = 4096;
+  q->bins = calloc(q->capacity, sizeof(VoteBin));
+  q->postings = malloc(QUERY_MAX_POSTINGS * sizeof(IndexPosting));
+  if (q->bins == NULL || q->postings == NULL) {
+    fprintf(stderr, "Unable to allocate vote table\n");
+    query_session_destroy(q);
+    return -1;
+  }
+#ifdef HACHING_METRICS
+  clock_gettime(CLOCK_MONOTONIC, &q->started);
+#endif
+  return 0;
+}
+
+size_t vote_slot(const VoteBin *bins, size_t capacity, uint32_t song_id,
+                 int32_t delta) {
+  size_t mask = capacity - 1;
+  size_t i = ((song_id * 0x9E3779B1u) ^ ((uint32_t)delta * 0x85EBCA77u)) & mask;
+  while (bins[i].votes != 0 &&
+         (bins[i].song_id != song_id || bins[i].delta != delta)) {
+    i = (i + 1) & mask;
+  }
+  return i;
+}
+
+int query_grow(QuerySession *q) {
+  size_t capacity = q->capacity * 2;
+  VoteBin *bins = calloc(capacity, sizeof(VoteBin));
+  if (bins == NULL) {
+    fprintf(stderr, "Unable to grow vote table\n");
+    return -1;
+  }
+  for (size_t i = 0; i < q->capacity; i++) {
+    if (q->bins[i].votes != 0) {
+      size_t slot =
+          vote_slot(bins, capacity, q->bins[i].song_id, q->bins[i].delta);
+      bins[slot] = q->bins[i];
+      if (q->best_votes > 0 && i == q->best) {
+        q->best = slot;
+      }
+    }
+  }
+  free(q->bins);
+  q->bins = bins;
+  q->capacity = capacity;
+  return 0;
+}
+
+int query_vote(QuerySession *q, uint32_t song_id, int32_t delta) {
+  if (2 * (q->used + 1) > q->capacity && query_grow(q) != 0) {
+    return -1;
+  }
+
+  size_t slot = vote_slot(q->bins, q->capacity, song_id, delta);
+  VoteBin *bin = &q->bins[slot];
+  if (bin->votes == 0) {
+    *bin = (VoteBin){song_id, delta, 0};
+    q->used++;
+  }
+  bin->votes++;
+
+  // Counts only grow, so the runner-up can be maintained incrementally
+  uint32_t best_song = q->best_votes > 0 ? q->bins[q->best].song_id : 0;
+  if (q->best_votes > 0 && slot == q->best) {
+    q->best_votes = bin->votes;
+  } else if (bin->votes > q->best_votes) {
+    if (q->best_votes > 0 && best_song != song_id) {
+      q->second_votes = q->best_votes;
+    }
+    q->best = slot;
+    q->best_votes = bin->votes;
+  } else if (song_id != best_song && bin->votes > q->second_votes) {
+    q->second_votes = bin->votes;
+  }
+  return 0;
+}
+
+int query_decided(const QuerySession *q) {
+  return q->best_votes >= QUERY_MIN_VOTES &&
+         q->best_votes >= QUERY_LEAD_FACTOR * q->second_votes;
+}
+
+// Votes for every posting of hash, taken at probe time probe_samples.
+int query_lookup(QuerySession *q, uint32_t hash, long probe_samples) {
+  const HashContext *ctx = q->ctx;
+  const IndexPosting *postings;
+  size_t count =
+      index_lookup(q->index, hash, q->postings, QUERY_MAX_POSTINGS, &postings);
+  int per_window = ctx->frames_per_window - 1;
+
+  q->lookups++;
+  METRIC_COUNT(COUNTER_LOOKUPS, 1);
+  METRIC_OBSERVE(HISTOGRAM_CANDIDATES, count);
+  if (count > QUERY_MAX_POSTINGS) {
+    return 0;
+  }
+
+  for (size_t i = 0; i < count; i++) {
+    // Sub-fingerprint o compares frames n - 1 and n of window o / per_window
+    uint32_t o = postings[i].offset;
+    long song_samples = (long)(o / per_window) * ctx->window_len +
+                        (long)(o % per_window + 1) * ctx->hop_size;
+    long delta = song_samples - probe_samples;
+    long bin = (delta >= 0 ? delta + ctx->hop_size / 2
+                           : delta - ctx->hop_size / 2) /
+               ctx->hop_size;
+    if (query_vote(q, postings[i].song_id, (int32_t)bin) != 0) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+// Feeds the band energies of the next probe frame. Returns 1 once the
+// query is decided, 0 to keep going and -1 on error.
+int query_add_frame(QuerySession *q, const double *energies) {
+  size_t frame = q->frames++;
+
+  if (frame > 0) {
+    uint32_t hash = 0;
+    double margins[32];
+    for (int m = 0; m < 32; m++) {
+      double slopePrev = q->prev[m] - q->prev[m + 1];
+      double slopeCurr = energies[m] - energies[m + 1];
+      if (slopeCurr > slopePrev) {
+        hash |= (uint32_t)1 << m;
+      }
+      margins[m] = fabs(slopeCurr - slopePrev);
+    }
+
+    // The flip_bits smallest margins, by insertion into a short list
+    int weak[QUERY_MAX_FLIP_BITS];
+    int found = 0;
+    for (int m = 0; m < 32; m++) {
+      int j = found < q->flip_bits ? found++ : q->flip_bits;
+      while (j > 0 && margins[m] < margins[weak[j - 1]]) {
+        if (j < q->flip_bits) {
+          weak[j] = weak[j - 1];
+        }
+        j--;
+      }
+      if (j < q->flip_bits) {
+        weak[j] = m;
+      }
+    }
+
+    long probe_samples = (long)frame * q->ctx->hop_size;
+    for (uint32_t combo = 0; combo < (1u << found); combo++) {
+      uint32_t variant = hash;
+      for (int b = 0; b < found; b++) {
+        if (combo & (1u << b)) {
+          variant ^= (uint32_t)1 << weak[b];
+        }
+      }
+      if (query_lookup(q, variant, probe_samples) != 0) {
+        return -1;
+      }
+    }
+  }
+
+  memcpy(q->prev, energies, sizeof(q->prev));
+  if (!query_decided(q)) {
+    return 0;
+  }
+  METRIC_COUNT(COUNTER_MATCHES, 1);
+  METRIC_OBSERVE_SINCE(HISTOGRAM_MATCH_US, q->started);
+  return 1;
+}
+
+// Runs a whole clip through the session, STFT batch by STFT batch, until it
+// is decided or the clip ends.
+int query_clip(QuerySession *q, HashContext *ctx, const PcmView *pcm,
+               size_t frames) {
+  if (frames < (size_t)ctx->frame_len) {
+    return 0;
+  }
+  size_t total = (frames - ctx->frame_len) / ctx->hop_size + 1;
+
+  for (size_t f0 = 0; f0 < total; f0 += ctx->stft.batch) {
+    int count = total - f0 < (size_t)ctx->stft.batch ? (int)(total - f0)
+                                                     : ctx->stft.batch;
+    PcmView first = pcm_view_at(pcm, f0 * ctx->hop_size);
+    compute_band_energies(ctx, &first, count, ctx->energies);
+    for (int f = 0; f < count; f++) {
+      int status = query_add_frame(q, ctx->energies + (size_t)f * NUM_BANDS);
+      if (status != 0) {
+        return status;
+      }
+    }
+  }
+  return 0;
+}
+
+// Lock-free single-producer single-consumer byte ring, the link between
+// pipeline stages on different threads. head and tail each sit on their own
+// cache line next to the owning side's cached copy of the other index, so
+// the two cores only touch a shared line when one side runs out of its
+// cached view and refreshes it.
+#define CACHE_LINE 64
+
+typedef struct {
+  unsigned char *data;
+  size_t mask; // capacity - 1, capacity a power of two
+  _Alignas(CACHE_LINE) _Atomic size_t head; // bytes written, producer-owned
+  size_t tail_seen;                         // producer's view of tail
+  _Alignas(CACHE_LINE) _Atomic size_t tail; // bytes consumed, consumer-owned
+  size_t head_seen;                         // consumer's view of head
+  _Alignas(CACHE_LINE) _Atomic int closed;
+} ByteRing;
+
+int byte_ring_init(ByteRing *ring, size_t capacity) {
+  ring->data = malloc(capacity);
+  if (ring->data == NULL) {
+    fprintf(stderr, "Unable to allocate ring buffer\n");
+    return -1;
+  }
+  ring->mask = capacity - 1;
+  atomic_init(&ring->head, 0);
+  atomic_init(&ring->tail, 0);
+  atomic_init(&ring->closed, 0);
+  ring->tail_seen = 0;
+  ring->head_seen = 0;
+  return 0;
+}
+
+// Contiguous free space at the head; the producer writes there and then
+// publishes it with byte_ring_commit.
+size_t byte_ring_reserve(ByteRing *ring, unsigned char **dest) {
+  size_t capacity = ring->mask + 1;
+  size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+  size_t to_end = capacity - (head & ring->mask);
+
+  if (capacity - (head - ring->tail_seen) < to_end) {
+    ring->tail_seen = atomic_load_explicit(&ring->tail, memory_order_acquire);
+  }
+  size_t free_bytes = capacity - (head - ring->tail_seen);
+  *dest = ring->data + (head & ring->mask);
+  return free_bytes < to_end ? free_bytes : to_end;
+}
+
+void byte_ring_commit(ByteRing *ring, size_t bytes) {
+  size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+  atomic_store_explicit(&ring->head, head + bytes, memory_order_release);
+}
+
+// Bytes readable from the tail, which may wrap; read them through
+// byte_ring_at and hand them back with byte_ring_release.
+size_t byte_ring_readable(ByteRing *ring) {
+  size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+  if (ring->head_seen == tail) {
+    ring->head_seen = atomic_load_explicit(&ring->head, memory_order_acquire);
+  }
+  return ring->head_seen - tail;
+}
+
+unsigned char *byte_ring_at(ByteRing *ring, size_t offset) {
+  size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+  return ring->data + ((tail + offset) & ring->mask);
+}
+
+void byte_ring_release(ByteRing *ring, size_t bytes) {
+  size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+  atomic_store_explicit(&ring->tail, tail + bytes, memory_order_release);
+}
+
+void byte_ring_close(ByteRing *ring) {
+  atomic_store_explicit(&ring->closed, 1, memory_order_release);
+}
+
+// True once the producer has closed the ring and every byte is consumed.
+// Check it before byte_ring_readable so no late commit slips past.
+int byte_ring_drained(ByteRing *ring) {
+  return atomic_load_explicit(&ring->closed, memory_order_acquire) &&
+         byte_ring_readable(ring) == 0;
+}
+
+// Nothing here blocks in the kernel, so an idle stage spins briefly for
+// low latency, then yields, then naps so it does not burn its core.
+void ring_backoff(unsigned *spins) {
+  if (++*spins < 64) {
+    return;
+  }
+  if (*spins < 128) {
+    sched_yield();
+  } else {
+    usleep(500);
+  }
+}
+
+// Copies all of src into the ring, waiting for room as needed.
+void byte_ring_write(ByteRing *ring, const void *src, size_t bytes) {
+  const unsigned char *from = src;
+  unsigned spins = 0;
+  while (bytes > 0) {
+    unsigned char *dest;
+    size_t space = byte_ring_reserve(ring, &dest);
+    if (space == 0) {
+      ring_backoff(&spins);
+      continue;
+    }
+    spins = 0;
+    size_t n = space < bytes ? space : bytes;
+    memcpy(dest, from, n);
+    byte_ring_commit(ring, n);
+    from += n;
+    bytes -= n;
+  }
+}
+
+// Moves up to max_frames whole frames of frame_bytes each into dest,
+// handling the wrap at the end of the ring. Returns the frames moved.
+size_t byte_ring_drain_frames(ByteRing *ring, size_t frame_bytes, void *dest,
+                              size_t max_frames) {
+  size_t frames = byte_ring_readable(ring) / frame_bytes;
+  if (frames > max_frames) {
+    frames = max_frames;
+  }
+
+  size_t bytes = frames * frame_bytes;
+  size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+  size_t start = tail & ring->mask;
+  size_t first =
+      ring->mask + 1 - start < bytes ? ring->mask + 1 - start : bytes;
+  memcpy(dest, ring->data + start, first);
+  memcpy((unsigned char *)dest + first, ring->data, bytes - first);
+
+  byte_ring_release(ring, bytes);
+  return frames;
+}
+
+// Live capture: a thread reads raw s16le PCM from a file descriptor (stdin by
+// default) or, when built with -DHACHING_ALSA -lasound, an ALSA capture
+// device, into a ByteRing. The listening loop drains it a hop at a time and
+// votes as frames complete, so a match can be reported long before a whole
+// window has been heard.
+#define CAPTURE_RING_BYTES (1 << 20) // ~5 s of 48 kHz stereo
+#define CAPTURE_CHUNK 4096
+
+typedef struct {
+  ByteRing ring;
+  int fd;
+  const char *alsa_device; // NULL for fd capture
+  long rate;
+  int channels;
+} Capture;
+
+#ifdef HACHING_ALSA
+int capture_alsa(Capture *cap) {
+  snd_pcm_t *pcm;
+  int err = snd_pcm_open(&pcm, cap->alsa_device, SND_PCM_STREAM_CAPTURE, 0);
+  if (err < 0) {
+    fprintf(stderr, "Unable to open %s: %s\n", cap->alsa_device,
+            snd_strerror(err));
+    return -1;
+  }
+  // 50 ms of latency keeps reads small without risking overruns
+  err = snd_pcm_set_params(pcm, SND_PCM_FORMAT_S16_LE,
+                           SND_PCM_ACCESS_RW_INTERLEAVED, cap->channels,
+                           cap->rate, 1, 50000);
+  if (err < 0) {
+    fprintf(stderr, "Unable to configure %s: %s\n", cap->alsa_device,
+            snd_strerror(err));
+    snd_pcm_close(pcm);
+    return -1;
+  }
+
+  size_t frame_bytes = 2 * cap->channels;
+  unsigned spins = 0;
+  for (;;) {
+    unsigned char *dest;
+    size_t space = byte_ring_reserve(&cap->ring, &dest) / frame_bytes;
+    if (space == 0) {
+      // Consumer is behind; drop nothing, just wait for room
+      ring_backoff(&spins);
+      continue;
+    }
+    spins = 0;
+    snd_pcm_sframes_t got = snd_pcm_readi(pcm, dest, space);
+    if (got == -EPIPE) {
+      fprintf(stderr, "Capture overrun\n");
+      snd_pcm_prepare(pcm);
+      continue;
+    }
+    if (got < 0) {
+      fprintf(stderr, "Capture failed: %s\n", snd_strerror(got));
+      break;
+    }
+    byte_ring_commit(&cap->ring, got * frame_bytes);
+    METRIC_COUNT(COUNTER_PCM_FRAMES, got);
+  }
+
+  snd_pcm_close(pcm);
+  return 0;
+}
+#endif
+
+void *capture_main(void *arg) {
+  Capture *cap = arg;
+
+#ifdef HACHING_ALSA
+  if (cap->alsa_device) {
+    capture_alsa(cap);
+    byte_ring_close(&cap->ring);
+    return NULL;
+  }
+#endif
+
+  unsigned spins = 0;
+  for (;;) {
+    unsigned char *dest;
+    size_t space = byte_ring_reserve(&cap->ring, &dest);
+    if (space == 0) {
+      ring_backoff(&spins);
+      continue;
+    }
+    spins = 0;
+    ssize_t got = read(cap->fd, dest, space < CAPTURE_CHUNK ? space
+                                                            : CAPTURE_CHUNK);
+    if (got < 0 && errno == EINTR) {
+      continue;
+    }
+    if (got <= 0) {
+      if (got < 0) {
+        fprintf(stderr, "Capture read failed: %s\n", strerror(errno));
+      }
+      break;
+    }
+    byte_ring_commit(&cap->ring, got);
+    METRIC_COUNT(COUNTER_PCM_FRAMES, got / (2 * cap->channels));
+  }
+
+  byte_ring_close(&cap->ring);
+  return NULL;
+}
+
+// Streaming mode runs as a pipeline of three stages, each on its own
+// thread, joined by ByteRings: decode pushes interleaved PCM blocks, DSP
+// gathers the left channel one 3.33 s window at a time and hashes it as soon
+// as the window is full, and output (the calling thread) prints and collects
+// the sub-fingerprints. A slow terminal or database write never stalls the
+// FFT, and a slow FFT only backs up the decoder.
+#define PIPELINE_PCM_BYTES (1 << 20)
+#define PIPELINE_HASH_BYTES (1 << 16)
+#define PIPELINE_BLOCK_FRAMES 4096
+
+typedef struct {
+  mpg123_handle *mh;
+  const char *filename;
+  ByteRing pcm;    // decode -> DSP, s16 interleaved
+  ByteRing hashes; // DSP -> output, uint32 sub-fingerprints
+  // Decode thread only: converts blocks to resample_rate before the ring
+  Resampler resampler;
+  short *resampled;
+  // Written by each producer before its first commit, so the consumer sees
+  // them once it sees data
+  long rate;
+  int channels;
+  int per_window;
+  // Read after the threads are joined
+  int decode_failed;
+  int dsp_failed;
+  size_t frames;
+  size_t windows;
+} StreamPipeline;
+
+int pipeline_push_block(const AudioData *block, void *user) {
+  StreamPipeline *p = user;
+  int resample = resample_rate > 0 && block->sample_rate != resample_rate;
+
+  if (p->rate == 0) {
+    if (resample) {
+      if (resampler_configure(&p->resampler, block->sample_rate,
+                              resample_rate, block->channels) != 0) {
+        return -1;
+      }
+      p->resampled = malloc(resampler_output_bound(&p->resampler,
+                                                   PIPELINE_BLOCK_FRAMES) *
+                            block->channels * sizeof(short));
+      if (p->resampled == NULL) {
+        fprintf(stderr, "Unable to allocate resampled block\n");
+        return -1;
+      }
+    }
+    p->rate = resample ? resample_rate : block->sample_rate;
+    p->channels = block->channels;
+  }
+
+  if (!resample) {
+    byte_ring_write(&p->pcm, block->samples,
+                    block->num_samples * sizeof(short));
+    return 0;
+  }
+
+  size_t got = resampler_process(&p->resampler, block->samples,
+                                 block->num_samples / block->channels,
+                                 p->resampled);
+  if (got == (size_t)-1) {
+    return -1;
+  }
+  byte_ring_write(&p->pcm, p->resampled, got * p->channels * sizeof(short));
+  return 0;
+}
+
+void *pipeline_decode_main(void *arg) {
+  StreamPipeline *p = arg;
+  if (stream_mp3_samples(p->mh, p->filename, PIPELINE_BLOCK_FRAMES,
+                         pipeline_push_block, p) != 0) {
+    p->decode_failed = 1;
+  } else if (p->resampled) {
+    size_t got = resampler_flush(&p->resampler, p->resampled);
+    byte_ring_write(&p->pcm, p->resampled, got * p->channels * sizeof(short));
+  }
+  byte_ring_close(&p->pcm);
+  resampler_destroy(&p->resampler);
+  free(p->resampled);
+  return NULL;
+}
+
+void *pipeline_dsp_main(void *arg) {
+  StreamPipeline *p = arg;
+  HashContext ctx = {0};
+  short *window = NULL;
+  uint32_t *hashes = NULL;
+  size_t filled = 0;
+  unsigned spins = 0;
+
+  for (;;) {
+    int drained = byte_ring_drained(&p->pcm);
+    if (byte_ring_readable(&p->pcm) == 0) {
+      if (drained) {
+        break;
+      }
+      ring_backoff(&spins);
+      continue;
+    }
+    spins = 0;
+
+    if (window == NULL) {
+      if (hash_context_configure(&ctx, p->rate) != 0) {
+        p->dsp_failed = 1;
+        break;
+      }
+      window = malloc((size_t)ctx.window_len * p->channels * sizeof(short));
+      hashes = malloc(ctx.frames_per_window * sizeof(uint32_t));
+      if (window == NULL || hashes == NULL) {
+        fprintf(stderr, "Error: Failed to allocate streaming buffers.\n");
+        p->dsp_failed = 1;
+        break;
+      }
+      p->per_window = ctx.frames_per_window - 1;
+    }
+
+    size_t got = byte_ring_drain_frames(
+        &p->pcm, 2 * (size_t)p->channels, window + filled * p->channels,
+        ctx.window_len - filled);
+    filled += got;
+    p->frames += got;
+
+    if (filled == (size_t)ctx.window_len) {
+      PcmView pcm = {window, p->channels, hash_channel};
+      int count = get_hash(&ctx, &pcm, hashes);
+      byte_ring_write(&p->hashes, hashes, count * sizeof(uint32_t));
+      filled = 0;
+      p->windows++;
+    }
+  }
+
+  // Let a stalled decoder finish so it can be joined
+  if (p->dsp_failed) {
+    spins = 0;
+    while (!byte_ring_drained(&p->pcm)) {
+      size_t readable = byte_ring_readable(&p->pcm);
+      if (readable == 0) {
+        ring_backoff(&spins);
+        continue;
+      }
+      spins = 0;
+      byte_ring_release(&p->pcm, readable);
+    }
+  }
+
+  byte_ring_close(&p->hashes);
+  hash_context_destroy(&ctx);
+  free(window);
+  free(hashes);
+  return NULL;
+}
+
+int stream_main(mpg123_handle *mh, const char *filename, int print) {
+  struct timespec t_start, t_end;
+  double elapsed;
+
+  StreamPipeline p = {.mh = mh, .filename = filename};
+  Fingerprints fingerprints = {0};
+
+  if (byte_ring_init(&p.pcm, PIPELINE_PCM_BYTES) != 0 ||
+      byte_ring_init(&p.hashes, PIPELINE_HASH_BYTES) != 0) {
+    exit(EXIT_FAILURE);
+  }
+
+  if (clock_gettime(CLOCK_MONOTONIC, &t_start) != 0) {
+    perror("clock_gettime");
+    exit(EXIT_FAILURE);
+  }
+
+  pthread_t decode, dsp;
+  if (pthread_create(&decode, NULL, pipeline_decode_main, &p) != 0 ||
+      pthread_create(&dsp, NULL, pipeline_dsp_main, &p) != 0) {
+    fprintf(stderr, "Unable to start pipeline threads\n");
+    exit(EXIT_FAILURE);
+  }
+
+  // Output stage
+  unsigned spins = 0;
+  for (;;) {
+    int drained = byte_ring_drained(&p.hashes);
+    size_t count = byte_ring_readable(&p.hashes) / sizeof(uint32_t);
+    if (count == 0) {
+      if (drained) {
+        break;
+      }
+      ring_backoff(&spins);
+      continue;
+    }
+    spins = 0;
+
+    if (fingerprints_reserve(&fingerprints, count) != 0) {
+      exit(EXIT_FAILURE);
+    }
+    for (size_t i = 0; i < count; i++) {
+      uint32_t hash;
+      memcpy(&hash, byte_ring_at(&p.hashes, i * sizeof(uint32_t)),
+             sizeof(hash));
+      if (print) {
+        size_t n = fingerprints.count;
+        printf("%zu %zu %u\n", n / p.per_window, n % p.per_window, hash);
+      }
+      fingerprints.hashes[fingerprints.count++] = hash;
+    }
+    byte_ring_release(&p.hashes, count * sizeof(uint32_t));
+  }
+
+  pthread_join(decode, NULL);
+  pthread_join(dsp, NULL);
+
+  if (clock_gettime(CLOCK_MONOTONIC, &t_end) != 0) {
+    perror("clock_gettime");
+    exit(EXIT_FAILURE);
+  }
+
+  elapsed =
+      (t_end.tv_sec - t_start.tv_sec) + (t_end.tv_nsec - t_start.tv_nsec) / 1e9;
+
+  free(p.pcm.data);
+  free(p.hashes.data);
+
+  if (p.decode_failed || p.dsp_failed) {
+    fprintf(stderr, "Failed to stream samples\n");
+    free(fingerprints.hashes);
+    return 1;
+  }
+
+  printf("Streamed %zu frames, %zu windows, %zu sub-fingerprints\n", p.frames,
+         p.windows, fingerprints.count);
+  printf("Decode and processing took %.6f seconds\n", elapsed);
+
+  int status = 0;
+  if (fingerprint_db &&
+      fingerprint_db_add_track(fingerprint_db, filename, fingerprints.hashes,
+                               fingerprints.count) != 0) {
+    status = 1;
+  }
+  if (song_file_dir &&
+      write_song_file(song_file_dir, filename, fingerprints.hashes,
+                      fingerprints.count) != 0) {
+    status = 1;
+  }
+
+  free(fingerprints.hashes);
+
+  return status;
+}
+
+// Paths of the tracks processed by one batch run.
+typedef struct {
+  char **paths;
+  size_t count;
+  size_t capacity;
+} FileList;
+
+int file_list_add(FileList *list, const char *path) {
+  if (list->count == list->capacity) {
+    size_t capacity = list->capacity ? list->capacity * 2 : 64;
+    char **grown = realloc(list->paths, capacity * sizeof(char *));
+    if (grown == NULL) {
+      return -1;
+    }
+    list->paths = grown;
+    list->capacity = capacity;
+  }
+
+  list->paths[list->count] = strdup(path);
+  if (list->paths[list->count] == NULL) {
+    return -1;
+  }
+  list->count++;
+
+  return 0;
+}
+
+void file_list_free(FileList *list) {
+  for (size_t i = 0; i < list->count; i++) {
+    free(list->paths[i]);
+  }
+  free(list->paths);
+}
+
+int compare_paths(const void *a, const void *b) {
+  return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+int has_mp3_suffix(const char *name) {
+  size_t len = strlen(name);
+  return len > 4 && strcasecmp(name + len - 4, ".mp3") == 0;
+}
+
+// Fills list from source, which is either a directory (every *.mp3 in it,
+// sorted) or a text file with one path per line ("-" reads stdin).
+int collect_batch_files(const char *source, FileList *list) {
+  struct stat st;
+
+  if (strcmp(source, "-") != 0 && stat(source, &st) == 0 &&
+      S_ISDIR(st.st_mode)) {
+    DIR *dir = opendir(source);
+    if (dir == NULL) {
+      perror(source);
+      return -1;
+    }
+
+    struct dirent *entry;
+    char path[PATH_MAX];
+    while ((entry = readdir(dir)) != NULL) {
+      if (!has_mp3_suffix(entry->d_name)) {
+        continue;
+      }
+      snprintf(path, sizeof(path), "%s/%s", source, entry->d_name);
+      if (file_list_add(list, path) != 0) {
+        fprintf(stderr, "Unable to grow file list\n");
+        closedir(dir);
+        return -1;
+      }
+    }
+    closedir(dir);
+
+    qsort(list->paths, list->count, sizeof(char *), compare_paths);
+    return 0;
+  }
+
+  FILE *fp = strcmp(source, "-") == 0 ? stdin : fopen(source, "r");
+  if (fp == NULL) {
+    perror(source);
+    return -1;
+  }
+
+  char line[PATH_MAX];
+  while (fgets(line, sizeof(line), fp) != NULL) {
+    line[strcspn(line, "\r\n")] = '\0';
+    if (line[0] == '\0') {
+      continue;
+    }
+    if (file_list_add(list, line) != 0) {
+      fprintf(stderr, "Unable to grow file list\n");
+      if (fp != stdin) {
+        fclose(fp);
+      }
+      return -1;
+    }
+  }
+  if (fp != stdin) {
+    fclose(fp);
+  }
+
+  return 0;
+}
+
+// Per-worker track scratch. The arena is reset at the start of every track,
+// the fingerprint buffer grows to fit the longest track seen so far, and the
+// resampler keeps its taps while the decoded rate stays the same.
+typedef struct {
+  Arena arena;
+  Fingerprints fingerprints;
+  Resampler resampler;
+} TrackScratch;
+
+int process_batch_track(mpg123_handle *mh, HashContext *ctx,
+                        TrackScratch *scratch, const char *path) {
+  AudioData audio_data;
+
+  arena_reset(&scratch->arena);
+  if (extract_mp3_samples(mh, path, &audio_data, &scratch->arena) != 0 ||
+      resample_audio(&scratch->resampler, &audio_data, &scratch->arena) != 0) {
+    fprintf(stderr, "Failed to extract samples from %s\n", path);
+    return -1;
+  }
+
+  size_t frames = audio_data.num_samples / audio_data.channels;
+
+  if (hash_context_configure(ctx, audio_data.sample_rate) != 0) {
+    return -1;
+  }
+
+  PcmView pcm = {audio_data.samples, audio_data.channels, hash_channel};
+  scratch->fingerprints.count = 0;
+  long windows = hash_track(ctx, &pcm, frames, &scratch->fingerprints);
+
+  if (windows < 0) {
+    return -1;
+  }
+
+  printf("%s: %.2f seconds, %zu sub-fingerprints\n", path,
+         (double)frames / audio_data.sample_rate, scratch->fingerprints.count);
+
+  if (fingerprint_db &&
+      fingerprint_db_add_track(fingerprint_db, path,
+                               scratch->fingerprints.hashes,
+                               scratch->fingerprints.count) != 0) {
+    return -1;
+  }
+  if (song_file_dir &&
+      write_song_file(song_file_dir, path, scratch->fingerprints.hashes,
+                      scratch->fingerprints.count) != 0) {
+    return -1;
+  }
+
+  return 0;
+}
+
+// Track indices owned by one worker. The owner takes from the head; idle
+// workers steal from the tail so they pick up the shortest remaining work.
+typedef struct {
+  pthread_mutex_t lock;
+  size_t *items;
+  size_t head;
+  size_t tail;
+} WorkQueue;
+
+typedef struct {
+  int id;
+  int num_workers;
+  WorkQueue *queues;
+  const FileList *files;
+  size_t processed;
+  size_t failed;
+  size_t stolen;
+} BatchWorker;
+
+int work_queue_pop(WorkQueue *q, size_t *item) {
+  int found = 0;
+  pthread_mutex_lock(&q->lock);
+  if (q->head < q->tail) {
+    *item = q->items[q->head++];
+    found = 1;
+  }
+  pthread_mutex_unlock(&q->lock);
+  return found;
+}
+
+int work_queue_steal(WorkQueue *q, size_t *item) {
+  int found = 0;
+  pthread_mutex_lock(&q->lock);
+  if (q->head < q->tail) {
+    *item = q->items[--q->tail];
+    found = 1;
+  }
+  pthread_mutex_unlock(&q->lock);
+  return found;
+}
+
+// Own queue first, then every other worker's, starting with the next one.
+int next_batch_track(BatchWorker *w, size_t *item) {
+  if (work_queue_pop(&w->queues[w->id], item)) {
+    return 1;
+  }
+  for (int i = 1; i < w->num_workers; i++) {
+    if (work_queue_steal(&w->queues[(w->id + i) % w->num_workers], item)) {
+      w->stolen++;
+      return 1;
+    }
+  }
+  return 0;
+}
+
+void *batch_worker_main(void *arg) {
+  BatchWorker *w = arg;
+  TrackScratch scratch = {0};
+  HashContext hash = {0};
+
+  mpg123_handle *mh = new_mp3_decoder();
+  if (mh == NULL) {
+    exit(EXIT_FAILURE);
+  }
+
+  size_t item;
+  while (next_batch_track(w, &item)) {
+    if (process_batch_track(mh, &hash, &scratch, w->files->paths[item]) == 0) {
+      w->processed++;
+    } else {
+      w->failed++;
+    }
+  }
+
+  arena_destroy(&scratch.arena);
+  free(scratch.fingerprints.hashes);
+  resampler_destroy(&scratch.resampler);
+  hash_context_destroy(&hash);
+  mpg123_delete(mh);
+
+  return NULL;
+}
+
+typedef struct {
+  size_t index;
+  off_t size;
+} TrackSize;
+
+int compare_track_size_desc(const void *a, const void *b) {
+  off_t sa = ((const TrackSize *)a)->size;
+  off_t sb = ((const TrackSize *)b)->size;
+  return (sa < sb) - (sa > sb);
+}
+
+// Processes a whole catalogue in one run. Each worker thread has its own
+// decoder handle and FFT buffers; all of them share the cached FFTW plans.
+int batch_main(const char *source, int jobs) {
+  struct timespec t_start, t_end;
+  double elapsed;
+
+  FileList files = {0};
+  if (collect_batch_files(source, &files) != 0) {
+    file_list_free(&files);
+    return 1;
+  }
+
+  if (jobs < 1) {
+    jobs = 1;
+  }
+  if ((size_t)jobs > files.count && files.count > 0) {
+    jobs = files.count;
+  }
+
+  // Deal tracks out longest first so the big ones start early and the
+  // stealing at the end only moves short tracks around
+  TrackSize *order = malloc((files.count + 1) * sizeof(TrackSize));
+  WorkQueue *queues = calloc(jobs, sizeof(WorkQueue));
+  BatchWorker *workers = calloc(jobs, sizeof(BatchWorker));
+  pthread_t *threads = calloc(jobs, sizeof(pthread_t));
+
+  if (order == NULL || queues == NULL || workers == NULL || threads == NULL) {
+    fprintf(stderr, "Error: Failed to allocate batch scheduler.\n");
+    exit(EXIT_FAILURE);
+  }
+
+  for (size_t f = 0; f < files.count; f++) {
+    struct stat st;
+    order[f].index = f;
+    order[f].size = stat(files.paths[f], &st) == 0 ? st.st_size : 0;
+  }
+  qsort(order, files.count, sizeof(TrackSize), compare_track_size_desc);
+
+  for (int i = 0; i < jobs; i++) {
+    pthread_mutex_init(&queues[i].lock, NULL);
+    queues[i].items = malloc((files.count / jobs + 1) * sizeof(size_t));
+    if (queues[i].items == NULL) {
+      fprintf(stderr, "Error: Failed to allocate batch scheduler.\n");
+      exit(EXIT_FAILURE);
+    }
+  }
+  for (size_t f = 0; f < files.count; f++) {
+    WorkQueue *q = &queues[f % jobs];
+    q->items[q->tail++] = order[f].index;
+  }
+
+  if (clock_gettime(CLOCK_MONOTONIC, &t_start) != 0) {
+    perror("clock_gettime");
+    exit(EXIT_FAILURE);
+  }
+
+  for (int i = 0; i < jobs; i++) {
+    workers[i] = (BatchWorker){i, jobs, queues, &files, 0, 0, 0};
+  }
+  for (int i = 1; i < jobs; i++) {
+    if (pthread_create(&threads[i], NULL, batch_worker_main, &workers[i]) !=
+        0) {
+      fprintf(stderr, "Error: Failed to start worker thread.\n");
+      exit(EXIT_FAILURE);
+    }
+  }
+  batch_worker_main(&workers[0]);
+
+  size_t processed = 0, failed = 0, stolen = 0;
+  for (int i = 0; i < jobs; i++) {
+    if (i > 0) {
+      pthread_join(threads[i], NULL);
+    }
+    processed += workers[i].processed;
+    failed += workers[i].failed;
+    stolen += workers[i].stolen;
+  }
+
+  if (clock_gettime(CLOCK_MONOTONIC, &t_end) != 0) {
+    perror("clock_gettime");
+    exit(EXIT_FAILURE);
+  }
+
+  elapsed =
+      (t_end.tv_sec - t_start.tv_sec) + (t_end.tv_nsec - t_start.tv_nsec) / 1e9;
+
+  printf("Processed %zu tracks (%zu failed, %zu stolen) on %d threads in "
+         "%.6f seconds\n",
+         processed, failed, stolen, jobs, elapsed);
+
+  for (int i = 0; i < jobs; i++) {
+    pthread_mutex_destroy(&queues[i].lock);
+    free(queues[i].items);
+  }
+  free(queues);
+  free(workers);
+  free(threads);
+  free(order);
+  file_list_free(&files);
+
+  return failed == files.count && files.count > 0 ? 1 : 0;
+}
+
+// Hashes the track again in the other precision and reports the share of
+// sub-fingerprint bits that differ from fp, the --validate-float check.
+int report_float_error(const PcmView *pcm, size_t frames, long sample_rate,
+                       const Fingerprints *fp) {
+  sample_precision other =
+      hash_precision == PRECISION_FLOAT ? PRECISION_DOUBLE : PRECISION_FLOAT;
+  HashContext ctx = {0};
+  Fingerprints check = {0};
+
+  if (hash_context_configure_precision(&ctx, sample_rate, other) != 0 ||
+      hash_track(&ctx, pcm, frames, &check) < 0) {
+    hash_context_destroy(&ctx);
+    free(check.hashes);
+    return -1;
+  }
+
+  uint64_t differing = 0;
+  for (size_t i = 0; i < fp->count && i < check.count; i++) {
+    differing += __builtin_popcount(fp->hashes[i] ^ check.hashes[i]);
+  }
+  uint64_t bits = (uint64_t)fp->count * 32;
+  printf("Float vs double: %llu of %llu sub-fingerprint bits differ"
+         " (BER %.6f)\n",
+         (unsigned long long)differing, (unsigned long long)bits,
+         bits ? (double)differing / bits : 0.0);
+
+  hash_context_destroy(&ctx);
+  free(check.hashes);
+  return 0;
+}
+
+// --bench: times each stage of hashing one track over several runs after
+// some warmup runs, then times the r2c transform alone at the frame lengths
+// of common sample rates. hachingRewriteNoLibrary.c prints the same table
+// for its own FFT, so the engines can be diffed. Percentiles are nearest
+// rank over the runs; throughput and the realtime factor use the median.
+#define BENCH_FFT_SAMPLES (1 << 21) // per run and frame length
+
+enum {
+  BENCH_DECODE,
+  BENCH_RESAMPLE,
+  BENCH_CONVERT,
+  BENCH_STFT,
+  BENCH_BANDS,
+  BENCH_SUBFP,
+  BENCH_DB,
+  BENCH_TOTAL,
+  BENCH_STAGES
+};
+
+const char *bench_stage_names[BENCH_STAGES] = {
+    "decode", "resample", "convert", "stft", "bands", "subfp", "db", "total"};
+
+const long bench_rates[] = {5512, 8000, 11025, 16000, 22050, 44100, 48000};
+
+double seconds_between(const struct timespec *start,
+                       const struct timespec *end) {
+  return (end->tv_sec - start->tv_sec) + (end->tv_nsec - start->tv_nsec) / 1e9;
+}
+
+double bench_lap(struct timespec *mark) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  double elapsed = seconds_between(mark, &now);
+  *mark = now;
+  return elapsed;
+}
+
+int compare_doubles(const void *a, const void *b) {
+  double x = *(const double *)a, y = *(const double *)b;
+  return (x > y) - (x < y);
+}
+
+double bench_percentile(const double *sorted, int runs, int pct) {
+  int rank = (pct * runs + 99) / 100;
+  return sorted[rank > 0 ? rank - 1 : 0];
+}
+
+void bench_header(void) {
+  printf("%-12s %10s %10s %10s %12s %10s\n", "stage", "p50 ms", "p90 ms",
+         "p99 ms", "Msamples/s", "realtime");
+}
+
+// One table row. samples and audio_seconds are the work done per run.
+void bench_report(const char *stage, double *seconds, int runs, double samples,
+                  double audio_seconds) {
+  qsort(seconds, runs, sizeof(double), compare_doubles);
+  double p50 = bench_percentile(seconds, runs, 50);
+  double rate = p50 > 0 ? samples / p50 / 1e6 : 0;
+  double realtime = p50 > 0 ? audio_seconds / p50 : 0;
+  printf("%-12s %10.3f %10.3f %10.3f %12.2f %9.1fx\n", stage, p50 * 1e3,
+         bench_percentile(seconds, runs, 90) * 1e3,
+         bench_percentile(seconds, runs, 99) * 1e3, rate, realtime);
+}
+
+// Hashes one decoded track like hash_track, adding the time spent in each
+// stage to stages.
+int bench_hash_track(HashContext *ctx, const PcmView *pcm, size_t frames,
+                     Fingerprints *fp, double *stages) {
+  size_t windows = frames / ctx->window_len;
+  Stft *stft = &ctx->stft;
+  struct timespec mark;
+
+  fp->count = 0;
+  if (fingerprints_reserve(fp, windows * (ctx->frames_per_window - 1)) != 0) {
+    return -1;
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &mark);
+  for (size_t w = 0; w < windows; w++) {
+    PcmView window = pcm_view_at(pcm, w * ctx->window_len);
+    for (int f0 = 0; f0 < ctx->frames_per_window; f0 += stft->batch) {
+      int count = ctx->frames_per_window - f0;
+      if (count > stft->batch) {
+        count = stft->batch;
+      }
+      PcmView first = pcm_view_at(&window, (size_t)f0 * ctx->hop_size);
+      stft_window(stft, &first, count);
+      stages[BENCH_CONVERT] += bench_lap(&mark);
+      if (ctx->bands.method != BANDS_GOERTZEL) {
+        stft_transform(stft, count);
+        stages[BENCH_STFT] += bench_lap(&mark);
+      }
+      batch_band_energies(ctx, count, ctx->energies + (size_t)f0 * NUM_BANDS);
+      stages[BENCH_BANDS] += bench_lap(&mark);
+    }
+    fp->count += compute_all_sub_fingerprints(
+        ctx->energies, ctx->frames_per_window, fp->hashes + fp->count);
+    stages[BENCH_SUBFP] += bench_lap(&mark);
+  }
+
+  return 0;
+}
+
+// Times n-point transforms of the current precision into seconds[0..runs)
+// and returns how many each run did, or -1 if the plan failed.
+int bench_fft_size(int n, int runs, int warmup, double *seconds) {
+  int reps = BENCH_FFT_SAMPLES / n > 0 ? BENCH_FFT_SAMPLES / n : 1;
+  int single = hash_precision == PRECISION_FLOAT;
+  fftw_plan plan = single ? NULL : get_r2c_plan(n, 1);
+  fftwf_plan plan_f = single ? get_r2cf_plan(n, 1) : NULL;
+  double *in = single ? NULL : fftw_malloc(n * sizeof(double));
+  fftw_complex *out =
+      single ? NULL : fftw_malloc((n / 2 + 1) * sizeof(fftw_complex));
+  float *in_f = single ? fftwf_malloc(n * sizeof(float)) : NULL;
+  fftwf_complex *out_f =
+      single ? fftwf_malloc((n / 2 + 1) * sizeof(fftwf_complex)) : NULL;
+
+  if (single ? plan_f == NULL || in_f == NULL || out_f == NULL
+             : plan == NULL || in == NULL || out == NULL) {
+    fprintf(stderr, "Error: Failed to set up a %d-point transform.\n", n);
+    reps = -1;
+  }
+
+  for (int i = 0; reps > 0 && i < n; i++) {
+    double x = sin(i * 0.1) * 16384;
+    if (single) {
+      in_f[i] = (float)x;
+    } else {
+      in[i] = x;
+    }
+  }
+
+  for (int run = -warmup; reps > 0 && run < runs; run++) {
+    struct timespec mark;
+    clock_gettime(CLOCK_MONOTONIC, &mark);
+    for (int r = 0; r < reps; r++) {
+      if (single) {
+        fftwf_execute_dft_r2c(plan_f, in_f, out_f);
+      } else {
+        fftw_execute_dft_r2c(plan, in, out);
+      }
+    }
+    double elapsed = bench_lap(&mark);
+    if (run >= 0) {
+      seconds[run] = elapsed;
+    }
+  }
+
+  fftw_free(in);
+  fftw_free(out);
+  fftwf_free(in_f);
+  fftwf_free(out_f);
+  return reps;
+}
+
+int bench_main(mpg123_handle *mh, const char *filename, int runs, int warmup) {
+  double *seconds = calloc((size_t)BENCH_STAGES * runs, sizeof(double));
+  FingerprintDb *db = fingerprint_db_open(":memory:", 0);
+  if (seconds == NULL || db == NULL) {
+    fprintf(stderr, "Unable to set up the benchmark\n");
+    exit(EXIT_FAILURE);
+  }
+
+  Arena arena = {0};
+  Resampler resampler = {0};
+  HashContext hash = {0};
+  Fingerprints fingerprints = {0};
+  AudioData audio_data = {0};
+  long decoded_rate = 0;
+  int status = 0;
+
+  for (int run = -warmup; run < runs && status == 0; run++) {
+    double stages[BENCH_STAGES] = {0};
+    struct timespec start, mark;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    mark = start;
+
+    arena_reset(&arena);
+    if (extract_mp3_samples(mh, filename, &audio_data, &arena) != 0) {
+      fprintf(stderr, "Failed to extract samples\n");
+      status = 1;
+      break;
+    }
+    stages[BENCH_DECODE] = bench_lap(&mark);
+    decoded_rate = audio_data.sample_rate;
+
+    if (resample_audio(&resampler, &audio_data, &arena) != 0) {
+      status = 1;
+      break;
+    }
+    stages[BENCH_RESAMPLE] = bench_lap(&mark);
+
+    size_t frames = audio_data.num_samples / audio_data.channels;
+    PcmView pcm = {audio_data.samples, audio_data.channels, hash_channel};
+    if (hash_context_configure(&hash, audio_data.sample_rate) != 0 ||
+        bench_hash_track(&hash, &pcm, frames, &fingerprints, stages) != 0) {
+      status = 1;
+      break;
+    }
+
+    bench_lap(&mark);
+    if (fingerprint_db_add_track(db, filename, fingerprints.hashes,
+                                 fingerprints.count) != 0) {
+      status = 1;
+      break;
+    }
+    stages[BENCH_DB] = bench_lap(&mark);
+    stages[BENCH_TOTAL] = seconds_between(&start, &mark);
+
+    for (int s = 0; run >= 0 && s < BENCH_STAGES; s++) {
+      seconds[(size_t)s * runs + run] = stages[s];
+    }
+  }
+
+  if (status == 0) {
+    size_t frames = audio_data.num_samples / audio_data.channels;
+    double duration = (double)frames / audio_data.sample_rate;
+    printf("Benchmark: %s, %.2f s at %ld Hz, %d channels; %d runs after %d "
+           "warmup\n",
+           filename, duration, decoded_rate, audio_data.channels, runs,
+           warmup);
+    bench_header();
+    for (int s = 0; s < BENCH_STAGES; s++) {
+      if ((s == BENCH_RESAMPLE && audio_data.sample_rate == decoded_rate) ||
+          (s == BENCH_STFT && hash.bands.method == BANDS_GOERTZEL)) {
+        continue;
+      }
+      bench_report(bench_stage_names[s], seconds + (size_t)s * runs, runs,
+                   frames, duration);
+    }
+  }
+
+  double hop_seconds = FRAME_LENGTH_SECONDS * (1 - OVERLAP_FACTOR);
+  if (status == 0) {
+    printf("FFT engine: FFTW r2c, %s precision\n",
+           hash_precision == PRECISION_FLOAT ? "single" : "double");
+    bench_header();
+  }
+  for (size_t i = 0;
+       status == 0 && i < sizeof(bench_rates) / sizeof(bench_rates[0]); i++) {
+    int n = (int)floor(FRAME_LENGTH_SECONDS * bench_rates[i]);
+    int reps = bench_fft_size(n, runs, warmup, seconds);
+    if (reps < 0) {
+      status = 1;
+      break;
+    }
+    char stage[32];
+    snprintf(stage, sizeof(stage), "fft %d", n);
+    bench_report(stage, seconds, runs, (double)reps * n, reps * hop_seconds);
+  }
+
+  fingerprint_db_free(db);
+  free(seconds);
+  free(fingerprints.hashes);
+  hash_context_destroy(&hash);
+  resampler_destroy(&resampler);
+  arena_destroy(&arena);
+  return status;
+}
+
+int single_main(mpg123_handle *mh, const char *filename, int print,
+                int validate_float) {
+  struct timespec t_start, t_end;
+  double elapsed;
+
+  AudioData audio_data;
+  Arena arena = {0};
+
+  if (extract_mp3_samples(mh, filename, &audio_data, &arena) != 0) {
+    fprintf(stderr, "Failed to extract samples\n");
+    arena_destroy(&arena);
+    return 1;
+  }
+
+  printf("Sample rate: %ld Hz\n", audio_data.sample_rate);
+  printf("Channels: %d\n", audio_data.channels);
+  printf("Successfully extracted %zu samples\n", audio_data.num_samples);
+  printf("Duration: %.2f seconds\n", (double)audio_data.num_samples /
+                                         audio_data.channels /
+                                         audio_data.sample_rate);
+
+  Resampler resampler = {0};
+  int resampled = resample_audio(&resampler, &audio_data, &arena);
+  resampler_destroy(&resampler);
+  if (resampled != 0) {
+    arena_destroy(&arena);
+    return 1;
+  }
+  if (resample_rate > 0) {
+    printf("Resampled to %ld Hz\n", audio_data.sample_rate);
+  }
+
+  size_t frames = audio_data.num_samples / audio_data.channels;
+
+  PcmView pcm = {audio_data.samples, audio_data.channels, hash_channel};
+
+  // hash every window ~3.33s
+
+  if (clock_gettime(CLOCK_MONOTONIC, &t_start) != 0) {
+    perror("clock_gettime");
+    exit(EXIT_FAILURE);
+  }
+
+  HashContext hash = {0};
+  Fingerprints fingerprints = {0};
+
+  if (hash_context_configure(&hash, audio_data.sample_rate) != 0 ||
+      hash_track(&hash, &pcm, frames, &fingerprints) < 0) {
+    exit(EXIT_FAILURE);
+  }
+
+  if (clock_gettime(CLOCK_MONOTONIC, &t_end) != 0) {
+    perror("clock_gettime");
+    exit(EXIT_FAILURE);
+  }
+
+  // Compute elapsed time in seconds
+  elapsed =
+      (t_end.tv_sec - t_start.tv_sec) + (t_end.tv_nsec - t_start.tv_nsec) / 1e9;
+
+  if (print) {
+    print_fingerprints(&fingerprints, hash.frames_per_window - 1);
+  }
+  printf("Computed %zu sub-fingerprints\n", fingerprints.count);
+  printf("Processing loop took %.6f seconds\n", elapsed);
+
+  int status = 0;
+  if (validate_float &&
+      report_float_error(&pcm, frames, audio_data.sample_rate,
+                         &fingerprints) != 0) {
+    status = 1;
+  }
+  if (fingerprint_db &&
+      fingerprint_db_add_track(fingerprint_db, filename, fingerprints.hashes,
+                               fingerprints.count) != 0) {
+    status = 1;
+  }
+  if (song_file_dir &&
+      write_song_file(song_file_dir, filename, fingerprints.hashes,
+                      fingerprints.count) != 0) {
+    status = 1;
+  }
+
+  // Clean up
+  arena_destroy(&arena);
+  free(fingerprints.hashes);
+  hash_context_destroy(&hash);
+
+  return status;
+}
+
+int query_main(mpg123_handle *mh, const char *index_path, const char *filename,
+               int flip_bits) {
+  struct timespec t_start, t_end;
+  FingerprintIndex index;
+  AudioData audio_data;
+
+  if (index_open(&index, index_path) != 0) {
+    return 1;
+  }
+
+  Arena arena = {0};
+  Resampler resampler = {0};
+  if (extract_mp3_samples(mh, filename, &audio_data, &arena) != 0 ||
+      resample_audio(&resampler, &audio_data, &arena) != 0) {
+    fprintf(stderr, "Failed to extract samples\n");
+    resampler_destroy(&resampler);
+    arena_destroy(&arena);
+    index_close(&index);
+    return 1;
+  }
+  resampler_destroy(&resampler);
+
+  size_t frames = audio_data.num_samples / audio_data.channels;
+  PcmView pcm = {audio_data.samples, audio_data.channels, hash_channel};
+
+  if (clock_gettime(CLOCK_MONOTONIC, &t_start) != 0) {
+    perror("clock_gettime");
+    exit(EXIT_FAILURE);
+  }
+
+  HashContext hash = {0};
+  QuerySession query;
+  if (hash_context_configure(&hash, audio_data.sample_rate) != 0 ||
+      query_session_init(&query, &index, &hash, flip_bits) != 0) {
+    exit(EXIT_FAILURE);
+  }
+
+  int status = query_clip(&query, &hash, &pcm, frames);
+
+  if (clock_gettime(CLOCK_MONOTONIC, &t_end) != 0) {
+    perror("clock_gettime");
+    exit(EXIT_FAILURE);
+  }
+
+  double elapsed =
+      (t_end.tv_sec - t_start.tv_sec) + (t_end.tv_nsec - t_start.tv_nsec) / 1e9;
+
+  if (status >= 0 && query.best_votes > 0) {
+    const VoteBin *best = &query.bins[query.best];
+    printf("%s: song %u at %.2f seconds (%u votes, runner-up %u)\n",
+           query_decided(&query) ? "Match" : "Best guess", best->song_id,
+           (double)best->delta * hash.hop_size / audio_data.sample_rate,
+           best->votes, query.second_votes);
+  } else if (status >= 0) {
+    printf("No match\n");
+  }
+  printf("Used %.2f of %.2f seconds, %zu lookups\n",
+         (double)query.frames * hash.hop_size / audio_data.sample_rate,
+         (double)frames / audio_data.sample_rate, query.lookups);
+  printf("Query took %.3f ms\n", elapsed * 1e3);
+
+  query_session_destroy(&query);
+  hash_context_destroy(&hash);
+  arena_destroy(&arena);
+  index_close(&index);
+
+  return status < 0 ? 1 : 0;
+}
+
+// Identifies whatever arrives on the capture source. Frames are hashed as
+// soon as a hop of new audio completes one. After each decision the vote
+// table restarts, so a long capture can recognise song after song; a song
+// is announced again only once something else has matched in between.
+int listen_main(const char *index_path, const char *source, long rate,
+                int channels, int flip_bits) {
+  FingerprintIndex index;
+  Capture cap = {.fd = STDIN_FILENO, .rate = rate, .channels = channels};
+
+  if (strncmp(source, "alsa:", 5) == 0) {
+#ifdef HACHING_ALSA
+    cap.alsa_device = source + 5;
+#else
+    fprintf(stderr, "Built without ALSA support (-DHACHING_ALSA)\n");
+    return 1;
+#endif
+  } else if (strcmp(source, "-") != 0) {
+    cap.fd = open(source, O_RDONLY);
+    if (cap.fd < 0) {
+      fprintf(stderr, "Unable to open %s: %s\n", source, strerror(errno));
+      return 1;
+    }
+  }
+
+  if (index_open(&index, index_path) != 0 ||
+      byte_ring_init(&cap.ring, CAPTURE_RING_BYTES) != 0) {
+    return 1;
+  }
+
+  HashContext hash = {0};
+  QuerySession query;
+  long hash_rate = resample_rate > 0 ? resample_rate : rate;
+  if (hash_context_configure(&hash, hash_rate) != 0 ||
+      query_session_init(&query, &index, &hash, flip_bits) != 0) {
+    exit(EXIT_FAILURE);
+  }
+
+  // Captured audio at another rate goes through a staging buffer and the
+  // resampler on its way into pending
+  Resampler resampler = {0};
+  short *captured = NULL;
+  if (hash_rate != rate) {
+    captured = malloc((size_t)CAPTURE_CHUNK * channels * sizeof(short));
+    if (captured == NULL ||
+        resampler_configure(&resampler, rate, hash_rate, channels) != 0) {
+      fprintf(stderr, "Error: Failed to allocate capture buffers.\n");
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  // Samples not yet consumed by a frame; a batch of frames needs
+  // frame_len + (batch - 1) * hop of them
+  size_t pending_capacity =
+      hash.frame_len + (size_t)hash.stft.batch * hash.hop_size;
+  short *pending = malloc(pending_capacity * channels * sizeof(short));
+  if (pending == NULL) {
+    fprintf(stderr, "Error: Failed to allocate capture buffers.\n");
+    exit(EXIT_FAILURE);
+  }
+
+  pthread_t thread;
+  if (pthread_create(&thread, NULL, capture_main, &cap) != 0) {
+    fprintf(stderr, "Unable to start capture thread\n");
+    exit(EXIT_FAILURE);
+  }
+
+  printf("Listening at %ld Hz, %d channels\n", rate, channels);
+  if (captured) {
+    printf("Resampling to %ld Hz\n", hash_rate);
+  }
+
+  size_t filled = 0;
+  size_t heard = 0;    // frames of audio at hash_rate taken in
+  size_t consumed = 0; // frames shifted out of pending
+  size_t start = 0;    // consumed when the current query began; its time 0
+  uint32_t last_song = 0;    // announced once until another song wins
+  int status = 0;
+
+  unsigned spins = 0;
+  for (;;) {
+    int drained = byte_ring_drained(&cap.ring);
+    size_t got;
+    if (captured) {
+      size_t limit = resampler_input_for(&resampler, pending_capacity - filled);
+      size_t in = byte_ring_drain_frames(
+          &cap.ring, 2 * (size_t)channels, captured,
+          limit < CAPTURE_CHUNK ? limit : CAPTURE_CHUNK);
+      got = resampler_process(&resampler, captured, in,
+                              pending + filled * channels);
+      if (got == (size_t)-1) {
+        status = -1;
+        break;
+      }
+    } else {
+      got = byte_ring_drain_frames(&cap.ring, 2 * (size_t)channels,
+                                   pending + filled * channels,
+                                   pending_capacity - filled);
+    }
+    filled += got;
+    heard += got;
+
+    if (filled < (size_t)hash.frame_len) {
+      if (got == 0 && drained) {
+        break;
+      }
+      if (got == 0) {
+        ring_backoff(&spins);
+      } else {
+        spins = 0;
+      }
+      continue;
+    }
+
+    int count = (filled - hash.frame_len) / hash.hop_size + 1;
+    if (count > hash.stft.batch) {
+      count = hash.stft.batch;
+    }
+    PcmView pcm = {pending, channels, hash_channel};
+    compute_band_energies(&hash, &pcm, count, hash.energies);
+    for (int f = 0; f < count && status == 0; f++) {
+      status = query_add_frame(&query, hash.energies + (size_t)f * NUM_BANDS);
+    }
+    if (status < 0) {
+      break;
+    }
+
+    size_t used = (size_t)count * hash.hop_size;
+    memmove(pending, pending + used * channels,
+            (filled - used) * channels * sizeof(short));
+    filled -= used;
+    consumed += used;
+
+    if (status == 1) {
+      const VoteBin *best = &query.bins[query.best];
+      if (best->song_id != last_song) {
+        printf("Match after %.2f seconds: song %u, now at %.2f seconds "
+               "(%u votes)\n",
+               (double)(heard - start) / hash_rate, best->song_id,
+               ((double)best->delta * hash.hop_size + heard - start) /
+                   hash_rate,
+               best->votes);
+        fflush(stdout);
+        last_song = best->song_id;
+      }
+      query_session_destroy(&query);
+      if (query_session_init(&query, &index, &hash, flip_bits) != 0) {
+        status = -1;
+        break;
+      }
+      start = consumed;
+      status = 0;
+    }
+  }
+
+  pthread_join(thread, NULL);
+
+  if (status == 0 && query.best_votes > 0) {
+    const VoteBin *best = &query.bins[query.best];
+    printf("Best guess: song %u at %.2f seconds (%u votes, runner-up %u)\n",
+           best->song_id, (double)best->delta * hash.hop_size / hash_rate,
+           best->votes, query.second_votes);
+  }
+  printf("Heard %.2f seconds\n", (double)heard / hash_rate);
+
+  if (cap.fd != STDIN_FILENO) {
+    close(cap.fd);
+  }
+  free(pending);
+  free(captured);
+  resampler_destroy(&resampler);
+  free(cap.ring.data);
+  query_session_destroy(&query);
+  hash_context_destroy(&hash);
+  index_close(&index);
+
+  return status < 0 ? 1 : 0;
+}
+
+void usage(const char *prog) {
+  printf("Usage: %s [--stream] [--print] <mp3_file>\n", prog);
+  printf("       %s --batch <directory|list_file|-> [--jobs N]\n", prog);
+  printf("       %s --build-index <fingerprint.db> <index_file>\n", prog);
+  printf("       %s --pack <fingerprint.db|song_file_dir> <archive>"
+         " [--with-postings]\n",
+         prog);
+  printf("       %s --unpack <archive> <fingerprint.db>\n", prog);
+  printf("       %s --query <index|archive> [--flip-bits N] <mp3_clip>\n", prog);
+  printf("       %s --listen <index|archive> [--input -|FILE|alsa:DEV]"
+         " [--rate HZ] [--channels N]\n",
+         prog);
+  printf("       %s --bench [--runs N] [--warmup N] <mp3_file>\n", prog);
+  printf("Options: --patient          plan with FFTW_PATIENT and save wisdom\n");
+  printf("         --wisdom-dir DIR   wisdom cache (~/.cache/hachingRewrite)\n");
+  printf("         --db PATH          store sub-fingerprints in fingerprint.db\n");
+  printf("         --defer-index      rebuild the hash index after the load\n");
+  printf("         --archive-dir DIR  write a .hfp song file per track to DIR\n");
+  printf("         --channel C        left (default), right or mix\n");
+  printf("         --resample HZ      hash at HZ (e.g. 5512) whatever the input"
+         " rate\n");
+  printf("         --stats SECONDS    print a stats line this often"
+         " (-DHACHING_METRICS)\n");
+  printf("         --metrics PATH     keep Prometheus text metrics in PATH\n");
+  printf("         --float            single-precision FFT and band energies\n");
+  printf("         --validate-float   report bit errors of float vs double\n");
+}
+
+int main(int argc, char *argv[]) {
+  const char *filename = NULL;
+  const char *batch = NULL;
+  int streaming = 0;
+  int print = 0;
+  int validate_float = 0;
+  int bench = 0;
+  double stats_interval = 0;
+  const char *metrics_path = NULL;
+  int runs = 10;
+  int warmup = 1;
+  const char *wisdom = NULL;
+  const char *db_path = NULL;
+  int defer_index = 0;
+  const char *index_db = NULL;
+  const char *index_out = NULL;
+  const char *pack_source = NULL;
+  const char *pack_out = NULL;
+  int pack_postings = 0;
+  const char *unpack_archive_path = NULL;
+  const char *unpack_db = NULL;
+  const char *query_index = NULL;
+  int flip_bits = 2;
+  const char *listen_index = NULL;
+  const char *input = "-";
+  long rate = 48000;
+  int channels = 2;
+  int jobs = (int)sysconf(_SC_NPROCESSORS_ONLN);
+
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--stream") == 0) {
+      streaming = 1;
+    } else if (strcmp(argv[i], "--print") == 0) {
+      print = 1;
+    } else if (strcmp(argv[i], "--resample") == 0 && i + 1 < argc) {
+      resample_rate = atol(argv[++i]);
+      if (resample_rate <= 0) {
+        usage(argv[0]);
+        return 1;
+      }
+    } else if (strcmp(argv[i], "--stats") == 0 && i + 1 < argc) {
+      stats_interval = atof(argv[++i]);
+    } else if (strcmp(argv[i], "--metrics") == 0 && i + 1 < argc) {
+      metrics_path = argv[++i];
+    } else if (strcmp(argv[i], "--bench") == 0) {
+      bench = 1;
+    } else if (strcmp(argv[i], "--runs") == 0 && i + 1 < argc) {
+      runs = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--warmup") == 0 && i + 1 < argc) {
+      warmup = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--float") == 0) {
+      hash_precision = PRECISION_FLOAT;
+    } else if (strcmp(argv[i], "--validate-float") == 0) {
+      validate_float = 1;
+    } else if (strcmp(argv[i], "--patient") == 0) {
+      plan_patient = 1;
+    } else if (strcmp(argv[i], "--wisdom-dir") == 0 && i + 1 < argc) {
+      wisdom = argv[++i];
+    } else if (strcmp(argv[i], "--db") == 0 && i + 1 < argc) {
+      db_path = argv[++i];
+    } else if (strcmp(argv[i], "--defer-index") == 0) {
+      defer_index = 1;
+    } else if (strcmp(argv[i], "--build-index") == 0 && i + 2 < argc) {
+      index_db = argv[++i];
+      index_out = argv[++i];
+    } else if (strcmp(argv[i], "--pack") == 0 && i + 2 < argc) {
+      pack_source = argv[++i];
+      pack_out = argv[++i];
+    } else if (strcmp(argv[i], "--with-postings") == 0) {
+      pack_postings = 1;
+    } else if (strcmp(argv[i], "--unpack") == 0 && i + 2 < argc) {
+      unpack_archive_path = argv[++i];
+      unpack_db = argv[++i];
+    } else if (strcmp(argv[i], "--archive-dir") == 0 && i + 1 < argc) {
+      song_file_dir = argv[++i];
+    } else if (strcmp(argv[i], "--query") == 0 && i + 1 < argc) {
+      query_index = argv[++i];
+    } else if (strcmp(argv[i], "--listen") == 0 && i + 1 < argc) {
+      listen_index = argv[++i];
+    } else if (strcmp(argv[i], "--input") == 0 && i + 1 < argc) {
+      input = argv[++i];
+    } else if (strcmp(argv[i], "--rate") == 0 && i + 1 < argc) {
+      rate = atol(argv[++i]);
+    } else if (strcmp(argv[i], "--channels") == 0 && i + 1 < argc) {
+      channels = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--channel") == 0 && i + 1 < argc) {
+      const char *name = argv[++i];
+      if (strcmp(name, "left") == 0) {
+        hash_channel = CHANNEL_LEFT;
+      } else if (strcmp(name, "right") == 0) {
+        hash_channel = CHANNEL_RIGHT;
+      } else if (strcmp(name, "mix") == 0) {
+        hash_channel = CHANNEL_MIX;
+      } else {
+        usage(argv[0]);
+        return 1;
+      }
+    } else if (strcmp(argv[i], "--flip-bits") == 0 && i + 1 < argc) {
+      flip_bits = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--batch") == 0 && i + 1 < argc) {
+      batch = argv[++i];
+    } else if (strcmp(argv[i], "--jobs") == 0 && i + 1 < argc) {
+      jobs = atoi(argv[++i]);
+    } else if (argv[i][0] != '-' && filename == NULL) {
+      filename = argv[i];
+    } else {
+      usage(argv[0]);
+      return 1;
+    }
+  }
+
+#ifndef HACHING_METRICS
+  if (stats_interval > 0 || metrics_path) {
+    fprintf(stderr, "Built without metrics support (-DHACHING_METRICS)\n");
+    return 1;
+  }
+#endif
+
+  if (index_db) {
+    if (batch || filename) {
+      usage(argv[0]);
+      return 1;
+    }
+    return build_index(index_db, index_out) == 0 ? 0 : 1;
+  }
+
+  if (pack_source || unpack_archive_path) {
+    if (batch || filename || (pack_source && unpack_archive_path)) {
+      usage(argv[0]);
+      return 1;
+    }
+    int status = pack_source ? pack_archive(pack_source, pack_out,
+                                            pack_postings)
+                             : unpack_archive(unpack_archive_path, unpack_db,
+                                              defer_index);
+    return status == 0 ? 0 : 1;
+  }
+
+  if (listen_index) {
+    if (batch || filename || rate <= 0 || channels <= 0) {
+      usage(argv[0]);
+      return 1;
+    }
+    init_wisdom_dir(wisdom);
+    select_simd_kernels();
+    if (METRICS_START(stats_interval, metrics_path) != 0) {
+      return 1;
+    }
+    int status = listen_main(listen_index, input, rate, channels, flip_bits);
+    METRICS_STOP();
+    destroy_plan_cache();
+    return status;
+  }
+
+  if ((batch == NULL) == (filename == NULL) || (batch && streaming) ||
+      (query_index && (batch || streaming)) ||
+      (validate_float && (batch || streaming || query_index)) ||
+      (bench && (batch || streaming || query_index || validate_float ||
+                 runs < 1 || warmup < 0))) {
+    usage(argv[0]);
+    return 1;
+  }
+
+  init_wisdom_dir(wisdom);
+  select_simd_kernels();
+  if (METRICS_START(stats_interval, metrics_path) != 0) {
+    return 1;
+  }
+
+  // mpg123 is initialized once per process; each thread reuses one handle
+  if (mpg123_init() != MPG123_OK) {
+    fprintf(stderr, "Failed to initialize mpg123\n");
+    return 1;
+  }
+
+  if (db_path) {
+    fingerprint_db = fingerprint_db_open(db_path, defer_index);
+    if (fingerprint_db == NULL) {
+      mpg123_exit();
+      return 1;
+    }
+  }
+
+  int status;
+  if (batch) {
+    status = batch_main(batch, jobs);
+  } else {
+    mpg123_handle *mh = new_mp3_decoder();
+    if (mh == NULL) {
+      mpg123_exit();
+      return 1;
+    }
+    if (bench) {
+      status = bench_main(mh, filename, runs, warmup);
+    } else if (query_index) {
+      status = query_main(mh, query_index, filename, flip_bits);
+    } else if (streaming) {
+      status = stream_main(mh, filename, print);
+    } else {
+      status = single_main(mh, filename, print, validate_float);
+    }
+    mpg123_delete(mh);
+  }
+
+  if (fingerprint_db && fingerprint_db_close(fingerprint_db) != 0) {
+    status = 1;
+  }
+
+  mpg123_exit();
+  destroy_plan_cache();
+  METRICS_STOP();
+
+  return status;
+}
@@ -5,9 +5,16 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#endif
 
 #ifndef PI
-#define PI 3.1415926535
+#define PI 3.14159265358979323846
 #endif
 // Structure to hold audio data
 typedef struct {
@@ -35,41 +42,787 @@ Complex mul(Complex a, Complex b) {
 
 double getLength(Complex a) { return sqrt(a.re * a.re + a.im * a.im); }
 
-Complex fromAngle(float amplitude, float angle) {
+Complex fromAngle(double amplitude, double angle) {
   return (Complex){amplitude * cos(angle), amplitude * sin(angle)};
 }
 
 double nextPowerOfTwo(int n) { return pow(2, ceil(log2(n))); }
 
+int isPowerOfTwo(size_t n) { return n > 0 && (n & (n - 1)) == 0; }
+
+// Split-complex (SoA) vector: real and imaginary parts live in separate
+// arrays so butterflies and pointwise products vectorize across bins.
+typedef struct {
+  double *re;
+  double *im;
+} SplitComplex;
+
+// Vector kernels, picked once per process by selectSimdKernels. Every
+// variant uses the scalar code's multiply/add sequence without FMA, so where
+// the compiler doesn't contract the scalar loops the results are identical.
+typedef struct {
+  const char *name;
+  int width; // doubles per vector; radix-4 stages with h below it go scalar
+  // One fused radix-4 stage over m points with quarter length h
+  void (*radix4Stage)(double *re, double *im, size_t m, size_t h,
+                      const double *wRe, const double *wIm);
+  // out = a * b elementwise; out may alias a
+  void (*complexMultiply)(const double *aRe, const double *aIm,
+                          const double *bRe, const double *bIm, double *outRe,
+                          double *outIm, size_t n);
+  void (*magnitude)(const double *re, const double *im, double *out,
+                    size_t n);
+  // |X|^2, for band energies where the sqrt is wasted work
+  void (*squaredMagnitude)(const double *re, const double *im, double *out,
+                           size_t n);
+} SimdKernels;
+
+// wRe/wIm hold W^k, W^2k and W^3k for k < h back to back, W = e^(-2 pi i/4h).
+// The radix-2 stage before them runs on bit-reversed input, so each call
+// fuses two radix-2 stages into butterflies of 3 twiddle multiplies.
+void radix4StageScalar(double *re, double *im, size_t m, size_t h,
+                       const double *wRe, const double *wIm) {
+  for (size_t i = 0; i < m; i += 4 * h) {
+    double *r = re + i, *q = im + i;
+    for (size_t k = 0; k < h; k++) {
+      double x0r = r[k], x0i = q[k];
+      double a1r = r[k + h], a1i = q[k + h];
+      double a2r = r[k + 2 * h], a2i = q[k + 2 * h];
+      double a3r = r[k + 3 * h], a3i = q[k + 3 * h];
+
+      double x1r = a1r * wRe[h + k] - a1i * wIm[h + k];
+      double x1i = a1r * wIm[h + k] + a1i * wRe[h + k];
+      double x2r = a2r * wRe[k] - a2i * wIm[k];
+      double x2i = a2r * wIm[k] + a2i * wRe[k];
+      double x3r = a3r * wRe[2 * h + k] - a3i * wIm[2 * h + k];
+      double x3i = a3r * wIm[2 * h + k] + a3i * wRe[2 * h + k];
+
+      double s0r = x0r + x1r, s0i = x0i + x1i;
+      double d0r = x0r - x1r, d0i = x0i - x1i;
+      double s1r = x2r + x3r, s1i = x2i + x3i;
+      double d1r = x2r - x3r, d1i = x2i - x3i;
+
+      r[k] = s0r + s1r;
+      q[k] = s0i + s1i;
+      r[k + h] = d0r + d1i;
+      q[k + h] = d0i - d1r;
+      r[k + 2 * h] = s0r - s1r;
+      q[k + 2 * h] = s0i - s1i;
+      r[k + 3 * h] = d0r - d1i;
+      q[k + 3 * h] = d0i + d1r;
+    }
+  }
+}
+
+void complexMultiplyScalar(const double *aRe, const double *aIm,
+                           const double *bRe, const double *bIm,
+                           double *outRe, double *outIm, size_t n) {
+  for (size_t k = 0; k < n; k++) {
+    double re = aRe[k] * bRe[k] - aIm[k] * bIm[k];
+    double im = aRe[k] * bIm[k] + aIm[k] * bRe[k];
+    outRe[k] = re;
+    outIm[k] = im;
+  }
+}
+
+void squaredMagnitudeScalar(const double *re, const double *im, double *out,
+                            size_t n) {
+  for (size_t k = 0; k < n; k++) {
+    out[k] = re[k] * re[k] + im[k] * im[k];
+  }
+}
+
+void magnitudeScalar(const double *re, const double *im, double *out,
+                     size_t n) {
+  for (size_t k = 0; k < n; k++) {
+    out[k] = sqrt(re[k] * re[k] + im[k] * im[k]);
+  }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+#define AVX2 __attribute__((target("avx2")))
+
+AVX2 static inline void mulAvx2(__m256d ar, __m256d ai, __m256d br,
+                                __m256d bi, __m256d *outRe, __m256d *outIm) {
+  *outRe = _mm256_sub_pd(_mm256_mul_pd(ar, br), _mm256_mul_pd(ai, bi));
+  *outIm = _mm256_add_pd(_mm256_mul_pd(ar, bi), _mm256_mul_pd(ai, br));
+}
+
+AVX2 void radix4StageAvx2(double *re, double *im, size_t m, size_t h,
+                          const double *wRe, const double *wIm) {
+  for (size_t i = 0; i < m; i += 4 * h) {
+    double *r = re + i, *q = im + i;
+    for (size_t k = 0; k < h; k += 4) {
+      __m256d x0r = _mm256_loadu_pd(r + k), x0i = _mm256_loadu_pd(q + k);
+      __m256d x1r, x1i, x2r, x2i, x3r, x3i;
+      mulAvx2(_mm256_loadu_pd(r + k + h), _mm256_loadu_pd(q + k + h),
+              _mm256_loadu_pd(wRe + h + k), _mm256_loadu_pd(wIm + h + k),
+              &x1r, &x1i);
+      mulAvx2(_mm256_loadu_pd(r + k + 2 * h), _mm256_loadu_pd(q + k + 2 * h),
+              _mm256_loadu_pd(wRe + k), _mm256_loadu_pd(wIm + k), &x2r, &x2i);
+      mulAvx2(_mm256_loadu_pd(r + k + 3 * h), _mm256_loadu_pd(q + k + 3 * h),
+              _mm256_loadu_pd(wRe + 2 * h + k),
+              _mm256_loadu_pd(wIm + 2 * h + k), &x3r, &x3i);
+
+      __m256d s0r = _mm256_add_pd(x0r, x1r), s0i = _mm256_add_pd(x0i, x1i);
+      __m256d d0r = _mm256_sub_pd(x0r, x1r), d0i = _mm256_sub_pd(x0i, x1i);
+      __m256d s1r = _mm256_add_pd(x2r, x3r), s1i = _mm256_add_pd(x2i, x3i);
+      __m256d d1r = _mm256_sub_pd(x2r, x3r), d1i = _mm256_sub_pd(x2i, x3i);
+
+      _mm256_storeu_pd(r + k, _mm256_add_pd(s0r, s1r));
+      _mm256_storeu_pd(q + k, _mm256_add_pd(s0i, s1i));
+      _mm256_storeu_pd(r + k + h, _mm256_add_pd(d0r, d1i));
+      _mm256_storeu_pd(q + k + h, _mm256_sub_pd(d0i, d1r));
+      _mm256_storeu_pd(r + k + 2 * h, _mm256_sub_pd(s0r, s1r));
+      _mm256_storeu_pd(q + k + 2 * h, _mm256_sub_pd(s0i, s1i));
+      _mm256_storeu_pd(r + k + 3 * h, _mm256_sub_pd(d0r, d1i));
+      _mm256_storeu_pd(q + k + 3 * h, _mm256_add_pd(d0i, d1r));
+    }
+  }
+}
+
+AVX2 void complexMultiplyAvx2(const double *aRe, const double *aIm,
+                              const double *bRe, const double *bIm,
+                              double *outRe, double *outIm, size_t n) {
+  size_t k = 0;
+  for (; k + 4 <= n; k += 4) {
+    __m256d re, im;
+    mulAvx2(_mm256_loadu_pd(aRe + k), _mm256_loadu_pd(aIm + k),
+            _mm256_loadu_pd(bRe + k), _mm256_loadu_pd(bIm + k), &re, &im);
+    _mm256_storeu_pd(outRe + k, re);
+    _mm256_storeu_pd(outIm + k, im);
+  }
+  complexMultiplyScalar(aRe + k, aIm + k, bRe + k, bIm + k, outRe + k,
+                        outIm + k, n - k);
+}
+
+AVX2 void squaredMagnitudeAvx2(const double *re, const double *im,
+                               double *out, size_t n) {
+  size_t k = 0;
+  for (; k + 4 <= n; k += 4) {
+    __m256d r = _mm256_loadu_pd(re + k), i = _mm256_loadu_pd(im + k);
+    _mm256_storeu_pd(out + k,
+                     _mm256_add_pd(_mm256_mul_pd(r, r), _mm256_mul_pd(i, i)));
+  }
+  squaredMagnitudeScalar(re + k, im + k, out + k, n - k);
+}
+
+AVX2 void magnitudeAvx2(const double *re, const double *im, double *out,
+                        size_t n) {
+  size_t k = 0;
+  for (; k + 4 <= n; k += 4) {
+    __m256d r = _mm256_loadu_pd(re + k), i = _mm256_loadu_pd(im + k);
+    _mm256_storeu_pd(out + k, _mm256_sqrt_pd(_mm256_add_pd(
+                                  _mm256_mul_pd(r, r), _mm256_mul_pd(i, i))));
+  }
+  magnitudeScalar(re + k, im + k, out + k, n - k);
+}
+#endif
+
+#if defined(__aarch64__)
+// NEON is part of the AArch64 baseline, so it needs no runtime check
+static inline void mulNeon(float64x2_t ar, float64x2_t ai, float64x2_t br,
+                           float64x2_t bi, float64x2_t *outRe,
+                           float64x2_t *outIm) {
+  *outRe = vsubq_f64(vmulq_f64(ar, br), vmulq_f64(ai, bi));
+  *outIm = vaddq_f64(vmulq_f64(ar, bi), vmulq_f64(ai, br));
+}
+
+void radix4StageNeon(double *re, double *im, size_t m, size_t h,
+                     const double *wRe, const double *wIm) {
+  for (size_t i = 0; i < m; i += 4 * h) {
+    double *r = re + i, *q = im + i;
+    for (size_t k = 0; k < h; k += 2) {
+      float64x2_t x0r = vld1q_f64(r + k), x0i = vld1q_f64(q + k);
+      float64x2_t x1r, x1i, x2r, x2i, x3r, x3i;
+      mulNeon(vld1q_f64(r + k + h), vld1q_f64(q + k + h),
+              vld1q_f64(wRe + h + k), vld1q_f64(wIm + h + k), &x1r, &x1i);
+      mulNeon(vld1q_f64(r + k + 2 * h), vld1q_f64(q + k + 2 * h),
+              vld1q_f64(wRe + k), vld1q_f64(wIm + k), &x2r, &x2i);
+      mulNeon(vld1q_f64(r + k + 3 * h), vld1q_f64(q + k + 3 * h),
+              vld1q_f64(wRe + 2 * h + k), vld1q_f64(wIm + 2 * h + k), &x3r,
+              &x3i);
+
+      float64x2_t s0r = vaddq_f64(x0r, x1r), s0i = vaddq_f64(x0i, x1i);
+      float64x2_t d0r = vsubq_f64(x0r, x1r), d0i = vsubq_f64(x0i, x1i);
+      float64x2_t s1r = vaddq_f64(x2r, x3r), s1i = vaddq_f64(x2i, x3i);
+      float64x2_t d1r = vsubq_f64(x2r, x3r), d1i = vsubq_f64(x2i, x3i);
+
+      vst1q_f64(r + k, vaddq_f64(s0r, s1r));
+      vst1q_f64(q + k, vaddq_f64(s0i, s1i));
+      vst1q_f64(r + k + h, vaddq_f64(d0r, d1i));
+      vst1q_f64(q + k + h, vsubq_f64(d0i, d1r));
+      vst1q_f64(r + k + 2 * h, vsubq_f64(s0r, s1r));
+      vst1q_f64(q + k + 2 * h, vsubq_f64(s0i, s1i));
+      vst1q_f64(r + k + 3 * h, vsubq_f64(d0r, d1i));
+      vst1q_f64(q + k + 3 * h, vaddq_f64(d0i, d1r));
+    }
+  }
+}
+
+void complexMultiplyNeon(const double *aRe, const double *aIm,
+                         const double *bRe, const double *bIm, double *outRe,
+                         double *outIm, size_t n) {
+  size_t k = 0;
+  for (; k + 2 <= n; k += 2) {
+    float64x2_t re, im;
+    mulNeon(vld1q_f64(aRe + k), vld1q_f64(aIm + k), vld1q_f64(bRe + k),
+            vld1q_f64(bIm + k), &re, &im);
+    vst1q_f64(outRe + k, re);
+    vst1q_f64(outIm + k, im);
+  }
+  complexMultiplyScalar(aRe + k, aIm + k, bRe + k, bIm + k, outRe + k,
+                        outIm + k, n - k);
+}
+
+void squaredMagnitudeNeon(const double *re, const double *im, double *out,
+                          size_t n) {
+  size_t k = 0;
+  for (; k + 2 <= n; k += 2) {
+    float64x2_t r = vld1q_f64(re + k), i = vld1q_f64(im + k);
+    vst1q_f64(out + k, vaddq_f64(vmulq_f64(r, r), vmulq_f64(i, i)));
+  }
+  squaredMagnitudeScalar(re + k, im + k, out + k, n - k);
+}
+
+void magnitudeNeon(const double *re, const double *im, double *out,
+                   size_t n) {
+  size_t k = 0;
+  for (; k + 2 <= n; k += 2) {
+    float64x2_t r = vld1q_f64(re + k), i = vld1q_f64(im + k);
+    vst1q_f64(out + k,
+              vsqrtq_f64(vaddq_f64(vmulq_f64(r, r), vmulq_f64(i, i))));
+  }
+  magnitudeScalar(re + k, im + k, out + k, n - k);
+}
+#endif
+
+SimdKernels simd = {"scalar", 1, radix4StageScalar, complexMultiplyScalar,
+                    magnitudeScalar, squaredMagnitudeScalar};
+
+// Picks the widest kernels this CPU runs. HACHING_SIMD=scalar forces the
+// portable path, e.g. to compare outputs.
+void selectSimdKernels(void) {
+  const char *forced = getenv("HACHING_SIMD");
+  if (forced != NULL && strcmp(forced, "scalar") == 0) {
+    return;
+  }
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) {
+    simd = (SimdKernels){"avx2",        4, radix4StageAvx2, complexMultiplyAvx2,
+                         magnitudeAvx2, squaredMagnitudeAvx2};
+  }
+#elif defined(__aarch64__)
+  simd = (SimdKernels){"neon",        2, radix4StageNeon, complexMultiplyNeon,
+                       magnitudeNeon, squaredMagnitudeNeon};
+#endif
+}
+
+// Everything a transform of one length needs, built once by createFFTPlan
+// and read-only afterwards, so a plan can be shared between threads.
+// Bluestein turns an n-point DFT into a cyclic convolution of length m; with
+// the chirp and FFT(B) precomputed an execution costs one forward and one
+// inverse m-point transform and no trig or allocation.
+typedef struct {
+  size_t n;
+  size_t m;          // n for powers of two, else pow2 >= 2n - 1
+  int *bitrev;       // radix-2 bit-reversal permutation of 0..m-1
+  double *twRe;      // per-stage radix-4 twiddles, see radix4StageScalar
+  double *twIm;
+  double *chirpRe;   // e^(-i pi k^2 / n), k < n; NULL when m == n
+  double *chirpIm;
+  double *fftBRe;    // FFT of the conjugate chirp wrapped to length m, / m
+  double *fftBIm;
+} FFTPlan;
+
+void destroyFFTPlan(FFTPlan *plan) {
+  if (plan == NULL) {
+    return;
+  }
+  free(plan->bitrev);
+  free(plan->twRe);
+  free(plan->twIm);
+  free(plan->chirpRe);
+  free(plan->chirpIm);
+  free(plan->fftBRe);
+  free(plan->fftBIm);
+  free(plan);
+}
+
+// Iterative in-place forward FFT of plan->m points. After the bit-reversal
+// permutation an odd stage count starts with one plain radix-2 pass, and
+// the remaining stages run as radix-4 butterflies.
+void fftRadix4(const FFTPlan *plan, double *re, double *im) {
+  size_t m = plan->m;
+
+  for (size_t i = 0; i < m; i++) {
+    size_t j = plan->bitrev[i];
+    if (i < j) {
+      double t = re[i];
+      re[i] = re[j];
+      re[j] = t;
+      t = im[i];
+      im[i] = im[j];
+      im[j] = t;
+    }
+  }
+
+  size_t h = 1;
+  if ((int)log2(m) % 2 == 1) {
+    for (size_t i = 0; i < m; i += 2) {
+      double ur = re[i], ui = im[i];
+      re[i] = ur + re[i + 1];
+      im[i] = ui + im[i + 1];
+      re[i + 1] = ur - re[i + 1];
+      im[i + 1] = ui - im[i + 1];
+    }
+    h = 2;
+  }
+
+  size_t offset = 0;
+  for (; 4 * h <= m; h *= 4) {
+    const double *wRe = plan->twRe + offset, *wIm = plan->twIm + offset;
+    if ((int)h >= simd.width) {
+      simd.radix4Stage(re, im, m, h, wRe, wIm);
+    } else {
+      radix4StageScalar(re, im, m, h, wRe, wIm);
+    }
+    offset += 3 * h;
+  }
+}
+
+FFTPlan *createFFTPlan(size_t n) {
+  FFTPlan *plan = calloc(1, sizeof(FFTPlan));
+  if (plan == NULL) {
+    return NULL;
+  }
+
+  size_t m = isPowerOfTwo(n) ? n : nextPowerOfTwo(n * 2 - 1);
+  int bits = (int)log2(m);
+  plan->n = n;
+  plan->m = m;
+
+  size_t h0 = bits % 2 == 1 ? 2 : 1;
+  size_t twiddles = 0;
+  for (size_t h = h0; 4 * h <= m; h *= 4) {
+    twiddles += 3 * h;
+  }
+
+  plan->bitrev = malloc(m * sizeof(int));
+  plan->twRe = malloc((twiddles + 1) * sizeof(double));
+  plan->twIm = malloc((twiddles + 1) * sizeof(double));
+  if (plan->bitrev == NULL || plan->twRe == NULL || plan->twIm == NULL) {
+    destroyFFTPlan(plan);
+    return NULL;
+  }
+
+  for (size_t k = 0; k < m; k++) {
+    size_t r = 0;
+    for (int b = 0; b < bits; b++) {
+      r |= ((k >> b) & 1) << (bits - 1 - b);
+    }
+    plan->bitrev[k] = r;
+  }
+
+  size_t offset = 0;
+  for (size_t h = h0; 4 * h <= m; h *= 4) {
+    for (size_t j = 0; j < 3; j++) {
+      for (size_t k = 0; k < h; k++) {
+        Complex w = fromAngle(1, -2 * PI * (double)((j + 1) * k) / (4 * h));
+        plan->twRe[offset + j * h + k] = w.re;
+        plan->twIm[offset + j * h + k] = w.im;
+      }
+    }
+    offset += 3 * h;
+  }
+
+  // Power-of-two lengths need no convolution
+  if (m == n) {
+    return plan;
+  }
+
+  plan->chirpRe = malloc(n * sizeof(double));
+  plan->chirpIm = malloc(n * sizeof(double));
+  plan->fftBRe = calloc(m, sizeof(double));
+  plan->fftBIm = calloc(m, sizeof(double));
+  if (plan->chirpRe == NULL || plan->chirpIm == NULL ||
+      plan->fftBRe == NULL || plan->fftBIm == NULL) {
+    destroyFFTPlan(plan);
+    return NULL;
+  }
+
+  // chirp sequence; k^2 is reduced mod 2n so the phase keeps its precision
+  for (size_t k = 0; k < n; k++) {
+    double phase = -PI * (double)((k * k) % (2 * n)) / n;
+    Complex w = fromAngle(1, phase);
+    plan->chirpRe[k] = w.re;
+    plan->chirpIm[k] = w.im;
+  }
+
+  // B is the conjugate chirp, which is symmetric: B[m - k] = B[k]
+  for (size_t k = 0; k < n; k++) {
+    plan->fftBRe[k] = plan->chirpRe[k];
+    plan->fftBIm[k] = -plan->chirpIm[k];
+  }
+  for (size_t k = 1; k < n; k++) {
+    plan->fftBRe[m - k] = plan->fftBRe[k];
+    plan->fftBIm[m - k] = plan->fftBIm[k];
+  }
+  fftRadix4(plan, plan->fftBRe, plan->fftBIm);
+
+  // Fold the 1/m of the inverse transform in here
+  for (size_t k = 0; k < m; k++) {
+    plan->fftBRe[k] /= m;
+    plan->fftBIm[k] /= m;
+  }
+
+  return plan;
+}
+
+// Length of each scratch array executeFFTPlan needs, in doubles.
+size_t fftPlanWorkLength(const FFTPlan *plan) {
+  return plan->m == plan->n ? 0 : plan->m;
+}
+
+// Forward DFT of plan->n values from in to out (which may alias). work must
+// hold fftPlanWorkLength(plan) entries per array, and may be empty when
+// that is 0.
+void executeFFTPlan(const FFTPlan *plan, SplitComplex in, SplitComplex out,
+                    SplitComplex work) {
+  size_t n = plan->n, m = plan->m;
+
+  if (m == n) {
+    if (out.re != in.re) {
+      memcpy(out.re, in.re, n * sizeof(double));
+      memcpy(out.im, in.im, n * sizeof(double));
+    }
+    fftRadix4(plan, out.re, out.im);
+    return;
+  }
+
+  // A = in * chirp, zero padded to m
+  simd.complexMultiply(in.re, in.im, plan->chirpRe, plan->chirpIm, work.re,
+                       work.im, n);
+  memset(work.re + n, 0, (m - n) * sizeof(double));
+  memset(work.im + n, 0, (m - n) * sizeof(double));
+
+  // Cyclic convolution with B in the frequency domain. Swapping the real
+  // and imaginary arrays turns the forward transform into the inverse.
+  fftRadix4(plan, work.re, work.im);
+  simd.complexMultiply(work.re, work.im, plan->fftBRe, plan->fftBIm, work.re,
+                       work.im, m);
+  fftRadix4(plan, work.im, work.re);
+
+  // Extract result and apply final chirp
+  simd.complexMultiply(work.re, work.im, plan->chirpRe, plan->chirpIm, out.re,
+                       out.im, n);
+}
+
+// One-off forward DFT of any length. Returns a newly allocated array of
+// bufflen values that the caller frees, or NULL when out of memory. Repeated
+// transforms should hold an FFTPlan instead.
 Complex *bluesteinFFT(Complex *buff, size_t bufflen) {
+  FFTPlan *plan = createFFTPlan(bufflen);
+  if (plan == NULL) {
+    return NULL;
+  }
+
+  size_t work = fftPlanWorkLength(plan);
+  double *split = malloc((2 * bufflen + 2 * work) * sizeof(double));
   Complex *result = malloc(bufflen * sizeof(Complex));
+  if (split != NULL && result != NULL) {
+    SplitComplex data = {split, split + bufflen};
+    SplitComplex scratch = {split + 2 * bufflen, split + 2 * bufflen + work};
+    for (size_t k = 0; k < bufflen; k++) {
+      data.re[k] = buff[k].re;
+      data.im[k] = buff[k].im;
+    }
+    executeFFTPlan(plan, data, data, scratch);
+    for (size_t k = 0; k < bufflen; k++) {
+      result[k] = (Complex){data.re[k], data.im[k]};
+    }
+  } else {
+    free(result);
+    result = NULL;
+  }
+
+  free(split);
+  destroyFFTPlan(plan);
+  return result;
+}
+
+// Real-input transform returning the n/2 + 1 non-redundant bins, like
+// FFTW's r2c. Even lengths pack x[2k] + i x[2k+1] into an n/2-point complex
+// FFT and recover the spectrum with one split pass; odd lengths fall back
+// to a full complex transform.
+typedef struct {
+  size_t n;
+  FFTPlan *inner; // n/2 points for even n, n points for odd n
+  double *splitARe; // (1 - i W^k) / 2 with W = e^(-2 pi i / n), k <= n/2
+  double *splitAIm;
+  double *splitBRe; // (1 + i W^k) / 2
+  double *splitBIm;
+} RealFFTPlan;
+
+void destroyRealFFTPlan(RealFFTPlan *plan) {
+  if (plan == NULL) {
+    return;
+  }
+  destroyFFTPlan(plan->inner);
+  free(plan->splitARe);
+  free(plan->splitAIm);
+  free(plan->splitBRe);
+  free(plan->splitBIm);
+  free(plan);
+}
+
+RealFFTPlan *createRealFFTPlan(size_t n) {
+  RealFFTPlan *plan = calloc(1, sizeof(RealFFTPlan));
+  if (plan == NULL) {
+    return NULL;
+  }
+  plan->n = n;
+
+  if (n % 2 == 1) {
+    plan->inner = createFFTPlan(n);
+    if (plan->inner == NULL) {
+      destroyRealFFTPlan(plan);
+      return NULL;
+    }
+    return plan;
+  }
 
-  // chirp sequence
-  Complex *chirp = malloc(bufflen * sizeof(Complex));
+  size_t half = n / 2;
+  plan->inner = createFFTPlan(half);
+  plan->splitARe = malloc((half + 1) * sizeof(double));
+  plan->splitAIm = malloc((half + 1) * sizeof(double));
+  plan->splitBRe = malloc((half + 1) * sizeof(double));
+  plan->splitBIm = malloc((half + 1) * sizeof(double));
+  if (plan->inner == NULL || plan->splitARe == NULL ||
+      plan->splitAIm == NULL || plan->splitBRe == NULL ||
+      plan->splitBIm == NULL) {
+    destroyRealFFTPlan(plan);
+    return NULL;
+  }
+
+  for (size_t k = 0; k <= half; k++) {
+    Complex w = fromAngle(1, -2 * PI * k / n);
+    plan->splitARe[k] = (1 + w.im) / 2;
+    plan->splitAIm[k] = -w.re / 2;
+    plan->splitBRe[k] = (1 - w.im) / 2;
+    plan->splitBIm[k] = w.re / 2;
+  }
+
+  return plan;
+}
+
+// Length of each scratch array executeRealFFTPlan needs, in doubles.
+size_t realFFTPlanWorkLength(const RealFFTPlan *plan) {
+  return plan->inner->n + fftPlanWorkLength(plan->inner);
+}
+
+// Spectrum of plan->n reals into out[0..n/2]. work must hold
+// realFFTPlanWorkLength(plan) entries per array and not overlap out.
+void executeRealFFTPlan(const RealFFTPlan *plan, const double *in,
+                        SplitComplex out, SplitComplex work) {
+  size_t len = plan->inner->n;
+  SplitComplex z = {work.re, work.im};
+  SplitComplex scratch = {work.re + len, work.im + len};
+
+  if (plan->n % 2 == 1) {
+    memcpy(z.re, in, len * sizeof(double));
+    memset(z.im, 0, len * sizeof(double));
+    executeFFTPlan(plan->inner, z, z, scratch);
+    memcpy(out.re, z.re, (len / 2 + 1) * sizeof(double));
+    memcpy(out.im, z.im, (len / 2 + 1) * sizeof(double));
+    return;
+  }
+
+  for (size_t k = 0; k < len; k++) {
+    z.re[k] = in[2 * k];
+    z.im[k] = in[2 * k + 1];
+  }
+  executeFFTPlan(plan->inner, z, z, scratch);
+
+  // X[k] = Z[k] A[k] + conj(Z[len - k]) B[k], indices mod len
+  for (size_t k = 0; k <= len; k++) {
+    size_t a = k == len ? 0 : k;
+    size_t b = k == 0 ? 0 : len - k;
+    double ar = z.re[a], ai = z.im[a];
+    double br = z.re[b], bi = -z.im[b];
+    out.re[k] = ar * plan->splitARe[k] - ai * plan->splitAIm[k] +
+                br * plan->splitBRe[k] - bi * plan->splitBIm[k];
+    out.im[k] = ar * plan->splitAIm[k] + ai * plan->splitARe[k] +
+                br * plan->splitBIm[k] + bi * plan->splitBRe[k];
+  }
+}
+
+// Length of each scratch array executeStereoFFTPlan needs, in doubles.
+size_t stereoFFTPlanWorkLength(const FFTPlan *plan) {
+  return plan->n + fftPlanWorkLength(plan);
+}
+
+// Spectra of both channels of plan->n interleaved stereo frames from a
+// single complex FFT. Left rides in the real part and right in the imaginary
+// part; since both are real, conjugate symmetry separates them again:
+//   L[k] = (Z[k] + conj(Z[n - k])) / 2,  R[k] = (Z[k] - conj(Z[n - k])) / 2i
+// left and right receive n/2 + 1 bins each. work must hold
+// stereoFFTPlanWorkLength(plan) entries per array and not overlap the outputs.
+void executeStereoFFTPlan(const FFTPlan *plan, const short *interleaved,
+                          SplitComplex left, SplitComplex right,
+                          SplitComplex work) {
+  size_t n = plan->n;
+  SplitComplex z = {work.re, work.im};
+  SplitComplex scratch = {work.re + n, work.im + n};
+
+  for (size_t k = 0; k < n; k++) {
+    z.re[k] = interleaved[2 * k];
+    z.im[k] = interleaved[2 * k + 1];
+  }
+  executeFFTPlan(plan, z, z, scratch);
+
+  for (size_t k = 0; k <= n / 2; k++) {
+    size_t j = k == 0 ? 0 : n - k;
+    double ar = z.re[k], ai = z.im[k];
+    double br = z.re[j], bi = z.im[j];
+    left.re[k] = (ar + br) / 2;
+    left.im[k] = (ai - bi) / 2;
+    right.re[k] = (ai + bi) / 2;
+    right.im[k] = (br - ar) / 2;
+  }
+}
+
+// Turns separated left/right spectra into mid (L + R) / 2 and side
+// (L - R) / 2 in place. The transform is linear, so this needs no new FFT.
+void midSideFromStereo(SplitComplex left, SplitComplex right, size_t bins) {
+  for (size_t k = 0; k < bins; k++) {
+    double lr = left.re[k], li = left.im[k];
+    left.re[k] = (lr + right.re[k]) / 2;
+    left.im[k] = (li + right.im[k]) / 2;
+    right.re[k] = (lr - right.re[k]) / 2;
+    right.im[k] = (li - right.im[k]) / 2;
+  }
+}
+
+// Bump allocator for track and transform scratch, as in hachingRewrite.c.
+// Allocations are 64-byte aligned, so every SIMD kernel sees aligned
+// arrays. arena_reset releases a whole track in O(1). If
+// the track overflowed the current block, the reset swaps the chain for one
+// block that holds all of it, so tracks up to that size never again reach
+// the system allocator.
+#define ARENA_ALIGN 64
+#define ARENA_MIN_BLOCK (1 << 20)
+
+typedef struct ArenaBlock {
+  struct ArenaBlock *prev;
+  size_t capacity;
+  size_t used;
+} ArenaBlock; // the data starts ARENA_ALIGN bytes into the block
+
+typedef struct {
+  ArenaBlock *current;
+  size_t total; // bytes handed out since the last reset, padding included
+  void *last; // most recent allocation, the only one that can grow in place
+} Arena;
+
+size_t arena_round(size_t bytes) {
+  return (bytes + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+}
+
+unsigned char *arena_block_data(ArenaBlock *block) {
+  return (unsigned char *)block + ARENA_ALIGN;
+}
 
-  for (int k = 0; k < bufflen; k++) {
-    float phase = (-PI * k * k) / bufflen;
-    chirp[k] = fromAngle(1, phase);
+ArenaBlock *arena_new_block(size_t capacity) {
+  void *mem;
+  if (posix_memalign(&mem, ARENA_ALIGN, ARENA_ALIGN + capacity) != 0) {
+    return NULL;
   }
-  int m = nextPowerOfTwo(bufflen * 2 - 1);
+  ArenaBlock *block = mem;
+  block->prev = NULL;
+  block->capacity = capacity;
+  block->used = 0;
+  return block;
+}
 
-  // prepare sequences for convolution
-  Complex *A = malloc(m * sizeof(Complex));
-  Complex *B = malloc(m * sizeof(Complex));
-  memset(A, 0, m * sizeof(Complex));
-  memset(B, 0, m * sizeof(Complex));
+void arena_free_blocks(ArenaBlock *block) {
+  while (block != NULL) {
+    ArenaBlock *prev = block->prev;
+    free(block);
+    block = prev;
+  }
+}
+
+void arena_destroy(Arena *arena) {
+  arena_free_blocks(arena->current);
+  memset(arena, 0, sizeof(*arena));
+}
 
-  // fill sequences
-  for (int k = 0; k < bufflen; k++) {
-    A[k] = mul(buff[k], chirp[k]);
-    B[k] = fromAngle(1, (PI * k * k) / bufflen);
+void *arena_alloc(Arena *arena, size_t bytes) {
+  size_t size = arena_round(bytes > 0 ? bytes : 1);
+  ArenaBlock *block = arena->current;
+
+  if (block == NULL || block->capacity - block->used < size) {
+    size_t capacity = size > ARENA_MIN_BLOCK ? size : ARENA_MIN_BLOCK;
+    if (block != NULL && capacity < 2 * block->capacity) {
+      capacity = 2 * block->capacity;
+    }
+    ArenaBlock *fresh = arena_new_block(capacity);
+    if (fresh == NULL) {
+      return NULL;
+    }
+    fresh->prev = block;
+    arena->current = block = fresh;
   }
-  for (int k = 1; k < bufflen; k++) {
-    B[m - k] = (Complex){B[k].re, -B[k].im};
+
+  void *ptr = arena_block_data(block) + block->used;
+  block->used += size;
+  arena->total += size;
+  arena->last = ptr;
+  return ptr;
+}
+
+// Resizes ptr, which holds old_bytes. The most recent allocation grows or
+// shrinks in place while its block has room; anything else is moved, and
+// the old copy is reclaimed by the next reset.
+void *arena_grow(Arena *arena, void *ptr, size_t old_bytes, size_t new_bytes) {
+  ArenaBlock *block = arena->current;
+
+  if (ptr != NULL && ptr == arena->last) {
+    size_t offset = (unsigned char *)ptr - arena_block_data(block);
+    size_t size = arena_round(new_bytes > 0 ? new_bytes : 1);
+    if (block->capacity - offset >= size) {
+      arena->total = arena->total - (block->used - offset) + size;
+      block->used = offset + size;
+      return ptr;
+    }
+  }
+
+  void *moved = arena_alloc(arena, new_bytes);
+  if (moved != NULL && ptr != NULL) {
+    memcpy(moved, ptr, old_bytes < new_bytes ? old_bytes : new_bytes);
+  }
+  return moved;
+}
+
+void arena_reset(Arena *arena) {
+  ArenaBlock *block = arena->current;
+
+  if (block != NULL && block->prev != NULL) {
+    arena_free_blocks(block);
+    arena->current = arena_new_block(arena->total);
+  } else if (block != NULL) {
+    block->used = 0;
   }
+  arena->total = 0;
+  arena->last = NULL;
 }
 
-int extract_mp3_samples(const char *filename, AudioData *audio_data) {
+// Decodes all of filename. The samples are allocated from arena and stay
+// valid until it is reset.
+int extract_mp3_samples(const char *filename, AudioData *audio_data,
+                        Arena *arena) {
   mpg123_handle *mh;
   unsigned char *buffer;
   size_t buffer_size;
@@ -132,13 +885,10 @@ int extract_mp3_samples(const char *filename, AudioData *audio_data) {
   audio_data->num_samples = 0;
   audio_data->samples = NULL;
 
-  printf("Sample rate: %ld Hz\n", rate);
-  printf("Channels: %d\n", channels);
-
   // Read and decode the entire file
   size_t total_samples = 0;
   size_t capacity = rate * channels * 2; // Initial capacity for ~2 seconds
-  audio_data->samples = malloc(capacity * sizeof(short));
+  audio_data->samples = arena_alloc(arena, capacity * sizeof(short));
 
   if (audio_data->samples == NULL) {
     fprintf(stderr, "Unable to allocate sample buffer\n");
@@ -154,9 +904,10 @@ int extract_mp3_samples(const char *filename, AudioData *audio_data) {
 
     // Resize buffer if needed
     if (total_samples + samples_in_buffer > capacity) {
-      capacity *= 2;
       audio_data->samples =
-          realloc(audio_data->samples, capacity * sizeof(short));
+          arena_grow(arena, audio_data->samples, capacity * sizeof(short),
+                     2 * capacity * sizeof(short));
+      capacity *= 2;
       if (audio_data->samples == NULL) {
         fprintf(stderr, "Unable to reallocate sample buffer\n");
         free(buffer);
@@ -187,26 +938,351 @@ int extract_mp3_samples(const char *filename, AudioData *audio_data) {
   return 0;
 }
 
+// --bench: times each stage of the hop loop over several runs after some
+// warmup runs, then times the real transform alone at the frame lengths
+// hachingRewrite.c hashes with at common sample rates. The table matches
+// hachingRewrite --bench, so this engine can be diffed against FFTW.
+// Percentiles are nearest rank over the runs; throughput and the realtime
+// factor use the median.
+#define BENCH_FFT_SAMPLES (1 << 21) // per run and frame length
+#define BENCH_FRAME_SECONDS 0.37    // FRAME_LENGTH_SECONDS in hachingRewrite.c
+#define BENCH_HOP_SECONDS (BENCH_FRAME_SECONDS / 32)
+
+enum {
+  BENCH_DECODE,
+  BENCH_CONVERT,
+  BENCH_FFT,
+  BENCH_MAGNITUDE,
+  BENCH_TOTAL,
+  BENCH_STAGES
+};
+
+const char *bench_stage_names[BENCH_STAGES] = {"decode", "convert", "fft",
+                                               "magnitude", "total"};
+
+const long bench_rates[] = {5512, 8000, 11025, 16000, 22050, 44100, 48000};
+
+double seconds_between(const struct timespec *start,
+                       const struct timespec *end) {
+  return (end->tv_sec - start->tv_sec) + (end->tv_nsec - start->tv_nsec) / 1e9;
+}
+
+double bench_lap(struct timespec *mark) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  double elapsed = seconds_between(mark, &now);
+  *mark = now;
+  return elapsed;
+}
+
+int compare_doubles(const void *a, const void *b) {
+  double x = *(const double *)a, y = *(const double *)b;
+  return (x > y) - (x < y);
+}
+
+double bench_percentile(const double *sorted, int runs, int pct) {
+  int rank = (pct * runs + 99) / 100;
+  return sorted[rank > 0 ? rank - 1 : 0];
+}
+
+void bench_header(void) {
+  printf("%-12s %10s %10s %10s %12s %10s\n", "stage", "p50 ms", "p90 ms",
+         "p99 ms", "Msamples/s", "realtime");
+}
+
+// One table row. samples and audio_seconds are the work done per run.
+void bench_report(const char *stage, double *seconds, int runs, double samples,
+                  double audio_seconds) {
+  qsort(seconds, runs, sizeof(double), compare_doubles);
+  double p50 = bench_percentile(seconds, runs, 50);
+  double rate = p50 > 0 ? samples / p50 / 1e6 : 0;
+  double realtime = p50 > 0 ? audio_seconds / p50 : 0;
+  printf("%-12s %10.3f %10.3f %10.3f %12.2f %9.1fx\n", stage, p50 * 1e3,
+         bench_percentile(seconds, runs, 90) * 1e3,
+         bench_percentile(seconds, runs, 99) * 1e3, rate, realtime);
+}
+
+// Times n-point real transforms into seconds[0..runs) and returns how many
+// each run did, or -1 if the plan could not be built.
+int bench_fft_size(size_t n, int runs, int warmup, double *seconds) {
+  int reps = BENCH_FFT_SAMPLES / n > 0 ? BENCH_FFT_SAMPLES / n : 1;
+  RealFFTPlan *plan = createRealFFTPlan(n);
+  size_t work = plan ? realFFTPlanWorkLength(plan) : 0;
+  size_t bins = n / 2 + 1;
+  double *buffer = malloc((n + 2 * bins + 2 * work) * sizeof(double));
+
+  if (plan == NULL || buffer == NULL) {
+    fprintf(stderr, "Error: Failed to set up a %zu-point transform.\n", n);
+    destroyRealFFTPlan(plan);
+    free(buffer);
+    return -1;
+  }
+
+  double *in = buffer;
+  SplitComplex out = {in + n, in + n + bins};
+  SplitComplex scratch = {in + n + 2 * bins, in + n + 2 * bins + work};
+  for (size_t i = 0; i < n; i++) {
+    in[i] = sin(i * 0.1) * 16384;
+  }
+
+  for (int run = -warmup; run < runs; run++) {
+    struct timespec mark;
+    clock_gettime(CLOCK_MONOTONIC, &mark);
+    for (int r = 0; r < reps; r++) {
+      executeRealFFTPlan(plan, in, out, scratch);
+    }
+    double elapsed = bench_lap(&mark);
+    if (run >= 0) {
+      seconds[run] = elapsed;
+    }
+  }
+
+  destroyRealFFTPlan(plan);
+  free(buffer);
+  return reps;
+}
+
+int bench_main(const char *filename, int runs, int warmup) {
+  size_t hopsize = 159840;
+  size_t bins = hopsize / 2 + 1;
+  RealFFTPlan *plan = createRealFFTPlan(hopsize);
+  double *seconds = calloc((size_t)BENCH_STAGES * runs, sizeof(double));
+  if (plan == NULL || seconds == NULL) {
+    fprintf(stderr, "Unable to set up the benchmark\n");
+    exit(EXIT_FAILURE);
+  }
+
+  AudioData audio_data = {0};
+  Arena arena = {0};
+  int status = 0;
+
+  for (int run = -warmup; run < runs; run++) {
+    double stages[BENCH_STAGES] = {0};
+    struct timespec start, mark;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    mark = start;
+
+    arena_reset(&arena);
+    if (extract_mp3_samples(filename, &audio_data, &arena) != 0) {
+      fprintf(stderr, "Failed to extract samples\n");
+      status = 1;
+      break;
+    }
+
+    size_t work = realFFTPlanWorkLength(plan);
+    double *in = arena_alloc(&arena, hopsize * sizeof(double));
+    SplitComplex out = {arena_alloc(&arena, bins * sizeof(double)),
+                        arena_alloc(&arena, bins * sizeof(double))};
+    SplitComplex scratch = {arena_alloc(&arena, work * sizeof(double)),
+                            arena_alloc(&arena, work * sizeof(double))};
+    double *freqArr = arena_alloc(&arena, bins * sizeof(double));
+    if (in == NULL || out.re == NULL || out.im == NULL || scratch.re == NULL ||
+        scratch.im == NULL || freqArr == NULL) {
+      fprintf(stderr, "Error: Failed to allocate FFT buffers.\n");
+      status = 1;
+      break;
+    }
+    stages[BENCH_DECODE] = bench_lap(&mark);
+
+    size_t frames = audio_data.num_samples / audio_data.channels;
+    for (size_t i = 0; i + hopsize <= frames; i += hopsize) {
+      for (size_t j = 0; j < hopsize; j++) {
+        in[j] = audio_data.samples[(i + j) * audio_data.channels];
+      }
+      stages[BENCH_CONVERT] += bench_lap(&mark);
+      executeRealFFTPlan(plan, in, out, scratch);
+      stages[BENCH_FFT] += bench_lap(&mark);
+      simd.magnitude(out.re, out.im, freqArr, bins);
+      stages[BENCH_MAGNITUDE] += bench_lap(&mark);
+    }
+    stages[BENCH_TOTAL] = seconds_between(&start, &mark);
+
+    for (int s = 0; run >= 0 && s < BENCH_STAGES; s++) {
+      seconds[(size_t)s * runs + run] = stages[s];
+    }
+  }
+
+  if (status == 0) {
+    size_t frames = audio_data.num_samples / audio_data.channels;
+    double duration = (double)frames / audio_data.sample_rate;
+    printf("Benchmark: %s, %.2f s at %ld Hz, %d channels; %d runs after %d "
+           "warmup\n",
+           filename, duration, audio_data.sample_rate, audio_data.channels,
+           runs, warmup);
+    bench_header();
+    for (int s = 0; s < BENCH_STAGES; s++) {
+      bench_report(bench_stage_names[s], seconds + (size_t)s * runs, runs,
+                   frames, duration);
+    }
+
+    printf("FFT engine: bluestein/radix-4 r2c (%s), double precision\n",
+           simd.name);
+    bench_header();
+  }
+  for (size_t i = 0;
+       status == 0 && i < sizeof(bench_rates) / sizeof(bench_rates[0]); i++) {
+    size_t n = (size_t)floor(BENCH_FRAME_SECONDS * bench_rates[i]);
+    int reps = bench_fft_size(n, runs, warmup, seconds);
+    if (reps < 0) {
+      status = 1;
+      break;
+    }
+    char stage[32];
+    snprintf(stage, sizeof(stage), "fft %zu", n);
+    bench_report(stage, seconds, runs, (double)reps * n,
+                 reps * BENCH_HOP_SECONDS);
+  }
+
+  free(seconds);
+  destroyRealFFTPlan(plan);
+  arena_destroy(&arena);
+  return status;
+}
+
 int main(int argc, char *argv[]) {
-  if (argc != 2) {
-    printf("Usage: %s <mp3_file>\n", argv[0]);
+  const char *filename = NULL;
+  int stereo = 0;
+  int mid_side = 0;
+  int bench = 0;
+  int runs = 10;
+  int warmup = 1;
+
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--stereo") == 0) {
+      stereo = 1;
+    } else if (strcmp(argv[i], "--mid-side") == 0) {
+      stereo = 1;
+      mid_side = 1;
+    } else if (strcmp(argv[i], "--bench") == 0) {
+      bench = 1;
+    } else if (strcmp(argv[i], "--runs") == 0 && i + 1 < argc) {
+      runs = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--warmup") == 0 && i + 1 < argc) {
+      warmup = atoi(argv[++i]);
+    } else if (argv[i][0] != '-' && filename == NULL) {
+      filename = argv[i];
+    } else {
+      filename = NULL;
+      break;
+    }
+  }
+  if (filename == NULL || (bench && (stereo || runs < 1 || warmup < 0))) {
+    printf("Usage: %s [--stereo|--mid-side] <mp3_file>\n", argv[0]);
+    printf("       %s --bench [--runs N] [--warmup N] <mp3_file>\n", argv[0]);
     return 1;
   }
 
+  if (bench) {
+    selectSimdKernels();
+    return bench_main(filename, runs, warmup);
+  }
+
+  struct timespec t_start, t_end;
+  double elapsed;
+
   AudioData audio_data;
+  Arena arena = {0};
 
-  if (extract_mp3_samples(argv[1], &audio_data) != 0) {
+  if (extract_mp3_samples(filename, &audio_data, &arena) != 0) {
     fprintf(stderr, "Failed to extract samples\n");
+    arena_destroy(&arena);
     return 1;
   }
 
+  printf("Sample rate: %ld Hz\n", audio_data.sample_rate);
+  printf("Channels: %d\n", audio_data.channels);
   printf("Successfully extracted %zu samples\n", audio_data.num_samples);
   printf("Duration: %.2f seconds\n", (double)audio_data.num_samples /
                                          audio_data.channels /
                                          audio_data.sample_rate);
 
+  if (stereo && audio_data.channels != 2) {
+    fprintf(stderr, "Stereo transforms need a 2-channel file; using left\n");
+    stereo = 0;
+    mid_side = 0;
+  }
+
+  // fft of the left channel every hop ~3.33s, as in hachingRewrite.c; the
+  // stereo modes get both channels out of the same single transform
+  size_t frames = audio_data.num_samples / audio_data.channels;
+  size_t hopsize = 159840;
+
+  selectSimdKernels();
+  printf("SIMD kernels: %s\n", simd.name);
+
+  RealFFTPlan *plan = NULL;
+  FFTPlan *stereoPlan = NULL;
+  size_t work;
+  if (stereo) {
+    stereoPlan = createFFTPlan(hopsize);
+    work = stereoPlan ? stereoFFTPlanWorkLength(stereoPlan) : 0;
+  } else {
+    plan = createRealFFTPlan(hopsize);
+    work = plan ? realFFTPlanWorkLength(plan) : 0;
+  }
+  if (plan == NULL && stereoPlan == NULL) {
+    fprintf(stderr, "Error: Failed to create FFT plan.\n");
+    exit(EXIT_FAILURE);
+  }
+
+  // Every array starts on its own 64-byte boundary
+  size_t bins = hopsize / 2 + 1;
+  double *in = arena_alloc(&arena, hopsize * sizeof(double));
+  SplitComplex out = {arena_alloc(&arena, bins * sizeof(double)),
+                      arena_alloc(&arena, bins * sizeof(double))};
+  SplitComplex right = {arena_alloc(&arena, bins * sizeof(double)),
+                        arena_alloc(&arena, bins * sizeof(double))};
+  SplitComplex scratch = {arena_alloc(&arena, work * sizeof(double)),
+                          arena_alloc(&arena, work * sizeof(double))};
+  double *freqArr = arena_alloc(&arena, 2 * bins * sizeof(double));
+
+  if (in == NULL || out.re == NULL || out.im == NULL || right.re == NULL ||
+      right.im == NULL || scratch.re == NULL || scratch.im == NULL ||
+      freqArr == NULL) {
+    fprintf(stderr, "Error: Failed to allocate FFT buffers.\n");
+    exit(EXIT_FAILURE);
+  }
+
+  if (clock_gettime(CLOCK_MONOTONIC, &t_start) != 0) {
+    perror("clock_gettime");
+    exit(EXIT_FAILURE);
+  }
+
+  size_t hops = 0;
+  for (size_t i = 0; i + hopsize <= frames; i += hopsize) {
+    if (stereo) {
+      executeStereoFFTPlan(stereoPlan, audio_data.samples + i * 2, out, right,
+                           scratch);
+      if (mid_side) {
+        midSideFromStereo(out, right, bins);
+      }
+      simd.magnitude(out.re, out.im, freqArr, bins);
+      simd.magnitude(right.re, right.im, freqArr + bins, bins);
+    } else {
+      for (size_t j = 0; j < hopsize; j++) {
+        in[j] = audio_data.samples[(i + j) * audio_data.channels];
+      }
+
+      executeRealFFTPlan(plan, in, out, scratch);
+      simd.magnitude(out.re, out.im, freqArr, bins);
+    }
+    hops++;
+  }
+
+  if (clock_gettime(CLOCK_MONOTONIC, &t_end) != 0) {
+    perror("clock_gettime");
+    exit(EXIT_FAILURE);
+  }
+
+  elapsed =
+      (t_end.tv_sec - t_start.tv_sec) + (t_end.tv_nsec - t_start.tv_nsec) / 1e9;
+
+  printf("Transformed %zu hops in %.6f seconds\n", hops, elapsed);
+
   // Clean up
-  free(audio_data.samples);
+  arena_destroy(&arena);
+  destroyRealFFTPlan(plan);
+  destroyFFTPlan(stereoPlan);
 
   return 0;
 }
@@ -67,7 +67,7 @@ function bluesteinFFT(input: Complex[]): Complex[] {
     B[k] = Complex.fromAngle(1, (Math.PI * k * k) / n);
   }
   for (let k = 1; k < n; k++) {
-    B[m - k] = new Complex(B[k].re, -B[k].im);
+    B[m - k] = B[k];
   }
 
   // Perform convolution using power-of-2 FFT
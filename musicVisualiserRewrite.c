@@ -0,0 +1,900 @@
+// Build: gcc -O2 musicVisualiserRewrite.c -o musicVisualiserRewrite -lmpg123 -lfftw3 -lm
+
+#include <errno.h>
+#include <fftw3.h>
+#include <math.h>
+#include <mpg123.h>
+#include <signal.h>
+#include <spawn.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+extern char **environ;
+
+typedef struct {
+  short *samples;
+  size_t num_samples;
+  long sample_rate;
+  int channels;
+} AudioData;
+
+// Opens filename on mh and locks the decoder output to signed 16-bit samples.
+// Every successful open must be paired with mpg123_close.
+int open_mp3(mpg123_handle *mh, const char *filename, long *rate,
+             int *channels) {
+  int encoding;
+
+  if (mpg123_open(mh, filename) != MPG123_OK) {
+    fprintf(stderr, "Unable to open file: %s\n", mpg123_strerror(mh));
+    return -1;
+  }
+
+  if (mpg123_getformat(mh, rate, channels, &encoding) != MPG123_OK) {
+    fprintf(stderr, "Unable to get format information\n");
+    mpg123_close(mh);
+    return -1;
+  }
+
+  mpg123_format_none(mh);
+  mpg123_format(mh, *rate, *channels, MPG123_ENC_SIGNED_16);
+
+  return 0;
+}
+
+// Decodes the whole of filename into interleaved 16-bit PCM. The visualiser
+// needs random access to the track while it plays, so unlike the fingerprint
+// tool it keeps everything resident.
+int extract_mp3_samples(mpg123_handle *mh, const char *filename,
+                        AudioData *audio_data) {
+  unsigned char *audio;
+  size_t bytes;
+  off_t num;
+  int ret;
+
+  if (open_mp3(mh, filename, &audio_data->sample_rate,
+               &audio_data->channels) != 0) {
+    return -1;
+  }
+
+  size_t frame_samples = mpg123_outblock(mh) / sizeof(short);
+  size_t capacity = audio_data->sample_rate * audio_data->channels * 2;
+  if (mpg123_scan(mh) == MPG123_OK && mpg123_length(mh) > 0) {
+    capacity = (size_t)mpg123_length(mh) * audio_data->channels;
+  }
+  capacity += frame_samples;
+
+  audio_data->num_samples = 0;
+  audio_data->samples = malloc(capacity * sizeof(short));
+  if (audio_data->samples == NULL) {
+    fprintf(stderr, "Unable to allocate sample buffer\n");
+    mpg123_close(mh);
+    return -1;
+  }
+
+  for (;;) {
+    if (capacity - audio_data->num_samples < frame_samples) {
+      capacity *= 2;
+      short *grown = realloc(audio_data->samples, capacity * sizeof(short));
+      if (grown == NULL) {
+        fprintf(stderr, "Unable to reallocate sample buffer\n");
+        free(audio_data->samples);
+        audio_data->samples = NULL;
+        mpg123_close(mh);
+        return -1;
+      }
+      audio_data->samples = grown;
+    }
+
+    short *dest = audio_data->samples + audio_data->num_samples;
+    if (mpg123_replace_buffer(mh, dest, (capacity - audio_data->num_samples) *
+                                            sizeof(short)) != MPG123_OK) {
+      ret = MPG123_ERR;
+      break;
+    }
+    do {
+      ret = mpg123_decode_frame(mh, &num, &audio, &bytes);
+    } while (ret == MPG123_NEW_FORMAT);
+    if (ret != MPG123_OK) {
+      break;
+    }
+    if (audio != (unsigned char *)dest) {
+      memmove(dest, audio, bytes);
+    }
+    audio_data->num_samples += bytes / sizeof(short);
+  }
+
+  if (ret != MPG123_DONE) {
+    fprintf(stderr, "Decoding stopped early: %s\n", mpg123_strerror(mh));
+  }
+
+  mpg123_close(mh);
+
+  return 0;
+}
+
+// Terminal renderer. Each frame is drawn into a back buffer of cells and only
+// the cells that differ from the front buffer (what the terminal is already
+// showing) are sent. Colour escapes are emitted only when the colour actually
+// changes, and the whole frame goes out in a single write(2).
+
+#define GLYPH_BAR 0x80 // drawn as U+2588 FULL BLOCK
+#define MAX_GAP_REWRITE 4 // rewrite up to this many cells instead of a move
+
+typedef enum {
+  COLOR_DEFAULT,
+  COLOR_RED,
+  COLOR_GREEN,
+  COLOR_YELLOW,
+  COLOR_MAGENTA,
+  NUM_COLORS
+} cell_color;
+
+const char *const color_codes[NUM_COLORS] = {
+    "\x1b[0m", "\x1b[31m", "\x1b[32m", "\x1b[33m", "\x1b[35m",
+};
+
+typedef struct {
+  unsigned char glyph; // ASCII, or GLYPH_BAR
+  unsigned char color;
+} Cell;
+
+typedef struct {
+  int width;
+  int height;
+  Cell *front;
+  Cell *back;
+  char *out;
+  size_t out_len;
+  size_t out_capacity;
+  int cursor_x; // where the terminal cursor is, or -1 when unknown
+  int cursor_y;
+  int color; // colour the terminal is currently set to
+  unsigned generation; // bumped on every resize
+} Renderer;
+
+volatile sig_atomic_t resize_pending = 1;
+volatile sig_atomic_t stop_requested = 0;
+
+void handle_winch(int sig) {
+  (void)sig;
+  resize_pending = 1;
+}
+
+void handle_stop(int sig) {
+  (void)sig;
+  stop_requested = 1;
+}
+
+int write_all(int fd, const char *buf, size_t len) {
+  while (len > 0) {
+    ssize_t n = write(fd, buf, len);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return -1;
+    }
+    buf += n;
+    len -= (size_t)n;
+  }
+  return 0;
+}
+
+void renderer_append(Renderer *r, const char *text) {
+  size_t len = strlen(text);
+  memcpy(r->out + r->out_len, text, len);
+  r->out_len += len;
+}
+
+void renderer_emit_glyph(Renderer *r, unsigned char glyph) {
+  if (glyph == GLYPH_BAR) {
+    memcpy(r->out + r->out_len, "\xe2\x96\x88", 3);
+    r->out_len += 3;
+  } else {
+    r->out[r->out_len++] = (char)glyph;
+  }
+}
+
+// Re-reads the terminal size and resizes both buffers. Nothing on screen can
+// be trusted afterwards, so the screen is cleared and every front cell is
+// marked invalid, which makes the next flush repaint everything.
+int renderer_resize(Renderer *r) {
+  struct winsize ws;
+  int width = 80;
+  int height = 24;
+
+  if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == 0 && ws.ws_col > 0 &&
+      ws.ws_row > 0) {
+    width = ws.ws_col;
+    height = ws.ws_row;
+  }
+
+  size_t cells = (size_t)width * height;
+  // Worst case per cell: a cursor move, a colour change and a 3-byte glyph
+  size_t capacity = cells * 24 + 64;
+
+  Cell *front = realloc(r->front, cells * sizeof(Cell));
+  if (front == NULL) {
+    return -1;
+  }
+  r->front = front;
+  Cell *back = realloc(r->back, cells * sizeof(Cell));
+  if (back == NULL) {
+    return -1;
+  }
+  r->back = back;
+  char *out = realloc(r->out, capacity);
+  if (out == NULL) {
+    return -1;
+  }
+  r->out = out;
+
+  r->width = width;
+  r->height = height;
+  r->generation++;
+  r->out_capacity = capacity;
+  memset(r->front, 0, cells * sizeof(Cell));
+
+  r->out_len = 0;
+  renderer_append(r, "\x1b[0m\x1b[2J");
+  r->cursor_x = -1;
+  r->cursor_y = -1;
+  r->color = COLOR_DEFAULT;
+
+  return 0;
+}
+
+int renderer_init(Renderer *r) {
+  memset(r, 0, sizeof(*r));
+
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = handle_winch;
+  sigaction(SIGWINCH, &sa, NULL);
+  sa.sa_handler = handle_stop;
+  sigaction(SIGINT, &sa, NULL);
+  sigaction(SIGTERM, &sa, NULL);
+
+  if (renderer_resize(r) != 0) {
+    fprintf(stderr, "Unable to allocate terminal buffers\n");
+    return -1;
+  }
+  resize_pending = 0;
+  renderer_append(r, "\x1b[?25l"); // hide cursor
+
+  return 0;
+}
+
+// Starts a frame: picks up a pending resize and blanks the back buffer.
+int renderer_begin_frame(Renderer *r) {
+  if (resize_pending) {
+    resize_pending = 0;
+    if (renderer_resize(r) != 0) {
+      fprintf(stderr, "Unable to allocate terminal buffers\n");
+      return -1;
+    }
+  }
+
+  size_t cells = (size_t)r->width * r->height;
+  for (size_t i = 0; i < cells; i++) {
+    r->back[i].glyph = ' ';
+    r->back[i].color = COLOR_DEFAULT;
+  }
+
+  return 0;
+}
+
+void renderer_put(Renderer *r, int x, int y, unsigned char glyph,
+                  cell_color color) {
+  if (x < 0 || y < 0 || x >= r->width || y >= r->height) {
+    return;
+  }
+  Cell *cell = &r->back[(size_t)y * r->width + x];
+  cell->glyph = glyph;
+  cell->color = (unsigned char)color;
+}
+
+void renderer_text(Renderer *r, int x, int y, const char *text,
+                   cell_color color) {
+  for (; *text; text++, x++) {
+    renderer_put(r, x, y, (unsigned char)*text, color);
+  }
+}
+
+// True when the unchanged cells in run can be re-sent without a colour
+// change. Spaces look the same in any foreground colour.
+int run_keeps_color(const Cell *run, int count, int color) {
+  for (int i = 0; i < count; i++) {
+    if (run[i].glyph != ' ' && run[i].color != color) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+// Sends the difference between the back and front buffers in one write.
+int renderer_flush(Renderer *r) {
+  for (int y = 0; y < r->height; y++) {
+    Cell *front = r->front + (size_t)y * r->width;
+    const Cell *back = r->back + (size_t)y * r->width;
+
+    for (int x = 0; x < r->width; x++) {
+      if (front[x].glyph == back[x].glyph &&
+          front[x].color == back[x].color) {
+        continue;
+      }
+
+      if (r->cursor_y != y || r->cursor_x != x) {
+        // A short run of unchanged cells is cheaper to re-send than a move
+        int gap = x - r->cursor_x;
+        if (r->cursor_y == y && gap > 0 && gap <= MAX_GAP_REWRITE &&
+            run_keeps_color(front + r->cursor_x, gap, r->color)) {
+          for (int i = r->cursor_x; i < x; i++) {
+            renderer_emit_glyph(r, front[i].glyph);
+          }
+        } else {
+          r->out_len += (size_t)snprintf(r->out + r->out_len,
+                                         r->out_capacity - r->out_len,
+                                         "\x1b[%d;%dH", y + 1, x + 1);
+        }
+      }
+
+      if (back[x].glyph != ' ' && back[x].color != r->color) {
+        renderer_append(r, color_codes[back[x].color]);
+        r->color = back[x].color;
+      }
+      renderer_emit_glyph(r, back[x].glyph);
+      front[x] = back[x];
+
+      // Writing the last column leaves the cursor in a pending-wrap state
+      // that terminals disagree on, so force a move next time
+      r->cursor_x = x + 1;
+      r->cursor_y = x + 1 < r->width ? y : -1;
+    }
+  }
+
+  int status = 0;
+  if (r->out_len > 0) {
+    status = write_all(STDOUT_FILENO, r->out, r->out_len);
+    r->out_len = 0;
+  }
+  return status;
+}
+
+void renderer_cleanup(Renderer *r) {
+  const char *restore = "\x1b[0m\x1b[?25h\x1b[999;1H\n";
+  write_all(STDOUT_FILENO, restore, strlen(restore));
+  free(r->front);
+  free(r->back);
+  free(r->out);
+  memset(r, 0, sizeof(*r));
+}
+
+// Spectrum analysis, matching FFT() in musicVisualiser.ts: each channel of a
+// window is scaled to [-1, 1), mean-removed and Hann-windowed, and the
+// magnitudes of the positive-frequency bins are kept. Windows slide with the
+// playback position instead of stepping through disjoint chunks, so
+// consecutive frames overlap. Both channels share one complex FFT: left is
+// the real part and right the imaginary part, and the two spectra are pulled
+// apart afterwards by conjugate symmetry.
+
+#define CHUNK_SIZE 4096
+#define DEFAULT_FPS 30
+
+typedef enum { SPECTRUM_STEREO, SPECTRUM_MID_SIDE } spectrum_mode;
+
+typedef struct {
+  int n;
+  spectrum_mode mode;
+  double *window; // Hann coefficients with the 1/32768 sample scale folded in
+  fftw_complex *in; // left window in re, right window in im
+  fftw_complex *out;
+  fftw_plan plan;
+  double *magnitudes[2]; // n / 2 bins per channel (or mid and side)
+} Spectrum;
+
+void spectrum_destroy(Spectrum *s) {
+  if (s->plan) {
+    fftw_destroy_plan(s->plan);
+  }
+  fftw_free(s->in);
+  fftw_free(s->out);
+  free(s->magnitudes[0]);
+  free(s->magnitudes[1]);
+  free(s->window);
+  memset(s, 0, sizeof(*s));
+}
+
+int spectrum_init(Spectrum *s, int n, spectrum_mode mode) {
+  memset(s, 0, sizeof(*s));
+  s->n = n;
+  s->mode = mode;
+  s->window = malloc(n * sizeof(double));
+  s->in = fftw_malloc(n * sizeof(fftw_complex));
+  s->out = fftw_malloc(n * sizeof(fftw_complex));
+  s->magnitudes[0] = malloc((n / 2) * sizeof(double));
+  s->magnitudes[1] = malloc((n / 2) * sizeof(double));
+  if (!s->window || !s->in || !s->out || !s->magnitudes[0] ||
+      !s->magnitudes[1]) {
+    fprintf(stderr, "Unable to allocate spectrum buffers\n");
+    spectrum_destroy(s);
+    return -1;
+  }
+
+  for (int i = 0; i < n; i++) {
+    s->window[i] = 0.5 * (1 - cos(2 * M_PI * i / (n - 1))) / 32768.0;
+  }
+
+  s->plan = fftw_plan_dft_1d(n, s->in, s->out, FFTW_FORWARD, FFTW_MEASURE);
+  if (s->plan == NULL) {
+    fprintf(stderr, "Unable to create FFT plan\n");
+    spectrum_destroy(s);
+    return -1;
+  }
+
+  return 0;
+}
+
+// Windows one channel of the n frames starting at frame into its part (re
+// for left, im for right) of s->in. Windowing the mean-removed signal is
+// x * w - mean * w, so the sample scale rides along in the table.
+void spectrum_load_channel(Spectrum *s, const AudioData *audio, size_t frame,
+                           int channel) {
+  const short *src = audio->samples + frame * audio->channels +
+                     (channel < audio->channels ? channel : 0);
+  int n = s->n;
+
+  long sum = 0;
+  for (int i = 0; i < n; i++) {
+    sum += src[(size_t)i * audio->channels];
+  }
+  double mean = (double)sum / n;
+
+  for (int i = 0; i < n; i++) {
+    s->in[i][channel] =
+        (src[(size_t)i * audio->channels] - mean) * s->window[i];
+  }
+}
+
+// Computes both channels' magnitudes for the window ending at end_frame.
+// The track must hold at least n frames.
+void spectrum_analyse(Spectrum *s, const AudioData *audio, size_t end_frame) {
+  size_t start = end_frame > (size_t)s->n ? end_frame - s->n : 0;
+
+  spectrum_load_channel(s, audio, start, 0);
+  spectrum_load_channel(s, audio, start, 1);
+  fftw_execute(s->plan);
+
+  // With Z = FFT(l + i r) and Y = conj(Z[n - k]):
+  //   L[k] = (Z[k] + Y) / 2,  R[k] = (Z[k] - Y) / 2i
+  // and mid/side are (L + R) / 2 and (L - R) / 2
+  const fftw_complex *z = s->out;
+  for (int k = 0; k < s->n / 2; k++) {
+    int j = k == 0 ? 0 : s->n - k;
+    double left_re = (z[k][0] + z[j][0]) / 2;
+    double left_im = (z[k][1] - z[j][1]) / 2;
+    double right_re = (z[k][1] + z[j][1]) / 2;
+    double right_im = (z[j][0] - z[k][0]) / 2;
+
+    if (s->mode == SPECTRUM_MID_SIDE) {
+      s->magnitudes[0][k] =
+          hypot(left_re + right_re, left_im + right_im) / 2;
+      s->magnitudes[1][k] =
+          hypot(left_re - right_re, left_im - right_im) / 2;
+    } else {
+      s->magnitudes[0][k] = hypot(left_re, left_im);
+      s->magnitudes[1][k] = hypot(right_re, right_im);
+    }
+  }
+}
+
+// Bar mapping. Bars are spaced evenly in log frequency, and each one shows
+// the peak of its range of bins. The ranges depend only on the terminal
+// size, so they are rebuilt when the renderer reports a resize and never
+// allocate otherwise. The 0.9 power curve from musicVisualiser.ts is
+// monotonic, so it is taken of the normalised peak rather than of every bin,
+// and through a table instead of pow().
+
+#define BAR_LOW_HZ 40.0
+#define BAR_HIGH_HZ 16000.0
+#define POWER_SCALE 0.9
+#define POWER_TABLE_SIZE 1024
+
+typedef struct {
+  unsigned generation; // renderer generation this layout was built for
+  int too_small;
+  int viz_height;
+  int left_x;
+  int right_x;
+  int bar_width;
+  int bar_pitch; // bar width plus spacing
+  int num_bars;
+  int *first_bin; // bar b covers bins [first_bin[b], first_bin[b + 1])
+  unsigned char *colors;
+  double *bars[2];
+  double power_table[POWER_TABLE_SIZE];
+} BarLayout;
+
+void bar_layout_destroy(BarLayout *layout) {
+  free(layout->first_bin);
+  free(layout->colors);
+  free(layout->bars[0]);
+  free(layout->bars[1]);
+  memset(layout, 0, sizeof(*layout));
+}
+
+void bar_layout_init(BarLayout *layout) {
+  memset(layout, 0, sizeof(*layout));
+  for (int i = 0; i < POWER_TABLE_SIZE; i++) {
+    layout->power_table[i] =
+        pow((double)i / (POWER_TABLE_SIZE - 1), POWER_SCALE);
+  }
+}
+
+cell_color bar_color(int index, int num_bars) {
+  if (index < num_bars * 0.3) {
+    return COLOR_RED;
+  }
+  if (index < num_bars * 0.6) {
+    return COLOR_YELLOW;
+  }
+  return COLOR_GREEN;
+}
+
+// Rebuilds the layout if the terminal changed size since the last frame.
+int bar_layout_update(BarLayout *layout, const Renderer *r, int n,
+                      long sample_rate) {
+  if (layout->first_bin != NULL && layout->generation == r->generation) {
+    return 0;
+  }
+  layout->generation = r->generation;
+
+  int width = r->width;
+  int height = r->height;
+  layout->too_small = width < 20 || height < 10;
+  if (layout->too_small) {
+    return 0;
+  }
+
+  const int title_height = 3;
+  const int scale_width = 5;
+  int viz_width = width - scale_width - 2 > 10 ? width - scale_width - 2 : 10;
+  int half_width = viz_width / 2;
+  layout->viz_height =
+      height - title_height - 2 > 5 ? height - title_height - 2 : 5;
+  layout->left_x = scale_width;
+  layout->right_x = scale_width + half_width;
+  layout->bar_width = width < 40 ? 1 : width < 80 ? 2 : 3;
+  layout->bar_pitch = layout->bar_width + (width < 40 ? 0 : 1);
+  layout->num_bars = half_width / layout->bar_pitch;
+  if (layout->num_bars < 1) {
+    layout->num_bars = 1;
+  }
+
+  int num_bars = layout->num_bars;
+  int *first_bin = realloc(layout->first_bin, (num_bars + 1) * sizeof(int));
+  if (first_bin == NULL) {
+    return -1;
+  }
+  layout->first_bin = first_bin;
+  unsigned char *colors = realloc(layout->colors, num_bars);
+  if (colors == NULL) {
+    return -1;
+  }
+  layout->colors = colors;
+  for (int ch = 0; ch < 2; ch++) {
+    double *bars = realloc(layout->bars[ch], num_bars * sizeof(double));
+    if (bars == NULL) {
+      return -1;
+    }
+    layout->bars[ch] = bars;
+  }
+
+  double bin_hz = (double)sample_rate / n;
+  double high = BAR_HIGH_HZ < sample_rate / 2.0 ? BAR_HIGH_HZ
+                                                : sample_rate / 2.0;
+  int max_bin = n / 2;
+  for (int b = 0; b <= num_bars; b++) {
+    double hz = BAR_LOW_HZ * pow(high / BAR_LOW_HZ, (double)b / num_bars);
+    int bin = (int)(hz / bin_hz);
+    // Every bar gets at least one bin of its own while bins last
+    if (b > 0 && bin <= first_bin[b - 1]) {
+      bin = first_bin[b - 1] + 1;
+    }
+    first_bin[b] = bin < 1 ? 1 : bin > max_bin ? max_bin : bin;
+  }
+  for (int b = 0; b < num_bars; b++) {
+    colors[b] = (unsigned char)bar_color(b, num_bars);
+  }
+
+  return 0;
+}
+
+// Largest of count non-negative values.
+double range_max(const double *values, int count) {
+  double max = 0;
+  int i = 0;
+#if defined(__x86_64__) || defined(__i386__)
+  __m128d m0 = _mm_setzero_pd();
+  __m128d m1 = _mm_setzero_pd();
+  for (; i + 4 <= count; i += 4) {
+    m0 = _mm_max_pd(m0, _mm_loadu_pd(values + i));
+    m1 = _mm_max_pd(m1, _mm_loadu_pd(values + i + 2));
+  }
+  m0 = _mm_max_pd(m0, m1);
+  max = _mm_cvtsd_f64(_mm_max_sd(m0, _mm_unpackhi_pd(m0, m0)));
+#elif defined(__aarch64__)
+  float64x2_t m0 = vdupq_n_f64(0);
+  float64x2_t m1 = vdupq_n_f64(0);
+  for (; i + 4 <= count; i += 4) {
+    m0 = vmaxq_f64(m0, vld1q_f64(values + i));
+    m1 = vmaxq_f64(m1, vld1q_f64(values + i + 2));
+  }
+  max = vmaxvq_f64(vmaxq_f64(m0, m1));
+#endif
+  for (; i < count; i++) {
+    if (values[i] > max) {
+      max = values[i];
+    }
+  }
+  return max;
+}
+
+// Peak of each bar's bins, normalised to the loudest bar and power-scaled.
+void bar_layout_fill(BarLayout *layout, const double *magnitudes, int channel) {
+  double *bars = layout->bars[channel];
+  double max = 0;
+
+  for (int b = 0; b < layout->num_bars; b++) {
+    int first = layout->first_bin[b];
+    int count = layout->first_bin[b + 1] - first;
+    bars[b] = count > 0 ? range_max(magnitudes + first, count) : 0;
+    if (bars[b] > max) {
+      max = bars[b];
+    }
+  }
+
+  double scale = max > 0 ? (POWER_TABLE_SIZE - 1) / max : 0;
+  for (int b = 0; b < layout->num_bars; b++) {
+    bars[b] = layout->power_table[(int)(bars[b] * scale + 0.5)];
+  }
+}
+
+// Mirrored stereo layout from VisualiseFreqAnimatedStereo: the left channel
+// grows from the left edge and the right channel from the right edge, both
+// towards the centre, with an amplitude scale down the left side. In mid/side
+// mode the left half shows mid and the right half side.
+void draw_stereo_spectrum(Renderer *r, BarLayout *layout, const Spectrum *s) {
+  if (layout->too_small) {
+    renderer_text(r, 0, 0, "Terminal too small!", COLOR_RED);
+    return;
+  }
+
+  const int title_height = 3;
+  int num_bars = layout->num_bars;
+  int viz_height = layout->viz_height;
+
+  bar_layout_fill(layout, s->magnitudes[0], 0);
+  bar_layout_fill(layout, s->magnitudes[1], 1);
+
+  for (int y = 0; y < viz_height; y++) {
+    double threshold = 1 - (double)y / viz_height;
+    for (int x = 0; x < num_bars; x++) {
+      int left_col = layout->left_x + x * layout->bar_pitch;
+      int right_col = layout->right_x + x * layout->bar_pitch;
+      int reversed = num_bars - 1 - x;
+
+      for (int i = 0; i < layout->bar_width; i++) {
+        if (layout->bars[0][x] >= threshold) {
+          renderer_put(r, left_col + i, title_height + y, GLYPH_BAR,
+                       layout->colors[x]);
+        }
+        if (layout->bars[1][reversed] >= threshold) {
+          renderer_put(r, right_col + i, title_height + y, GLYPH_BAR,
+                       layout->colors[reversed]);
+        }
+      }
+    }
+  }
+
+  int scale_steps = r->height < 15 ? 3 : 5;
+  for (int i = 0; i <= scale_steps; i++) {
+    char label[8];
+    snprintf(label, sizeof(label), "%.1f", 1 - (double)i / scale_steps);
+    renderer_text(r, 0, title_height + viz_height * i / scale_steps, label,
+                  COLOR_MAGENTA);
+  }
+}
+
+// Plays the track through ffplay alongside the visualiser. Returns the
+// player's pid, or -1 if it could not be started.
+pid_t start_audio_playback(const char *filename) {
+  char *const args[] = {"ffplay", "-i",       (char *)filename, "-nodisp",
+                        "-autoexit", "-v", "quiet",          NULL};
+  pid_t pid;
+
+  int err = posix_spawnp(&pid, "ffplay", NULL, NULL, args, environ);
+  if (err != 0) {
+    fprintf(stderr, "Audio playback error: %s\n", strerror(err));
+    return -1;
+  }
+  return pid;
+}
+
+void stop_audio_playback(pid_t pid) {
+  if (pid > 0) {
+    kill(pid, SIGTERM);
+    waitpid(pid, NULL, 0);
+  }
+}
+
+void timespec_add_ns(struct timespec *t, long long ns) {
+  long long total = t->tv_nsec + ns;
+  t->tv_sec += total / 1000000000LL;
+  t->tv_nsec = total % 1000000000LL;
+}
+
+long long timespec_diff_ns(const struct timespec *a, const struct timespec *b) {
+  return (a->tv_sec - b->tv_sec) * 1000000000LL + (a->tv_nsec - b->tv_nsec);
+}
+
+// ffplay opens the file and fills its output buffer before the first
+// sample is heard. This is a rough figure for that, since ffplay reports
+// no position; --latency tunes it for the machine.
+#define DEFAULT_LATENCY_MS 200
+
+// Frames are locked to the playback clock, anchored when ffplay is spawned
+// and delayed by latency_ms for its startup: frame k is due at
+// anchor + k / fps and shows the window ending at the audio position of that
+// moment. The clock is not read back from the player, so an error in
+// latency_ms shows as a constant offset between bars and sound. Sleeping to
+// absolute deadlines means render time never accumulates as drift, and a
+// late frame skips ahead to the next deadline rather than falling further
+// behind.
+int visualise(const AudioData *audio, const char *filename,
+              spectrum_mode mode, int fps, long latency_ms) {
+  Renderer renderer;
+  Spectrum spectrum;
+  BarLayout layout;
+  size_t frames = audio->num_samples / audio->channels;
+
+  if (frames < CHUNK_SIZE) {
+    fprintf(stderr, "Track is too short to visualise\n");
+    return -1;
+  }
+  if (spectrum_init(&spectrum, CHUNK_SIZE, mode) != 0) {
+    return -1;
+  }
+  if (renderer_init(&renderer) != 0) {
+    spectrum_destroy(&spectrum);
+    return -1;
+  }
+  bar_layout_init(&layout);
+
+  struct timespec anchor;
+  clock_gettime(CLOCK_MONOTONIC, &anchor);
+  pid_t player = start_audio_playback(filename);
+
+  const long long frame_ns = 1000000000LL / fps;
+  struct timespec deadline = anchor;
+  int status = 0;
+
+  while (!stop_requested) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    long long elapsed =
+        timespec_diff_ns(&now, &anchor) - latency_ms * 1000000LL;
+    if (elapsed < 0) {
+      elapsed = 0;
+    }
+    size_t position = (size_t)(elapsed / 1000 * audio->sample_rate / 1000000);
+    if (position >= frames) {
+      break;
+    }
+
+    spectrum_analyse(&spectrum, audio, position);
+
+    if (renderer_begin_frame(&renderer) != 0 ||
+        bar_layout_update(&layout, &renderer, spectrum.n,
+                          audio->sample_rate) != 0) {
+      fprintf(stderr, "Unable to lay out the spectrum\n");
+      status = -1;
+      break;
+    }
+    draw_stereo_spectrum(&renderer, &layout, &spectrum);
+    if (renderer_flush(&renderer) != 0) {
+      status = -1;
+      break;
+    }
+
+    timespec_add_ns(&deadline, frame_ns);
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    long long behind = timespec_diff_ns(&now, &deadline);
+    if (behind > 0) {
+      timespec_add_ns(&deadline, (behind / frame_ns + 1) * frame_ns);
+    }
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL) ==
+               EINTR &&
+           !stop_requested) {
+    }
+  }
+
+  stop_audio_playback(player);
+  renderer_cleanup(&renderer);
+  bar_layout_destroy(&layout);
+  spectrum_destroy(&spectrum);
+
+  return status;
+}
+
+int main(int argc, char *argv[]) {
+  const char *filename = NULL;
+  spectrum_mode mode = SPECTRUM_STEREO;
+  int fps = DEFAULT_FPS;
+  long latency_ms = DEFAULT_LATENCY_MS;
+  AudioData audio;
+
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--mid-side") == 0) {
+      mode = SPECTRUM_MID_SIDE;
+    } else if (strcmp(argv[i], "--fps") == 0 && i + 1 < argc) {
+      fps = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--latency") == 0 && i + 1 < argc) {
+      latency_ms = atol(argv[++i]);
+      if (latency_ms < 0) {
+        fps = 0;
+        break;
+      }
+    } else if (argv[i][0] != '-' && filename == NULL) {
+      filename = argv[i];
+    } else {
+      fps = 0;
+      break;
+    }
+  }
+  if (fps <= 0) {
+    printf("Usage: %s [--mid-side] [--fps N] [--latency MS] [mp3_file]\n",
+           argv[0]);
+    return 1;
+  }
+  if (filename == NULL) {
+    filename = "Lost.mp3";
+  }
+
+  if (mpg123_init() != MPG123_OK) {
+    fprintf(stderr, "Failed to initialize mpg123\n");
+    return 1;
+  }
+
+  int err;
+  mpg123_handle *mh = mpg123_new(NULL, &err);
+  if (mh == NULL) {
+    fprintf(stderr, "Unable to create mpg123 handle: %s\n",
+            mpg123_plain_strerror(err));
+    mpg123_exit();
+    return 1;
+  }
+
+  int status = extract_mp3_samples(mh, filename, &audio);
+  mpg123_delete(mh);
+  mpg123_exit();
+  if (status != 0) {
+    return 1;
+  }
+
+  status = visualise(&audio, filename, mode, fps, latency_ms);
+  free(audio.samples);
+
+  return status == 0 ? 0 : 1;
+}
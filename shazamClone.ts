@@ -58,9 +58,11 @@ async function main() {
 
       console.log("frame" + i + "inserting");
       // Each hashTag entry gets its own row
+      const window = i / HOP_SIZE;
       frameHash.hashTag.forEach((hashValue, idx) => {
-        // compute your offset (seconds or whatever unit your spec uses)
-        const offset = ((idx + 1) * frameHash.time) / 32;
+        // offset is the integer sub-fingerprint index within the song, as
+        // hachingRewrite.c stores it: every window holds the same count
+        const offset = window * frameHash.hashTag.length + idx;
         insertStmt.run(hashValue, 1, offset, (err: Error) => {
           if (err) console.error("Insert error:", err.message);
         });